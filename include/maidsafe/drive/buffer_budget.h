@@ -0,0 +1,131 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
+#define MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+#include "maidsafe/drive/config.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+// Drive-wide accounting of the memory and disk space used by the buffers of open files.  Each
+// buffer is sized from a 'Reservation' obtained from the budget, and the space is returned when
+// the reservation is destroyed.  Reservations belonging to files with no open handles can be
+// marked idle; when the budget runs short, the least recently used idle reservations are asked to
+// release their space via the functor passed to 'SetIdle'.
+class BufferBudget {
+ public:
+  typedef std::function<void()> EvictFunctor;
+
+  class Reservation {
+   public:
+    ~Reservation();
+    MemoryUsage memory() const { return memory_; }
+    DiskUsage disk() const { return disk_; }
+    // Makes this reservation a candidate for eviction.  'evict' is invoked at most once, by the
+    // thread reserving space once the budget's mutex has been released.  It may run while the
+    // reservation is being destroyed, so it must not touch the owning buffer itself; it should
+    // post the flush and destruction of the buffer to the owner's io_service.
+    void SetIdle(EvictFunctor evict);
+    // Removes this reservation from the eviction candidates.
+    void SetActive();
+
+   private:
+    friend class BufferBudget;
+    Reservation(BufferBudget& budget, MemoryUsage memory, DiskUsage disk);
+    Reservation(const Reservation&) = delete;
+    Reservation(Reservation&&) = delete;
+    Reservation& operator=(Reservation) = delete;
+
+    BufferBudget& budget_;
+    const MemoryUsage memory_;
+    const DiskUsage disk_;
+    bool idle_, evicted_;
+    EvictFunctor evict_;
+    std::list<Reservation*>::iterator idle_itr_;
+  };
+
+  BufferBudget(MemoryUsage max_memory, DiskUsage max_disk,
+               std::chrono::steady_clock::duration eviction_timeout = kBufferEvictionTimeout);
+  ~BufferBudget();
+
+  // Grants up to the requested amounts, evicting idle reservations if the budget is short.  The
+  // caller gets whatever is available, but at least 'kMinimumMemory' of memory and no less disk
+  // than memory.  Evicted space is returned asynchronously, so if even that much isn't available,
+  // waits up to the eviction timeout for evicted reservations to be destroyed.  Throws
+  // 'CommonErrors::cannot_exceed_limit' if the budget is still full and nothing more is being
+  // evicted, or the wait times out.  The amounts granted never take the budget beyond its limits.
+  // Evicting runs the owners' functors, so this must not be called holding any lock they need.
+  std::unique_ptr<Reservation> Reserve(MemoryUsage wanted_memory, DiskUsage wanted_disk);
+
+  MemoryUsage max_memory() const { return max_memory_; }
+  DiskUsage max_disk() const { return max_disk_; }
+  MemoryUsage memory_in_use() const;
+  DiskUsage disk_in_use() const;
+  size_t idle_count() const;
+
+  static const MemoryUsage kMinimumMemory;
+
+ private:
+  BufferBudget(const BufferBudget&) = delete;
+  BufferBudget(BufferBudget&&) = delete;
+  BufferBudget& operator=(BufferBudget) = delete;
+
+  void Release(Reservation* reservation);
+  // Marks idle reservations as evicted until the wanted space is projected to be available, and
+  // returns their functors for the caller to invoke once 'mutex_' has been released.
+  std::vector<EvictFunctor> EvictIdle(uint64_t wanted_memory, uint64_t wanted_disk);
+  // Grants what is available of the wanted space, or returns nullptr if the budget is full.
+  // Requires 'mutex_'.
+  std::unique_ptr<Reservation> Grant(uint64_t wanted_memory, uint64_t wanted_disk);
+
+  const MemoryUsage max_memory_;
+  const DiskUsage max_disk_;
+  const std::chrono::steady_clock::duration eviction_timeout_;
+  mutable std::mutex mutex_;
+  // Notified whenever a reservation is destroyed or an eviction is cancelled.
+  std::condition_variable space_released_;
+  uint64_t memory_in_use_, disk_in_use_;
+  // Space held by evicted reservations which have not yet been destroyed.
+  uint64_t evicting_memory_, evicting_disk_;
+  // Least recently idled at the front.
+  std::list<Reservation*> idle_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_BUFFER_BUDGET_H_
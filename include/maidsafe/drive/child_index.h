@@ -0,0 +1,104 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_CHILD_INDEX_H_
+#define MAIDSAFE_DRIVE_CHILD_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/drive/meta_data.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+struct FileContext;
+
+// A directory's children, ordered as by 'CompareCollation'.  Held in a B+ tree whose nodes are
+// never modified once built: inserting or erasing copies only the nodes on the path to the change
+// and shares the rest with the original index.  Copying an index is therefore cheap, and an index
+// can be read by any number of threads while another builds its successor.
+class ChildIndex {
+ public:
+  struct Entry {
+    Entry() : name(), context() {}
+    Entry(std::shared_ptr<const ChildName> name_in, std::shared_ptr<FileContext> context_in)
+        : name(std::move(name_in)), context(std::move(context_in)) {}
+    std::shared_ptr<const ChildName> name;
+    std::shared_ptr<FileContext> context;
+  };
+
+  class Iterator;
+
+  ChildIndex();
+  // 'entries' must be in order with no duplicate names.
+  explicit ChildIndex(std::vector<Entry> entries);
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Returns the entry with exactly this name, or null.
+  const Entry* Find(const ChildName& name) const;
+  // Returns an index with 'entry' added, replacing any entry of the same name.
+  ChildIndex Insert(Entry entry) const;
+  // Returns an index without the entry of this name, which needn't be present.
+  ChildIndex Erase(const ChildName& name) const;
+
+ private:
+  struct Node;
+  ChildIndex(std::shared_ptr<const Node> root, size_t size);
+  // Return the copy of 'node' with the change made.  An insert which overfills the copy splits it,
+  // setting 'sibling' to the second half; an erase which empties it returns null instead.
+  static std::shared_ptr<const Node> DoInsert(const Node& node, Entry entry, bool& added,
+                                              std::shared_ptr<const Node>& sibling);
+  static std::shared_ptr<const Node> DoErase(const std::shared_ptr<const Node>& node,
+                                             const ChildName& name, bool& erased);
+
+  std::shared_ptr<const Node> root_;
+  size_t size_;
+};
+
+// Visits an index's entries in order.  The index must outlive the iterator.
+class ChildIndex::Iterator {
+ public:
+  explicit Iterator(const ChildIndex& index);
+  bool AtEnd() const { return path_.empty(); }
+  const Entry& operator*() const;
+  const Entry* operator->() const { return &**this; }
+  Iterator& operator++();
+
+ private:
+  void Descend(const Node* node);
+  // The node and position at each level, root first.
+  std::vector<std::pair<const Node*, size_t>> path_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_CHILD_INDEX_H_
@@ -25,6 +25,7 @@
 #include "boost/filesystem/path.hpp"
 
 #include "maidsafe/common/identity.h"
+#include "maidsafe/common/types.h"
 
 namespace maidsafe {
 
@@ -50,6 +51,37 @@ extern const MaxVersions kMaxVersions;
 extern const std::chrono::steady_clock::duration kDirectoryInactivityDelay;
 // The delay between the last close on a file and the deletion of its buffer and encryptor.
 extern const std::chrono::steady_clock::duration kFileInactivityDelay;
+// The total memory which may be used by the buffers of all open files.  The disk budget is a tenth
+// of the free space in the user app dir.
+extern const MemoryUsage kMaxBufferMemory;
+// The number of files expected to be open at once.  Each opened file asks for this share of the
+// buffer budget, and is granted less only when the budget is under pressure.
+extern const size_t kExpectedOpenFiles;
+// How long opening a file waits for evicted idle buffers to release their space when the buffer
+// budget is full (see 'BufferBudget::Reserve').
+extern const std::chrono::steady_clock::duration kBufferEvictionTimeout;
+// Files no larger than this are stored inside their parent directory's listing rather than being
+// self-encrypted into chunks.  Zero disables inline storage.
+extern const uint32_t kMaxInlineFileSize;
+// Closed files larger than the inline limit but no larger than this are appended to a pack object
+// shared with other small files from the same directory rather than being stored as their own
+// chunks.  Zero disables packing.
+extern const uint32_t kMaxPackedFileSize;
+// A directory's pending pack is sealed, and a new one started, when adding a file would take it
+// beyond this size.
+extern const uint32_t kMaxPackSize;
+// The number of decrypted packs held in memory for reading their members.
+extern const size_t kMaxCachedPacks;
+// The number of directories held in memory.  Beyond this, the least recently used ones which can be
+// reloaded from storage are dropped (see 'Directory::CanBeEvicted').
+extern const size_t kMaxCachedDirectories;
+// The number of directory listings fetched in the background at once, and the number queued,
+// being fetched or fetched but not yet used (see 'DirectoryHandler::Prefetch').
+extern const size_t kMaxConcurrentPrefetches;
+extern const size_t kMaxPrefetchedDirectories;
+// The most missing names each directory remembers; a newer miss may evict one sooner (see
+// 'Directory::FindChild').
+extern const size_t kMaxCachedMissingNames;
 
 }  // namespace detail
 
@@ -20,24 +20,31 @@
 #define MAIDSAFE_DRIVE_DIRECTORY_H_
 
 #include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <atomic>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/asio/io_service.hpp"
 #include "boost/asio/steady_timer.hpp"
 #include "boost/filesystem/path.hpp"
 #include "boost/system/error_code.hpp"
+#include "boost/thread/shared_mutex.hpp"
 
 #include "maidsafe/common/tagged_value.h"
 #include "maidsafe/common/types.h"
 #include "maidsafe/common/data_types/immutable_data.h"
 #include "maidsafe/common/data_types/structured_data_versions.h"
 
+#include "maidsafe/drive/child_index.h"
 #include "maidsafe/drive/config.h"
 #include "maidsafe/drive/file_context.h"
+#include "maidsafe/drive/listing.h"
 
 namespace maidsafe {
 
@@ -51,6 +58,7 @@ namespace test {
 
 void DirectoriesMatch(const Directory&, const Directory&);
 void SortAndResetChildrenCounter(Directory& lhs);
+size_t DecodedChildCount(const Directory& directory);
 
 }  // namespace test
 
@@ -74,6 +82,11 @@ class Directory : public std::enable_shared_from_this<Directory> {
     virtual void DirectoryPut(std::shared_ptr<Directory>) = 0;
     virtual void DirectoryPutChunk(const ImmutableData&) = 0;
     virtual void DirectoryIncrementChunks(const std::vector<Identity>&) = 0;
+    virtual void DirectoryDecrementChunks(const std::vector<Identity>&) = 0;
+    // Self-encrypts and stores a pack object, returning its data map.
+    virtual encrypt::DataMap DirectoryPutPack(const std::string& content) = 0;
+    virtual std::string DirectoryReadPack(const encrypt::DataMap& data_map, uint64_t offset,
+                                          uint32_t size) = 0;
 
   private:
     friend class Directory;
@@ -92,6 +105,22 @@ class Directory : public std::enable_shared_from_this<Directory> {
       ScopedUnlocker<Lock> unlocker(lock);
       DirectoryIncrementChunks(names);
     }
+    template <typename Lock>
+    void DecrementChunks(const std::vector<Identity>& names, Lock& lock) {
+      ScopedUnlocker<Lock> unlocker(lock);
+      DirectoryDecrementChunks(names);
+    }
+    template <typename Lock>
+    encrypt::DataMap PutPack(const std::string& content, Lock& lock) {
+      ScopedUnlocker<Lock> unlocker(lock);
+      return DirectoryPutPack(content);
+    }
+    template <typename Lock>
+    std::string ReadPack(const encrypt::DataMap& data_map, uint64_t offset, uint32_t size,
+                         Lock& lock) {
+      ScopedUnlocker<Lock> unlocker(lock);
+      return DirectoryReadPack(data_map, offset, size);
+    }
   };
 
   // This class must always be constructed using a Create() call to ensure that it will be
@@ -107,10 +136,17 @@ class Directory : public std::enable_shared_from_this<Directory> {
 
   // This marks the start of an attempt to store the directory.  It serialises the appropriate
   // member data (critically parent_id_ must never be serialised), and sets 'store_state_' to
-  // kOngoing.  It also calls 'FlushChild' on all children (see below).
-  std::string Serialise();
-  // Stores all new chunks from 'child', increments all the other chunks, and resets child's
-  // self_encryptor & buffer.
+  // kOngoing.  It also flushes all open children (see below) and sends the reference count
+  // increments accumulated since the previous store.  The accumulated decrements are moved to
+  // 'superseded_chunks' instead: the last stored listing still references those chunks, so they
+  // must only be released once the returned listing has been stored.
+  std::string Serialise(std::vector<Identity>& superseded_chunks);
+  // Takes back the superseded chunks of a listing which couldn't be stored, so that they are
+  // released after the next store instead.
+  void RestoreSupersededChunks(const std::vector<Identity>& superseded_chunks);
+  // Stores all new chunks from 'child', decrements the chunks it no longer uses (including any
+  // popped from the buffer since the last flush), and deletes child's 'open_file'.
+  // Small closed files are instead appended to the pending pack (see 'kMaxPackedFileSize').
   void FlushChildAndDeleteEncryptor(FileContext* child);
 
   size_t VersionsCount() const;
@@ -122,11 +158,24 @@ class Directory : public std::enable_shared_from_this<Directory> {
       AddNewVersion(Identity version_id);
 
   bool HasChild(const boost::filesystem::path& name) const;
+  // Throws no_such_file if there is no such child.
   const FileContext* GetChild(const boost::filesystem::path& name) const;
+  // As 'GetChild', but returns null rather than throwing.  Names recently found to be missing are
+  // remembered until the children next change, so repeated probes for them skip the search.
+  const FileContext* FindChild(const boost::filesystem::path& name) const;
   FileContext* GetMutableChild(const boost::filesystem::path& name);
   const FileContext* GetChildAndIncrementCounter();
+  // Returns the names and ids of the child directories, in collation order.  Doesn't affect the
+  // children counter.
+  std::vector<std::pair<boost::filesystem::path, DirectoryId>> ChildDirectories() const;
   void AddChild(FileContext&& child);
+  // The returned context of a packed file holds its content in 'unpacked_content', ready to be
+  // added to a different directory.
   FileContext RemoveChild(const boost::filesystem::path& name);
+  // As 'RemoveChild', but for a child which is being discarded; its chunks are released.
+  void DeleteChild(const boost::filesystem::path& name);
+  // Releases all of a closed file child's content, leaving it empty.
+  void DiscardChildContent(FileContext* child);
   void RenameChild(const boost::filesystem::path& old_name,
                    const boost::filesystem::path& new_name);
   void ResetChildrenCounter();
@@ -137,12 +186,27 @@ class Directory : public std::enable_shared_from_this<Directory> {
   void ScheduleForStoring();
   void StoreImmediatelyIfPending();
   bool HasPending() const;
+  // Brings forward any pending store and blocks until it and any store in progress have finished,
+  // then applies a parent change set by 'SetNewParent' which no store has yet picked up.
+  void CompletePendingStores();
+  // True if nothing would be lost by dropping the directory and reloading it from storage: no store
+  // is pending or in progress, no reference count changes are waiting to be sent, and no child has
+  // unserialised changes, is open or has an encryptor.
+  bool CanBeEvicted() const;
+  // Returns up to 'size' bytes of a packed child's content, starting at 'offset'.
+  std::string ReadPackedChild(const FileContext* child, uint64_t offset, uint32_t size);
+  // Drops a child's extent once its content no longer lives in a pack.  No-op if it has none.
+  void ReleasePackExtent(FileContext* child);
 
   friend void test::DirectoriesMatch(const Directory&, const Directory&);
   friend void test::SortAndResetChildrenCounter(Directory& lhs);
+  friend size_t test::DecodedChildCount(const Directory& directory);
 
   // TODO(Fraser#5#): 2014-01-30 - BEFORE_RELEASE - Make mutex_ private.
-  mutable std::mutex mutex_;
+  // Held exclusively by anything which modifies the directory, and shared by the remaining
+  // read-only accessors other than child lookups and listing, which take no lock (see
+  // 'children_').
+  mutable boost::shared_mutex mutex_;
 
  private:
   Directory(const Directory& other) = delete;
@@ -173,24 +237,165 @@ class Directory : public std::enable_shared_from_this<Directory> {
                   std::weak_ptr<Directory::Listener> listener,
                   const boost::filesystem::path& path);
 
-  typedef std::vector<std::unique_ptr<FileContext>> Children;
+  // The listing the directory was last loaded from or stored as, read in place.  A listed child
+  // is only decoded, and given a FileContext, when first looked up, and 'Serialise' copies the
+  // entries of unchanged children from it as they are.
+  struct Listing {
+    explicit Listing(const std::string& serialised_in);
+    const std::string serialised;
+    const ListingReader reader;
+    // Each listed child's context, in listing order; null until the child is first looked up.
+    // Read with 'std::atomic_load'; only set with 'listing_mutex_' held.
+    const std::unique_ptr<std::shared_ptr<FileContext>[]> contexts;
+  };
+
+  // The children as of one change.  Never modified once published; each change publishes a new
+  // one sharing all but the changed part of 'index'.
+  struct Children {
+    Children(std::shared_ptr<const Listing> listing_in, ChildIndex index_in, size_t size_in,
+             uint64_t generation_in)
+        : listing(std::move(listing_in)), index(std::move(index_in)), size(size_in),
+          generation(generation_in) {}
+    // The children of 'listing', if any, and those added since.  An entry in 'index' overrides the
+    // listed child of the same name, removing it if the entry's context is null.
+    std::shared_ptr<const Listing> listing;
+    ChildIndex index;
+    size_t size;
+    // Incremented by every change to the children's names.
+    uint64_t generation;
+  };
+
+  // Visits the children of a 'Children' in order, merging its listing with its index.  The
+  // 'Children' must outlive the iterator.
+  class ChildIterator {
+   public:
+    explicit ChildIterator(const Children& children);
+    bool AtEnd() const { return !listed_ && entries_.AtEnd(); }
+    const boost::filesystem::path& name() const;
+    // True for a child of the listing not overridden by the index, which is at 'listing_index()'
+    // in the listing.
+    bool listed() const { return listed_; }
+    uint32_t listing_index() const { return names_->index(); }
+    // The index entry of a child which isn't 'listed()'.
+    const ChildIndex::Entry& entry() const { return *entries_; }
+    ChildIterator& operator++();
+
+   private:
+    void AdvanceName();
+    // Moves past listed children removed or replaced by the index, setting 'listed_'.
+    void Settle();
+
+    const Children& children_;
+    std::unique_ptr<ListingReader::NameIterator> names_;
+    // The listed child 'names_' is at, and its collation key, computed when first needed.
+    boost::filesystem::path listed_path_;
+    std::unique_ptr<ChildName> listed_name_;
+    ChildIndex::Iterator entries_;
+    bool listed_;
+  };
+
+  struct Pack {
+    Pack() : data_map(), content(), size(0), live_size(0) {}
+    encrypt::DataMap data_map;
+    // Holds the pack's content while it is filled, sealed and stored; empty once 'data_map' is
+    // valid.
+    std::string content;
+    uint64_t size;
+    // The total length of the extents still referring to this pack.
+    uint64_t live_size;
+  };
+
+  // Names found to be missing from the children as they were at 'generation', all in the same
+  // bucket of 'missing_names_', most recent first.
+  struct MissingNames {
+    uint64_t generation;
+    std::vector<boost::filesystem::path::string_type> names;
+  };
 
-  Children::iterator Find(const boost::filesystem::path& name);
-  Children::const_iterator Find(const boost::filesystem::path& name) const;
+  // Returns the current children.  Takes no lock.
+  std::shared_ptr<const Children> LoadChildren() const;
+  // Publishes 'index' and 'size' with the current listing, which invalidates 'missing_names_' and
+  // restarts the children counter.  'mutex_' must be held exclusively.
+  void PublishChildren(ChildIndex index, size_t size);
+  // Returns the named child, or null.  Consults and updates 'missing_names_'.  Takes no lock.
+  std::shared_ptr<FileContext> Lookup(const boost::filesystem::path& name) const;
+  // Returns the named child of 'children', or null.  Takes no lock.
+  std::shared_ptr<FileContext> FindIn(const Children& children, const ChildName& name) const;
+  // Returns the child 'child' is at.
+  std::shared_ptr<FileContext> Get(const Children& children, const ChildIterator& child) const;
+  // Returns the context of the child at 'index' in 'listing', named 'name', creating it on first
+  // use.  Takes 'listing_mutex_' only to create it.
+  std::shared_ptr<FileContext> GetListed(const Listing& listing, uint32_t index,
+                                         const boost::filesystem::path& name) const;
+  // Returns the named child of the current children, creating its context if it is listed and has
+  // none yet.  'listing_mutex_' must be held.
+  std::shared_ptr<FileContext> FindCurrentLocked(std::shared_ptr<const ChildName> name) const;
+  // Returns the contexts of all 'children' which have one.  Children not yet looked up are left
+  // undecoded.
+  static std::vector<std::shared_ptr<FileContext>> ContextsOf(const Children& children);
+  // Returns 'children.index' without the named child, which must be present.
+  static ChildIndex Without(const Children& children, std::shared_ptr<const ChildName> name);
+  // Makes 'serialised', just written from 'children', the current listing.  'contexts' holds the
+  // context of each child written, or null and its index in 'children.listing' for those without
+  // one.  'mutex_' must be held exclusively.
+  void AdoptListing(const std::string& serialised, const Children& children,
+                    const std::vector<std::pair<std::shared_ptr<FileContext>, uint32_t>>& contexts);
   void SortAndResetChildrenCounter();
+  // Loads a listing stored in the protobuf format used before the binary listing.
+  void InitialiseFromProtobuf(const std::string& serialised_directory,
+                              std::vector<ChildIndex::Entry>& children);
   void DoScheduleForStoring(bool use_delay = true);
   void ProcessTimer(const boost::system::error_code&);
+  // Applies the parent change set by 'SetNewParent', if any.  'mutex_' must be held exclusively.
+  void ApplyNewParent();
+  // Moves a closed child's content into the pending pack if it is small enough and has changed
+  // since the file was opened.  Returns false, leaving the child untouched, otherwise.
+  bool PackChild(FileContext* child);
+  // Starts a new pending pack if 'content' doesn't fit in the current one, sealing it.
+  void AppendToPendingPack(FileContext* child, const std::string& content);
+  std::string DoReadPacked(const PackExtent& extent, uint64_t offset, uint32_t size,
+                           std::unique_lock<boost::shared_mutex>& lock);
+  void DoReleasePackExtent(const PackExtent& extent);
+  // Moves the live content of the sparsest pack which is less than half used, if any, into the
+  // pending pack.
+  void Repack(std::unique_lock<boost::shared_mutex>& lock);
+  // Stores the pending pack and any packs sealed since the last store.
+  void StorePendingPacks(std::unique_lock<boost::shared_mutex>& lock);
+  // Releases all of a file child's chunks (or its pack extent) and discards any encryptor, leaving
+  // it with an empty data map.
+  void ReleaseContent(FileContext* child);
 
   ParentId parent_id_;
   DirectoryId directory_id_;
   boost::asio::steady_timer timer_;
   boost::filesystem::path path_;
   std::weak_ptr<Directory::Listener> weakListener;
+  // Reference count changes to be sent with the next store.  Each chunk holds one reference for as
+  // long as the latest version of the listing uses it.
   std::vector<Identity> chunks_to_be_incremented_;
+  std::vector<Identity> chunks_to_be_decremented_;
   std::deque<StructuredDataVersions::VersionName> versions_;
   MaxVersions max_versions_;
-  Children children_;
-  size_t children_count_position_;
+  // Loaded by readers with 'std::atomic_load' and replaced by 'PublishChildren' with
+  // 'std::atomic_store'.  Readers keep the children they loaded alive for as long as they need
+  // them, so lookups, listing and serialisation run alongside changes rather than waiting for
+  // them.  Insertion and removal are logarithmic in the number of children whatever order names
+  // arrive in.
+  std::shared_ptr<const Children> children_;
+  // Serialises creating a listed child's context with replacing the listing, so that no child is
+  // ever given two.
+  mutable std::mutex listing_mutex_;
+  // Guards the children counter: the children being listed by 'GetChildAndIncrementCounter' and
+  // the position reached in them.  Null until a listing starts.
+  std::mutex children_counter_mutex_;
+  std::shared_ptr<const Children> counted_children_;
+  std::unique_ptr<ChildIterator> children_counter_;
+  // The names most recently found to be missing, in buckets chosen by hashing the name.  A miss
+  // replaces only its bucket, evicting the bucket's oldest name once it is full.  Each bucket is
+  // read with 'std::atomic_load' and replaced with 'std::atomic_store', so lookups share them
+  // without a lock.  Names from an earlier generation of the children are ignored.  Null until the
+  // first miss.
+  mutable std::atomic<std::shared_ptr<const MissingNames>*> missing_names_;
   enum class StoreState { kPending, kOngoing, kComplete } store_state_;
   struct NewParent {
     NewParent(const ParentId& parent_id, const boost::filesystem::path& path)
@@ -200,6 +405,11 @@ class Directory : public std::enable_shared_from_this<Directory> {
   };
   std::unique_ptr<NewParent> newParent_;  // Use std::unique_ptr<> to fake an optional<>
   int pending_count_;
+  // Notified with 'mutex_' held whenever 'pending_count_' drops to zero.
+  std::condition_variable_any stores_complete_;
+  std::map<uint32_t, Pack> packs_;
+  // Pack ids start at 1; a 'pending_pack_id_' of 0 means there is no pack being filled.
+  uint32_t next_pack_id_, pending_pack_id_;
 };
 
 bool operator<(const Directory& lhs, const Directory& rhs);
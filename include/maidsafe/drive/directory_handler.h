@@ -20,12 +20,18 @@
 #define MAIDSAFE_DRIVE_DIRECTORY_HANDLER_H_
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -72,7 +78,15 @@ class DirectoryHandler
 
   void Add(const boost::filesystem::path& relative_path, FileContext&& file_context);
   std::shared_ptr<Directory> Get(const boost::filesystem::path& relative_path);
+  // As 'Get', but returns null rather than throwing if 'relative_path' doesn't name a directory.
+  // Failures to load a directory from storage still throw.
+  std::shared_ptr<Directory> Find(const boost::filesystem::path& relative_path);
   void FlushAll();
+  // Queues the listings of the cached directory's uncached child directories to be fetched in the
+  // background, so that a walk descending into them finds them ready.  Does nothing if
+  // 'relative_path' isn't cached.  A prefetched directory is only cached once it is looked up, at
+  // which point its own children are prefetched in turn.
+  void Prefetch(const boost::filesystem::path& relative_path);
   void Delete(const boost::filesystem::path& relative_path);
   void Rename(const boost::filesystem::path& old_relative_path,
               const boost::filesystem::path& new_relative_path);
@@ -81,6 +95,15 @@ class DirectoryHandler
 
   Identity root_parent_id() const { return root_parent_id_; }
 
+  struct CacheStatistics {
+    CacheStatistics() : hits(0), misses(0), evictions(0), prefetches(0), prefetch_hits(0) {}
+    // Lookups of a cached directory, directories loaded from storage, and directories dropped.
+    uint64_t hits, misses, evictions;
+    // Directories fetched in the background, and loads satisfied by one of these.
+    uint64_t prefetches, prefetch_hits;
+  };
+  CacheStatistics cache_statistics() const;
+
   friend class test::DirectoryHandlerTest;
 
  private:
@@ -102,6 +125,74 @@ class DirectoryHandler
                   bool create,
                   boost::asio::io_service& asio_service);
 
+  typedef boost::filesystem::path::string_type PathKey;
+  // The cached directories form a tree mirroring the drive, each holding its cached children by
+  // name.  Paths are resolved a component at a time from the root's parent, so no entry records its
+  // full path and renaming a directory moves a single entry, whatever is cached beneath it.
+  struct CachedDirectory {
+    CachedDirectory(std::shared_ptr<Directory> directory_in, CachedDirectory* parent_in,
+                    PathKey name_in)
+        : directory(std::move(directory_in)), parent(parent_in), name(std::move(name_in)),
+          children(), lru_itr() {}
+    std::shared_ptr<Directory> directory;
+    // Null for the root's parent.
+    CachedDirectory* parent;
+    // The entry's key in its parent's 'children'.
+    PathKey name;
+    std::unordered_map<PathKey, CachedDirectory*> children;
+    // The entry's position in 'lru_'.
+    typename std::list<CachedDirectory*>::iterator lru_itr;
+  };
+  // Owns the entries, keyed by directory id.
+  typedef std::map<DirectoryId, std::unique_ptr<CachedDirectory>> Cache;
+
+  // A child directory whose listing is queued to be, is being, or has been fetched ahead of use.
+  struct PrefetchedDirectory {
+    PrefetchedDirectory(boost::filesystem::path relative_path_in, ParentId parent_id_in,
+                        uint64_t serial_in)
+        : relative_path(std::move(relative_path_in)), parent_id(std::move(parent_id_in)),
+          serial(serial_in), directory(), fetched(false), order_itr() {}
+    boost::filesystem::path relative_path;
+    ParentId parent_id;
+    // Distinguishes this fetch from a later one of the same directory.
+    uint64_t serial;
+    // Valid once the fetch has started.
+    std::shared_future<std::shared_ptr<Directory>> directory;
+    // Once fetched, the entry's position in 'prefetched_order_'.
+    bool fetched;
+    std::list<DirectoryId>::iterator order_itr;
+  };
+  // Keyed by directory id.  An entry is dropped whenever its directory enters or leaves 'cache_',
+  // since the fetched listing may then be outdated.
+  typedef std::map<DirectoryId, PrefetchedDirectory> Prefetches;
+
+  // The following require 'cache_mutex_' to be held.
+  CachedDirectory* FindInCache(const DirectoryId& directory_id) const;
+  // Follows 'relative_path' down from the root's parent as far as it is cached, making each entry
+  // passed the most recently used.  Returns the last entry reached, leaving 'path_itr' at the first
+  // component not found.
+  CachedDirectory* FindDeepestInCache(const boost::filesystem::path& relative_path,
+                                      boost::filesystem::path::const_iterator& path_itr);
+  // Adds 'directory' as the child 'name' of 'parent' (null for the root's parent), making it the
+  // most recently used.  An entry for the same directory elsewhere is moved, and a different one
+  // already under 'name' is dropped.
+  void AddToCache(CachedDirectory* parent, const PathKey& name,
+                  std::shared_ptr<Directory> directory);
+  // Drops the entry and everything cached beneath it.
+  void EraseFromCache(CachedDirectory* entry);
+  // Moves a cached directory's entry to be the child 'new_name' of its new parent.  Does nothing if
+  // the directory isn't cached, and drops its entry if the new parent isn't.
+  void MoveInCache(const DirectoryId& directory_id, const DirectoryId& new_parent_id,
+                   const PathKey& new_name);
+  // Drops least recently used directories until the cache is within 'max_cached_directories_'.
+  // Only directories with no cached children are dropped, and never the root or its parent, nor any
+  // directory which is in use elsewhere or can't yet be reloaded from storage, so the cache may
+  // stay over the limit.
+  void EvictFromCache();
+  void ErasePrefetch(const DirectoryId& directory_id);
+  // Run by each of 'prefetchers_'.
+  void RunPrefetcher();
+
   bool IsDirectory(const FileContext& file_context) const;
   std::pair<std::shared_ptr<Directory>, FileContext*>
       GetParent(const boost::filesystem::path& relative_path);
@@ -110,7 +201,15 @@ class DirectoryHandler
                              const boost::filesystem::path& new_relative_path,
                              std::shared_ptr<Directory> new_parent);
   void Put(std::shared_ptr<Directory> directory);
-  ImmutableData SerialiseDirectory(std::shared_ptr<Directory> directory) const;
+  ImmutableData SerialiseDirectory(std::shared_ptr<Directory> directory,
+                                   std::vector<Identity>& superseded_chunks) const;
+  // Implements 'Get' and 'Find'.
+  std::shared_ptr<Directory> Resolve(const boost::filesystem::path& relative_path,
+                                     bool throw_if_missing);
+  // Returns the cached directory, or else loads it from storage and caches it as a child of its
+  // parent's entry.  Concurrent loads of the same directory share a single fetch.
+  std::shared_ptr<Directory> GetOrLoad(const boost::filesystem::path& relative_path,
+                                       const ParentId& parent_id, const DirectoryId& directory_id);
   std::shared_ptr<Directory> GetFromStorage(const boost::filesystem::path& relative_path,
       const ParentId& parent_id, const DirectoryId& directory_id);
   std::shared_ptr<Directory> ParseDirectory(
@@ -120,7 +219,7 @@ class DirectoryHandler
   void DeleteOldestVersion(Directory* directory);
   void DeleteAllVersions(Directory* directory);
   NonEmptyString GetChunkFromStore(const std::string& name) const;
-
+  std::shared_ptr<const std::string> GetPackContent(const encrypt::DataMap& data_map);
 
   std::shared_ptr<Directory::Listener> GetListener();
 
@@ -128,13 +227,41 @@ class DirectoryHandler
   virtual void DirectoryPut(std::shared_ptr<Directory>);
   virtual void DirectoryPutChunk(const ImmutableData&);
   virtual void DirectoryIncrementChunks(const std::vector<Identity>&);
+  virtual void DirectoryDecrementChunks(const std::vector<Identity>&);
+  virtual encrypt::DataMap DirectoryPutPack(const std::string& content);
+  virtual std::string DirectoryReadPack(const encrypt::DataMap& data_map, uint64_t offset,
+                                        uint32_t size);
 
   std::shared_ptr<Storage> storage_;
   Identity unique_user_id_, root_parent_id_;
   mutable detail::FileContext::Buffer disk_buffer_;
   mutable std::mutex cache_mutex_;
   boost::asio::io_service& asio_service_;
-  std::map<boost::filesystem::path, std::shared_ptr<Directory>> cache_;
+  Cache cache_;
+  // The entry for the root's parent, from which all paths are resolved.
+  CachedDirectory* root_parent_;
+  // The entries of 'cache_', most recently used first.
+  std::list<CachedDirectory*> lru_;
+  // Directories being loaded from storage, by id.
+  std::map<DirectoryId, std::shared_future<std::shared_ptr<Directory>>> loading_;
+  size_t max_cached_directories_;
+  CacheStatistics cache_statistics_;
+  Prefetches prefetches_;
+  // The ids of entries in 'prefetches_' waiting to be fetched, oldest first.  May hold ids of
+  // entries since dropped or started.
+  std::deque<DirectoryId> prefetch_queue_;
+  // The ids of fetched entries in 'prefetches_', oldest first.  These make way for new requests.
+  std::list<DirectoryId> prefetched_order_;
+  uint64_t prefetch_serial_;
+  // Waited on by 'prefetchers_' with 'cache_mutex_'.
+  std::condition_variable prefetch_condition_;
+  bool stop_prefetching_;
+  // Started on the first call to 'Prefetch'.
+  std::vector<std::thread> prefetchers_;
+  // Recently-read packs' decrypted content, most recent first, so that reading the members of a
+  // pack in turn fetches its chunks only once.
+  std::mutex pack_cache_mutex_;
+  std::deque<std::pair<std::string, std::shared_ptr<const std::string>>> pack_cache_;
 };
 
 // ==================== Implementation details ====================================================
@@ -164,7 +291,21 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
                    [](const std::string&, const NonEmptyString&) {}, disk_buffer_path, true),
       cache_mutex_(),
       asio_service_(asio_service),
-      cache_() {
+      cache_(),
+      root_parent_(nullptr),
+      lru_(),
+      loading_(),
+      max_cached_directories_(kMaxCachedDirectories),
+      cache_statistics_(),
+      prefetches_(),
+      prefetch_queue_(),
+      prefetched_order_(),
+      prefetch_serial_(0),
+      prefetch_condition_(),
+      stop_prefetching_(false),
+      prefetchers_(),
+      pack_cache_mutex_(),
+      pack_cache_() {
   if (!unique_user_id.IsInitialised())
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::uninitialised));
   if (!root_parent_id.IsInitialised())
@@ -173,6 +314,13 @@ DirectoryHandler<Storage>::DirectoryHandler(std::shared_ptr<Storage> storage,
 
 template <typename Storage>
 DirectoryHandler<Storage>::~DirectoryHandler() {
+  {  // NOLINT
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    stop_prefetching_ = true;
+  }
+  prefetch_condition_.notify_all();
+  for (auto& prefetcher : prefetchers_)
+    prefetcher.join();
   FlushAll();
 }
 
@@ -190,7 +338,8 @@ void DirectoryHandler<Storage>::Initialise(std::shared_ptr<Storage>,
                                            boost::asio::io_service&) {
   if (!create) {
     try {
-      cache_[""] = GetFromStorage("", ParentId(unique_user_id_), root_parent_id_);
+      AddToCache(nullptr, PathKey(),
+                 GetFromStorage("", ParentId(unique_user_id_), root_parent_id_));
     } catch (...) {
       create = true;
     }
@@ -213,8 +362,8 @@ void DirectoryHandler<Storage>::Initialise(std::shared_ptr<Storage>,
     root_file_context.parent = root_parent;
     root_parent->AddChild(std::move(root_file_context));
     root->ScheduleForStoring();
-    cache_[""] = std::move(root_parent);
-    cache_[kRoot] = std::move(root);
+    AddToCache(nullptr, PathKey(), std::move(root_parent));
+    AddToCache(root_parent_, kRoot.native(), std::move(root));
   }
 }
 
@@ -233,18 +382,19 @@ void DirectoryHandler<Storage>::Add(const boost::filesystem::path& relative_path
                                     GetListener(),
                                     relative_path));
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    cache_[relative_path] = std::move(directory);
+    CachedDirectory* parent_entry(FindInCache(parent.first->directory_id()));
+    if (parent_entry)
+      AddToCache(parent_entry, relative_path.filename().native(), std::move(directory));
+    EvictFromCache();
   }
 
   parent.second->meta_data.UpdateLastModifiedTime();
 
 #ifndef MAIDSAFE_WIN32
-  parent.second->meta_data.attributes.st_ctime = parent.second->meta_data.attributes.st_mtime;
-  if (IsDirectory(file_context)) {
+  if (IsDirectory(file_context))
     ++parent.second->meta_data.attributes.st_nlink;
-    parent.second->ScheduleForStoring();
-  }
 #endif
+  parent.second->ScheduleForStoring();
 
   // TODO(Fraser#5#): 2013-11-28 - Use on_scope_exit or similar to undo changes if AddChild throws.
   parent.first->AddChild(std::move(file_context));
@@ -253,50 +403,54 @@ void DirectoryHandler<Storage>::Add(const boost::filesystem::path& relative_path
 template <typename Storage>
 std::shared_ptr<Directory>
   DirectoryHandler<Storage>::Get(const boost::filesystem::path& relative_path) {
+  return Resolve(relative_path, true);
+}
+
+template <typename Storage>
+std::shared_ptr<Directory>
+  DirectoryHandler<Storage>::Find(const boost::filesystem::path& relative_path) {
+  return Resolve(relative_path, false);
+}
+
+template <typename Storage>
+std::shared_ptr<Directory> DirectoryHandler<Storage>::Resolve(
+    const boost::filesystem::path& relative_path, bool throw_if_missing) {
   SCOPED_PROFILE
   std::shared_ptr<Directory> parent;
   boost::filesystem::path antecedent;
+  auto path_itr(std::begin(relative_path));
   {  // NOLINT
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    // Try to find the exact directory
-    auto itr(cache_.find(relative_path));
-    if (itr != std::end(cache_))
-      return itr->second;
-
-    // Locate the first antecedent in cache
-    antecedent = relative_path;
-    while (itr == std::end(cache_) && !antecedent.empty()) {
-      antecedent = antecedent.parent_path();
-      itr = cache_.find(antecedent);
+    CachedDirectory* entry(FindDeepestInCache(relative_path, path_itr));
+    if (path_itr == std::end(relative_path)) {
+      ++cache_statistics_.hits;
+      return entry->directory;
     }
-    assert(itr != std::end(cache_));
-    parent = itr->second;
+    parent = entry->directory;
+    for (auto itr(std::begin(relative_path)); itr != path_itr; ++itr)
+      antecedent = itr == std::begin(relative_path) ? kRoot : (antecedent / *itr).make_preferred();
   }
 
   // Recover the decendent directories until we reach the target
   const FileContext* file_context(nullptr);
-  auto path_itr(std::begin(relative_path));
-  std::advance(path_itr, std::distance(std::begin(antecedent), std::end(antecedent)));
   while (path_itr != std::end(relative_path)) {
     if (path_itr == std::begin(relative_path)) {
-      file_context = parent->GetChild(kRoot);
+      file_context = parent->FindChild(kRoot);
       antecedent = kRoot;
     } else {
-      file_context = parent->GetChild(*path_itr);
+      file_context = parent->FindChild(*path_itr);
       antecedent = (antecedent / *path_itr).make_preferred();
     }
 
-    if (!file_context->meta_data.directory_id)
+    if (!file_context || !file_context->meta_data.directory_id) {
+      if (!throw_if_missing)
+        return nullptr;
+      if (!file_context)
+        BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
       BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_argument));
-    auto directory(GetFromStorage(antecedent, ParentId(parent->directory_id()),
-                                  *file_context->meta_data.directory_id));
-    {
-      std::lock_guard<std::mutex> lock(cache_mutex_);
-      parent = directory;
-      auto insertion_result(cache_.emplace(antecedent, std::move(directory)));
-      assert(insertion_result.second);
-      static_cast<void>(insertion_result);
     }
+    parent = GetOrLoad(antecedent, ParentId(parent->directory_id()),
+                       *file_context->meta_data.directory_id);
     ++path_itr;
   }
   return parent;
@@ -307,23 +461,65 @@ void DirectoryHandler<Storage>::FlushAll() {
   SCOPED_PROFILE
   bool error(false);
   std::lock_guard<std::mutex> lock(cache_mutex_);
-  for (auto& dir : cache_) {
-    dir.second->ResetChildrenCounter();
-    auto child(dir.second->GetChildAndIncrementCounter());
+  for (auto& entry : cache_) {
+    Directory* directory(entry.second->directory.get());
+    directory->ResetChildrenCounter();
+    auto child(directory->GetChildAndIncrementCounter());
     while (child) {
-      if (child->self_encryptor && !child->self_encryptor->Flush()) {
+      if (child->open_file && !child->open_file->self_encryptor->Flush()) {
         error = true;
-        LOG(kError) << "Failed to flush " << (dir.first / child->meta_data.name);
+        LOG(kError) << "Failed to flush " << child->meta_data.name();
       }
-      child = dir.second->GetChildAndIncrementCounter();
+      child = directory->GetChildAndIncrementCounter();
     }
-    dir.second->ResetChildrenCounter();
-    dir.second->StoreImmediatelyIfPending();
+    directory->ResetChildrenCounter();
+    directory->StoreImmediatelyIfPending();
   }
   if (error)
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
 }
 
+template <typename Storage>
+void DirectoryHandler<Storage>::Prefetch(const boost::filesystem::path& relative_path) {
+  SCOPED_PROFILE
+  std::shared_ptr<Directory> directory;
+  {  // NOLINT
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto path_itr(std::begin(relative_path));
+    CachedDirectory* entry(FindDeepestInCache(relative_path, path_itr));
+    if (path_itr != std::end(relative_path))
+      return;
+    directory = entry->directory;
+  }
+  auto child_directories(directory->ChildDirectories());
+  ParentId parent_id(directory->directory_id());
+
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if (stop_prefetching_)
+    return;
+  for (const auto& child : child_directories) {
+    if (cache_.count(child.second) != 0 || loading_.count(child.second) != 0 ||
+        prefetches_.count(child.second) != 0) {
+      continue;
+    }
+    boost::filesystem::path child_path((relative_path / child.first).make_preferred());
+    if (prefetches_.size() >= kMaxPrefetchedDirectories) {
+      // Fetched directories which haven't been used yet make way, as the walk has moved on.
+      if (prefetched_order_.empty())
+        break;
+      ErasePrefetch(prefetched_order_.front());
+    }
+    prefetches_.emplace(child.second,
+                        PrefetchedDirectory(child_path, parent_id, ++prefetch_serial_));
+    prefetch_queue_.push_back(child.second);
+  }
+  if (prefetch_queue_.empty())
+    return;
+  while (prefetchers_.size() < kMaxConcurrentPrefetches)
+    prefetchers_.emplace_back([this] { RunPrefetcher(); });
+  prefetch_condition_.notify_all();
+}
+
 template <typename Storage>
 void DirectoryHandler<Storage>::Delete(const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
@@ -337,19 +533,21 @@ void DirectoryHandler<Storage>::Delete(const boost::filesystem::path& relative_p
     DeleteAllVersions(directory.get());
     {  // NOLINT
       std::lock_guard<std::mutex> lock(cache_mutex_);
-      cache_.erase(relative_path);
+      CachedDirectory* entry(FindInCache(directory->directory_id()));
+      if (entry)
+        EraseFromCache(entry);
     }
   }
 
-  parent.first->RemoveChild(relative_path.filename());
+  parent.first->DeleteChild(relative_path.filename());
   parent.second->meta_data.UpdateLastModifiedTime();
 
 #ifndef MAIDSAFE_WIN32
-  parent.second->meta_data.attributes.st_ctime = parent.second->meta_data.attributes.st_mtime;
   if (is_directory) {
     --parent.second->meta_data.attributes.st_nlink;
   }
 #endif
+  parent.second->ScheduleForStoring();
 }
 
 template <typename Storage>
@@ -361,28 +559,146 @@ void DirectoryHandler<Storage>::Rename(const boost::filesystem::path& old_relati
   auto new_parent(Get(new_relative_path.parent_path()));
   PrepareNewPath(new_relative_path, new_parent.get());
 
-  if (old_relative_path.parent_path() == new_relative_path.parent_path())
+  if (old_relative_path.parent_path() == new_relative_path.parent_path()) {
     new_parent->RenameChild(old_relative_path.filename(), new_relative_path.filename());
-  else
+    // Anything cached beneath a renamed directory moves with its entry.
+    auto child(new_parent->GetChild(new_relative_path.filename()));
+    if (IsDirectory(*child)) {
+      std::lock_guard<std::mutex> lock(cache_mutex_);
+      MoveInCache(*child->meta_data.directory_id, new_parent->directory_id(),
+                  new_relative_path.filename().native());
+    }
+  } else {
     RenameDifferentParent(old_relative_path, new_relative_path, new_parent);
+  }
+}
 
-  if (IsDirectory(FileContext(old_relative_path, true))) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    // Fix old entry (if it's still there) and any children entries in the cache (effectively
-    // renaming the key part of each such entry).
-    auto old_path_size(old_relative_path.string().size());
-    auto itr(cache_.lower_bound(old_relative_path));
-    while (itr != std::end(cache_)) {
-      if (itr->first.string().substr(0, old_path_size) == old_relative_path.string()) {
-        boost::filesystem::path new_path(
-            new_relative_path.string() + itr->first.string().substr(old_path_size));
-        cache_.insert(std::make_pair(new_path, std::move(itr->second)));
-        itr = cache_.erase(itr);
-      } else {
-        break;
-      }
+template <typename Storage>
+typename DirectoryHandler<Storage>::CacheStatistics
+    DirectoryHandler<Storage>::cache_statistics() const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return cache_statistics_;
+}
+
+template <typename Storage>
+typename DirectoryHandler<Storage>::CachedDirectory*
+    DirectoryHandler<Storage>::FindInCache(const DirectoryId& directory_id) const {
+  auto itr(cache_.find(directory_id));
+  return itr == std::end(cache_) ? nullptr : itr->second.get();
+}
+
+template <typename Storage>
+typename DirectoryHandler<Storage>::CachedDirectory*
+    DirectoryHandler<Storage>::FindDeepestInCache(
+        const boost::filesystem::path& relative_path,
+        boost::filesystem::path::const_iterator& path_itr) {
+  assert(root_parent_);
+  CachedDirectory* entry(root_parent_);
+  path_itr = std::begin(relative_path);
+  while (path_itr != std::end(relative_path)) {
+    auto child(entry->children.find(
+        path_itr == std::begin(relative_path) ? kRoot.native() : path_itr->native()));
+    if (child == std::end(entry->children))
+      break;
+    entry = child->second;
+    ++path_itr;
+  }
+  // Mark the path as used from the leaf up, so each ancestor ends up more recent than its
+  // descendants.
+  for (CachedDirectory* used(entry); used != root_parent_; used = used->parent)
+    lru_.splice(std::begin(lru_), lru_, used->lru_itr);
+  return entry;
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::AddToCache(CachedDirectory* parent, const PathKey& name,
+                                           std::shared_ptr<Directory> directory) {
+  const DirectoryId directory_id(directory->directory_id());
+  ErasePrefetch(directory_id);
+  CachedDirectory* entry(FindInCache(directory_id));
+  if (parent) {
+    auto existing(parent->children.find(name));
+    if (existing != std::end(parent->children) && existing->second != entry) {
+      EraseFromCache(existing->second);
+      entry = FindInCache(directory_id);
     }
   }
+  if (entry) {
+    if (entry->parent)
+      entry->parent->children.erase(entry->name);
+    entry->parent = parent;
+    entry->name = name;
+    entry->directory = std::move(directory);
+    lru_.splice(std::begin(lru_), lru_, entry->lru_itr);
+  } else {
+    std::unique_ptr<CachedDirectory> new_entry(
+        new CachedDirectory(std::move(directory), parent, name));
+    entry = new_entry.get();
+    lru_.push_front(entry);
+    entry->lru_itr = std::begin(lru_);
+    cache_.emplace(directory_id, std::move(new_entry));
+  }
+  if (parent)
+    parent->children[name] = entry;
+  else
+    root_parent_ = entry;
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::EraseFromCache(CachedDirectory* entry) {
+  assert(entry != root_parent_);
+  while (!entry->children.empty())
+    EraseFromCache(std::begin(entry->children)->second);
+  if (entry->parent)
+    entry->parent->children.erase(entry->name);
+  const DirectoryId directory_id(entry->directory->directory_id());
+  ErasePrefetch(directory_id);
+  lru_.erase(entry->lru_itr);
+  cache_.erase(directory_id);
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::MoveInCache(const DirectoryId& directory_id,
+                                            const DirectoryId& new_parent_id,
+                                            const PathKey& new_name) {
+  CachedDirectory* entry(FindInCache(directory_id));
+  if (!entry)
+    return;
+  CachedDirectory* new_parent(FindInCache(new_parent_id));
+  if (new_parent)
+    AddToCache(new_parent, new_name, entry->directory);
+  else
+    EraseFromCache(entry);
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::EvictFromCache() {
+  auto lru_itr(std::end(lru_));
+  while (cache_.size() > max_cached_directories_ && lru_itr != std::begin(lru_)) {
+    --lru_itr;
+    CachedDirectory* entry(*lru_itr);
+    if (entry == root_parent_ || entry->parent == root_parent_ || !entry->children.empty())
+      continue;
+    // Holders of the directory may be about to modify it, and a store in progress holds it too.
+    if (entry->directory.use_count() != 1 || !entry->directory->CanBeEvicted())
+      continue;
+    LOG(kInfo) << "Evicting " << boost::filesystem::path(entry->name)
+               << " from the directory cache.";
+    auto next(std::next(lru_itr));
+    EraseFromCache(entry);
+    lru_itr = next;
+    ++cache_statistics_.evictions;
+  }
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::ErasePrefetch(const DirectoryId& directory_id) {
+  auto itr(prefetches_.find(directory_id));
+  if (itr == std::end(prefetches_))
+    return;
+  if (itr->second.fetched)
+    prefetched_order_.erase(itr->second.order_itr);
+  prefetches_.erase(itr);
 }
 
 template <typename Storage>
@@ -416,16 +732,18 @@ void DirectoryHandler<Storage>::PrepareNewPath(const boost::filesystem::path& ne
 #else
       auto existing_directory(Get(new_relative_path));
       if (existing_directory->empty()) {
-        new_parent->RemoveChild(new_relative_path.filename());
+        new_parent->DeleteChild(new_relative_path.filename());
         DeleteAllVersions(existing_directory.get());
         std::lock_guard<std::mutex> lock(cache_mutex_);
-        cache_.erase(new_relative_path);
+        CachedDirectory* entry(FindInCache(existing_directory->directory_id()));
+        if (entry)
+          EraseFromCache(entry);
       } else {
         BOOST_THROW_EXCEPTION(MakeError(DriveErrors::file_exists));
       }
 #endif
     } else {
-      new_parent->RemoveChild(new_relative_path.filename());
+      new_parent->DeleteChild(new_relative_path.filename());
     }
   }
   catch (const drive_error& error) {
@@ -453,29 +771,26 @@ void DirectoryHandler<Storage>::RenameDifferentParent(
   if (IsDirectory(file_context)) {
     auto directory(Get(old_relative_path));
     DeleteAllVersions(directory.get());
+    directory->SetNewParent(ParentId(new_parent->directory_id()), new_relative_path);
     {
       std::lock_guard<std::mutex> lock(cache_mutex_);
-      auto itr(cache_.find(old_relative_path));
-      assert(itr != std::end(cache_));
-      std::shared_ptr<Directory> temp = itr->second;
-      temp->SetNewParent(ParentId(new_parent->directory_id()), new_relative_path);
-      while (directory->HasPending()) {
-          std::this_thread::sleep_for(std::chrono::milliseconds(250));
-      }
-      cache_.erase(itr);
-      auto insertion_result(cache_.emplace(new_relative_path, temp));
-      assert(insertion_result.second);
-      directory = insertion_result.first->second;
+      // Anything cached beneath the directory moves with its entry.
+      MoveInCache(directory->directory_id(), new_parent->directory_id(),
+                  new_relative_path.filename().native());
     }
+    // Stores already scheduled finish under the old parent before the directory is stored under
+    // the new one.  Only this directory is waited on; the cache remains available meanwhile.
+    directory->CompletePendingStores();
     directory->ScheduleForStoring();
   }
 
-  file_context.meta_data.name = new_relative_path.filename();
+  file_context.meta_data.SetName(new_relative_path.filename());
   file_context.parent = new_parent;
   new_parent->AddChild(std::move(file_context));
 
 #ifdef MAIDSAFE_WIN32
   GetSystemTimeAsFileTime(&old_parent.second->meta_data.last_write_time);
+  old_parent.second->ScheduleForStoring();
   // if (new_relative_path.parent_path() != old_relative_path.parent_path().parent_path()) {
   //   try {
   //     if (old_grandparent.listing)
@@ -498,7 +813,13 @@ void DirectoryHandler<Storage>::RenameDifferentParent(
 
 template <typename Storage>
 void DirectoryHandler<Storage>::Put(std::shared_ptr<Directory> directory) {
-  ImmutableData encrypted_data_map(SerialiseDirectory(directory));
+  // Until the new version is stored, the last stored listing still references these chunks.
+  std::vector<Identity> superseded_chunks;
+  on_scope_exit restore_superseded_chunks([&] {
+    if (!superseded_chunks.empty())
+      directory->RestoreSupersededChunks(superseded_chunks);
+  });
+  ImmutableData encrypted_data_map(SerialiseDirectory(directory, superseded_chunks));
   storage_->Put(encrypted_data_map);
   if (directory->VersionsCount() == 0) {
     auto result(directory->InitialiseVersions(encrypted_data_map.name()));
@@ -509,14 +830,18 @@ void DirectoryHandler<Storage>::Put(std::shared_ptr<Directory> directory) {
   } else {
     auto result(directory->AddNewVersion(encrypted_data_map.name()));
     MutableData::Name hash_directory_id(crypto::Hash<crypto::SHA512>(std::get<0>(result)));
-    storage_->PutVersion(hash_directory_id, std::get<1>(result), std::get<2>(result));
+    storage_->PutVersion(hash_directory_id, std::get<1>(result), std::get<2>(result)).get();
   }
+  restore_superseded_chunks.Release();
+  if (!superseded_chunks.empty())
+    storage_->DecrementReferenceCount(superseded_chunks);
 }
 
 template <typename Storage>
 ImmutableData
-DirectoryHandler<Storage>::SerialiseDirectory(std::shared_ptr<Directory> directory) const {
-  std::string serialised_directory(directory->Serialise());
+DirectoryHandler<Storage>::SerialiseDirectory(std::shared_ptr<Directory> directory,
+                                              std::vector<Identity>& superseded_chunks) const {
+  std::string serialised_directory(directory->Serialise(superseded_chunks));
   encrypt::DataMap data_map;
   {
     encrypt::SelfEncryptor self_encryptor(data_map,
@@ -541,6 +866,125 @@ DirectoryHandler<Storage>::SerialiseDirectory(std::shared_ptr<Directory> directo
   return ImmutableData(encrypted_data_map_contents);
 }
 
+template <typename Storage>
+std::shared_ptr<Directory> DirectoryHandler<Storage>::GetOrLoad(
+    const boost::filesystem::path& relative_path, const ParentId& parent_id,
+    const DirectoryId& directory_id) {
+  std::promise<std::shared_ptr<Directory>> promise;
+  std::shared_future<std::shared_ptr<Directory>> prefetched;
+  {
+    std::unique_lock<std::mutex> lock(cache_mutex_);
+    // Another thread may have loaded the directory since the caller looked.
+    CachedDirectory* entry(FindInCache(directory_id));
+    if (entry) {
+      ++cache_statistics_.hits;
+      CachedDirectory* parent_entry(FindInCache(parent_id.data));
+      if (parent_entry)
+        AddToCache(parent_entry, relative_path.filename().native(), entry->directory);
+      return entry->directory;
+    }
+    auto loading_itr(loading_.find(directory_id));
+    if (loading_itr != std::end(loading_)) {
+      auto future(loading_itr->second);
+      lock.unlock();
+      return future.get();
+    }
+    loading_.emplace(directory_id, promise.get_future().share());
+    // A prefetch which has started is taken over; one still queued is superseded by this load.
+    auto prefetch_itr(prefetches_.find(directory_id));
+    if (prefetch_itr != std::end(prefetches_)) {
+      if (prefetch_itr->second.parent_id == parent_id)
+        prefetched = prefetch_itr->second.directory;
+      ErasePrefetch(directory_id);
+    }
+  }
+
+  std::shared_ptr<Directory> directory;
+  if (prefetched.valid()) {
+    try {
+      directory = prefetched.get();
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Prefetch of " << relative_path << " failed: " << e.what();
+    }
+  }
+  const bool was_prefetched(directory != nullptr);
+  try {
+    if (!was_prefetched)
+      directory = GetFromStorage(relative_path, parent_id, directory_id);
+  }
+  catch (...) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    loading_.erase(directory_id);
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+  {  // NOLINT
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (was_prefetched)
+      ++cache_statistics_.prefetch_hits;
+    else
+      ++cache_statistics_.misses;
+    loading_.erase(directory_id);
+    // The parent is normally held by the caller, but may have been deleted meanwhile.
+    CachedDirectory* parent_entry(FindInCache(parent_id.data));
+    if (parent_entry)
+      AddToCache(parent_entry, relative_path.filename().native(), directory);
+    EvictFromCache();
+  }
+  promise.set_value(directory);
+  // Descending into a prefetched directory suggests a walk of the tree, so look one level ahead.
+  if (was_prefetched)
+    Prefetch(relative_path);
+  return directory;
+}
+
+template <typename Storage>
+void DirectoryHandler<Storage>::RunPrefetcher() {
+  std::unique_lock<std::mutex> lock(cache_mutex_);
+  for (;;) {
+    prefetch_condition_.wait(lock, [this] {
+      return stop_prefetching_ || !prefetch_queue_.empty();
+    });
+    if (stop_prefetching_)
+      return;
+    DirectoryId directory_id(prefetch_queue_.front());
+    prefetch_queue_.pop_front();
+    auto itr(prefetches_.find(directory_id));
+    if (itr == std::end(prefetches_) || itr->second.directory.valid())
+      continue;
+    std::promise<std::shared_ptr<Directory>> promise;
+    itr->second.directory = promise.get_future().share();
+    const uint64_t serial(itr->second.serial);
+    const boost::filesystem::path relative_path(itr->second.relative_path);
+    const ParentId parent_id(itr->second.parent_id);
+    lock.unlock();
+
+    bool fetched(false);
+    try {
+      promise.set_value(GetFromStorage(relative_path, parent_id, directory_id));
+      fetched = true;
+    }
+    catch (const std::exception& e) {
+      LOG(kWarning) << "Failed to prefetch " << relative_path << ": " << e.what();
+      promise.set_exception(std::current_exception());
+    }
+
+    lock.lock();
+    // The entry may have been taken over or dropped meanwhile.
+    itr = prefetches_.find(directory_id);
+    if (itr == std::end(prefetches_) || itr->second.serial != serial)
+      continue;
+    if (!fetched) {
+      prefetches_.erase(itr);
+      continue;
+    }
+    ++cache_statistics_.prefetches;
+    itr->second.fetched = true;
+    itr->second.order_itr = prefetched_order_.insert(std::end(prefetched_order_), directory_id);
+  }
+}
+
 template <typename Storage>
 std::shared_ptr<Directory> DirectoryHandler<Storage>::GetFromStorage(
     const boost::filesystem::path& relative_path, const ParentId& parent_id,
@@ -554,10 +998,14 @@ std::shared_ptr<Directory> DirectoryHandler<Storage>::GetFromStorage(
     //                  one to keep)
     version_tip_of_trees.resize(1);
   }
-  auto versions(storage_->GetBranch(hash_directory_id, version_tip_of_trees.front()).get());
-  assert(!versions.empty());
+  // The tip is the newest version in the branch, so its data map is fetched alongside the branch
+  // rather than after it.
+  auto versions_future(storage_->GetBranch(hash_directory_id, version_tip_of_trees.front()));
+  auto encrypted_data_map_future(storage_->Get(version_tip_of_trees.front().id));
+  auto versions(versions_future.get());
+  assert(!versions.empty() && versions.front().id == version_tip_of_trees.front().id);
   try {
-    ImmutableData encrypted_data_map(storage_->Get(versions.front().id).get());
+    ImmutableData encrypted_data_map(encrypted_data_map_future.get());
     return ParseDirectory(relative_path, encrypted_data_map, parent_id, directory_id,
                           std::move(versions));
   }
@@ -619,16 +1067,13 @@ void DirectoryHandler<Storage>::HandleDataPoppedFromBuffer(
     const NonEmptyString& content) const {
   // NOTE, This will be executed on a different thread to the one writing to the encryptor which has
   // triggered this call.  We therefore can't safely access any non-threadsafe class members here.
-  LOG(kWarning) << "Chunk " << HexSubstr(name) << " has been popped from the buffer for "
-                << relative_path;
-  // TODO(Fraser#5#): 2013-11-27 - Handle mutex-protecting the file_contexts, so we can log that
-  // we're storing this chunk to the network.  If it's only a temporary chunk (i.e. it's not still
-  // listed in the datamap when we get the next flush/close call), we should delete it from the
-  // network again.
+  // The caller records the chunk in the file's 'PoppedChunks' once this returns, so that the next
+  // flush doesn't store it again, or decrements it if it has been superseded by then.
+  LOG(kInfo) << "Chunk " << HexSubstr(name) << " has been popped from the buffer for "
+             << relative_path << " - storing it now.";
   ImmutableData data(content);
   assert(data.name()->string() == name);
-//  storage_->Put(data);
-  BOOST_THROW_EXCEPTION(MakeError(CommonErrors::file_too_large));
+  storage_->Put(data);
 }
 
 template <typename Storage>
@@ -659,6 +1104,88 @@ void DirectoryHandler<Storage>::DirectoryIncrementChunks(
   storage_->IncrementReferenceCount(names);
 }
 
+template <typename Storage>
+void DirectoryHandler<Storage>::DirectoryDecrementChunks(
+  const std::vector<Identity>& names) {
+  storage_->DecrementReferenceCount(names);
+}
+
+template <typename Storage>
+encrypt::DataMap DirectoryHandler<Storage>::DirectoryPutPack(const std::string& content) {
+  encrypt::DataMap data_map;
+  {
+    encrypt::SelfEncryptor self_encryptor(data_map,
+                                          disk_buffer_,
+                                          std::bind(&DirectoryHandler<Storage>::GetChunkFromStore,
+                                                    this->shared_from_this(),
+                                                    std::placeholders::_1));
+    on_scope_exit close_encryptor([&self_encryptor]() { self_encryptor.Close(); });
+    assert(content.size() <= std::numeric_limits<uint32_t>::max());
+    if (!self_encryptor.Write(content.c_str(), static_cast<uint32_t>(content.size()), 0))
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_argument));
+  }
+  for (const auto& chunk : data_map.chunks) {
+    auto chunk_content(disk_buffer_.Get(std::string(std::begin(chunk.hash), std::end(chunk.hash))));
+    storage_->Put(ImmutableData(chunk_content));
+  }
+  return data_map;
+}
+
+template <typename Storage>
+std::string DirectoryHandler<Storage>::DirectoryReadPack(const encrypt::DataMap& data_map,
+                                                         uint64_t offset, uint32_t size) {
+  auto content(GetPackContent(data_map));
+  if (offset >= content->size())
+    return std::string();
+  return content->substr(static_cast<size_t>(offset), size);
+}
+
+template <typename Storage>
+std::shared_ptr<const std::string> DirectoryHandler<Storage>::GetPackContent(
+    const encrypt::DataMap& data_map) {
+  // A pack's first chunk identifies it; packs small enough to have no chunks are held in full in
+  // their data map and are cheap to decrypt.
+  std::string key(data_map.chunks.empty() ? std::string() :
+                  std::string(std::begin(data_map.chunks.front().hash),
+                              std::end(data_map.chunks.front().hash)));
+  if (!key.empty()) {
+    std::lock_guard<std::mutex> lock(pack_cache_mutex_);
+    auto itr(std::find_if(std::begin(pack_cache_), std::end(pack_cache_),
+                          [&key](const decltype(pack_cache_)::value_type& entry) {
+                            return entry.first == key;
+                          }));
+    if (itr != std::end(pack_cache_)) {
+      auto content(itr->second);
+      pack_cache_.erase(itr);
+      pack_cache_.emplace_front(key, content);
+      return content;
+    }
+  }
+
+  encrypt::DataMap pack_data_map(data_map);
+  auto content(std::make_shared<std::string>(static_cast<size_t>(pack_data_map.size()), 0));
+  {
+    encrypt::SelfEncryptor self_encryptor(pack_data_map,
+                                          disk_buffer_,
+                                          std::bind(&DirectoryHandler<Storage>::GetChunkFromStore,
+                                                    this->shared_from_this(),
+                                                    std::placeholders::_1));
+    on_scope_exit close_encryptor([&self_encryptor]() { self_encryptor.Close(); });
+    if (!content->empty() &&
+        !self_encryptor.Read(&(*content)[0], static_cast<uint32_t>(content->size()), 0)) {
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+    }
+  }
+
+  if (!key.empty()) {
+    std::lock_guard<std::mutex> lock(pack_cache_mutex_);
+    pack_cache_.emplace_front(key, content);
+    if (pack_cache_.size() > kMaxCachedPacks)
+      pack_cache_.pop_back();
+  }
+  return content;
+}
+
 }  // namespace detail
 
 }  // namespace drive
@@ -20,6 +20,7 @@
 #define MAIDSAFE_DRIVE_DRIVE_H_
 
 #include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <functional>
@@ -39,6 +40,7 @@
 #include "maidsafe/common/rsa.h"
 #include "maidsafe/common/utils.h"
 
+#include "maidsafe/drive/buffer_budget.h"
 #include "maidsafe/drive/config.h"
 #include "maidsafe/drive/meta_data.h"
 #include "maidsafe/drive/directory_handler.h"
@@ -66,6 +68,8 @@ class Drive {
   virtual void Unmount() = 0;
 
   const detail::FileContext* GetContext(const boost::filesystem::path& relative_path);
+  // As 'GetContext', but returns null rather than throwing if there is no such file or directory.
+  const detail::FileContext* FindContext(const boost::filesystem::path& relative_path);
   detail::FileContext* GetMutableContext(const boost::filesystem::path& relative_path);
   void Create(const boost::filesystem::path& relative_path, detail::FileContext&& file_context);
   void Open(const boost::filesystem::path& relative_path);
@@ -79,6 +83,19 @@ class Drive {
                 uint64_t offset);
   uint32_t Write(const boost::filesystem::path& relative_path, const char* data, uint32_t size,
                  uint64_t offset);
+  // Returns the truncated file's context, so callers can adjust its attributes further.
+  detail::FileContext* Truncate(const boost::filesystem::path& relative_path, uint64_t size);
+  // Preallocation only affects the logical size (unless 'keep_size' is set, when it's a no-op);
+  // the new range reads as zeros without any chunks being created.  Writing zeros into the range
+  // later (or into a punched hole) is skipped, but writing other data beyond the end of the content
+  // still makes the encryptor encrypt the zeros between the two, so they are stored like any other
+  // data.
+  void Allocate(const boost::filesystem::path& relative_path, uint64_t offset, uint64_t length,
+                bool keep_size);
+  // Never changes the logical size.  A hole reaching the end of the encrypted content discards
+  // that content and its chunks.  An interior hole is recorded in the file's hole map and reads as
+  // zeros, but the chunks beneath it remain referenced, so it saves no storage.
+  void PunchHole(const boost::filesystem::path& relative_path, uint64_t offset, uint64_t length);
 
   std::shared_ptr<Storage> storage_;
   const boost::filesystem::path kMountDir_;
@@ -91,11 +108,42 @@ class Drive {
 
  private:
   typedef detail::FileContext::Buffer Buffer;
+  typedef std::unique_ptr<detail::BufferBudget::Reservation> BufferReservation;
+  // Reserves space for the buffer of a file which has no encryptor, or returns nullptr if it has
+  // one.  Reserving may wait for idle buffers to be evicted, and evicting a buffer takes its
+  // parent's mutex, so this is called before taking a directory's mutex and the result passed to
+  // 'InitialiseEncryptor'.
+  BufferReservation ReserveBuffer(const detail::FileContext& file_context);
+  // Reactivates the file's encryptor or creates one using 'reservation'.  If the encryptor was
+  // deleted since 'reservation' was requested, space is reserved here instead.
   void InitialiseEncryptor(const boost::filesystem::path& relative_path,
-                           detail::FileContext& file_context);
-  void ScheduleDeletionOfEncryptor(detail::FileContext* file_context);
+                           detail::FileContext& file_context, BufferReservation reservation);
+  // 'open_file' must be 'file_context's.  Requires the parent's mutex, except when called by the
+  // thread which has just released the file's last handle.
+  void ScheduleDeletionOfEncryptor(
+      detail::FileContext* file_context, detail::OpenFile& open_file,
+      std::chrono::steady_clock::duration delay = detail::kFileInactivityDelay);
+  // Schedules deletion of the encryptor of a file which has no open handles, and marks its buffer
+  // as evictable.
+  void ReleaseEncryptor(detail::FileContext* file_context);
+  // Moves an inline file's content into a newly-initialised encryptor.  Requires the parent's
+  // mutex.
+  void PromoteInlineContent(const boost::filesystem::path& relative_path,
+                            detail::FileContext& file_context, BufferReservation reservation);
+  // Moves a packed file's content into a newly-initialised encryptor and releases its extent.
+  // Must be called without the parent's mutex held.
+  void PromotePackedContent(const boost::filesystem::path& relative_path,
+                            detail::Directory& parent, detail::FileContext& file_context);
+  // The size of the file's stored or buffered content, which may be less than its logical size.
+  uint64_t ContentSize(const detail::FileContext& file_context) const;
+  // Discards any encrypted content beyond 'size' without touching the logical size.
+  void TruncateContent(const boost::filesystem::path& relative_path, detail::Directory& parent,
+                       detail::FileContext* file_context, uint64_t size);
 
   std::function<NonEmptyString(const std::string&)> get_chunk_from_store_;
+  // Shared by all open files' buffers.  Must outlive 'directory_handler_'.
+  detail::BufferBudget buffer_budget_;
+  // The amounts requested from 'buffer_budget_' for each opened file.
   MemoryUsage default_max_buffer_memory_;
   DiskUsage default_max_buffer_disk_;
 
@@ -129,10 +177,14 @@ Drive<Storage>::Drive(std::shared_ptr<Storage> storage, const Identity& unique_u
       mount_promise_(),
       unmounted_once_flag_(),
       get_chunk_from_store_(),
-      // TODO(Fraser#5#): 2013-11-27 - BEFORE_RELEASE - confirm the following 2 variables.
-      default_max_buffer_memory_(Concurrency() * 1024 * 1024),  // cores * default chunk size
-      default_max_buffer_disk_(static_cast<uint64_t>(
-          boost::filesystem::space(kUserAppDir_).available / 10)),
+      buffer_budget_(detail::kMaxBufferMemory, DiskUsage(std::max(
+          static_cast<uint64_t>(boost::filesystem::space(kUserAppDir_).available / 10),
+          detail::kMaxBufferMemory.data))),
+      default_max_buffer_memory_(std::max(buffer_budget_.max_memory().data /
+                                          detail::kExpectedOpenFiles,
+                                          detail::BufferBudget::kMinimumMemory.data)),
+      default_max_buffer_disk_(std::max(buffer_budget_.max_disk().data / detail::kExpectedOpenFiles,
+                                        default_max_buffer_memory_.data)),
       asio_service_(2) {
     directory_handler_ = detail::DirectoryHandler<Storage>::Create
         (storage, unique_user_id, root_parent_id,
@@ -165,52 +217,110 @@ boost::future<void> Drive<Storage>::GetMountFuture() {
   return mount_promise_.get_future();
 }
 
+template <typename Storage>
+typename Drive<Storage>::BufferReservation Drive<Storage>::ReserveBuffer(
+    const detail::FileContext& file_context) {
+  if (file_context.open_file)
+    return nullptr;
+  return buffer_budget_.Reserve(default_max_buffer_memory_, default_max_buffer_disk_);
+}
+
 template <typename Storage>
 void Drive<Storage>::InitialiseEncryptor(const boost::filesystem::path& relative_path,
-                                         detail::FileContext& file_context) {
-  assert(*file_context.open_count == 0 || *file_context.open_count == 1);
-  if (!file_context.timer) {
-    file_context.timer.reset(new boost::asio::steady_timer(asio_service_.service()));
-  } else if (file_context.timer->cancel() > 0) {
-    // Encryptor and buffer were about to to be deleted
-    assert(file_context.buffer && file_context.self_encryptor);
-    return;
-  } else if (file_context.buffer || file_context.self_encryptor) {
-    assert(file_context.buffer && file_context.self_encryptor);
+                                         detail::FileContext& file_context,
+                                         BufferReservation reservation) {
+  assert(file_context.open_count == 0 || file_context.open_count == 1 ||
+         file_context.meta_data.inline_content || file_context.meta_data.pack_extent);
+  if (file_context.open_file) {
+    // Encryptor and buffer may have been about to be deleted
+    assert(file_context.open_file->buffer && file_context.open_file->self_encryptor &&
+           file_context.open_file->buffer_reservation);
+    file_context.open_file->timer.cancel();
+    file_context.open_file->buffer_reservation->SetActive();
     return;
   }
-  auto buffer_pop_functor([this, relative_path](const std::string& name,
-                                                const NonEmptyString& content) {
+  std::unique_ptr<detail::OpenFile> open_file(new detail::OpenFile(asio_service_.service()));
+  open_file->popped_chunks = std::make_shared<detail::PoppedChunks>();
+  auto popped_chunks(open_file->popped_chunks);
+  auto buffer_pop_functor([this, relative_path, popped_chunks](const std::string& name,
+                                                               const NonEmptyString& content) {
     directory_handler_->HandleDataPoppedFromBuffer(relative_path, name, content);
+    popped_chunks->Add(name);
   });
   auto disk_buffer_path(boost::filesystem::unique_path(*kBufferRoot_ / "%%%%%-%%%%%-%%%%%-%%%%%"));
-  file_context.buffer.reset(new detail::FileContext::Buffer(default_max_buffer_memory_,
-      default_max_buffer_disk_, buffer_pop_functor, disk_buffer_path, true));
-  file_context.self_encryptor.reset(new encrypt::SelfEncryptor(*file_context.meta_data.data_map,
-      *file_context.buffer, get_chunk_from_store_));
+  open_file->buffer_reservation = reservation ? std::move(reservation) :
+                                  ReserveBuffer(file_context);
+  open_file->buffer.reset(new Buffer(open_file->buffer_reservation->memory(),
+                                     open_file->buffer_reservation->disk(), buffer_pop_functor,
+                                     disk_buffer_path, true));
+  open_file->self_encryptor.reset(new encrypt::SelfEncryptor(*file_context.meta_data.data_map,
+      *open_file->buffer, get_chunk_from_store_));
+  file_context.open_file = std::move(open_file);
+}
+
+template <typename Storage>
+void Drive<Storage>::PromoteInlineContent(const boost::filesystem::path& relative_path,
+                                          detail::FileContext& file_context,
+                                          BufferReservation reservation) {
+  assert(file_context.meta_data.inline_content && file_context.meta_data.data_map &&
+         file_context.meta_data.data_map->chunks.empty());
+  LOG(kInfo) << "Moving " << relative_path << " out of its parent listing.";
+  InitialiseEncryptor(relative_path, file_context, std::move(reservation));
+  const std::string& content(*file_context.meta_data.inline_content);
+  if (!content.empty() && !file_context.open_file->self_encryptor->Write(
+          content.data(), static_cast<uint32_t>(content.size()), 0)) {
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+  }
+  file_context.meta_data.inline_content.reset();
 }
 
 template <typename Storage>
-void Drive<Storage>::ScheduleDeletionOfEncryptor(detail::FileContext* file_context) {
-  auto cancelled_count(file_context->timer->expires_from_now(detail::kFileInactivityDelay));
+void Drive<Storage>::PromotePackedContent(const boost::filesystem::path& relative_path,
+                                          detail::Directory& parent,
+                                          detail::FileContext& file_context) {
+  assert(file_context.meta_data.pack_extent);
+  LOG(kInfo) << "Moving " << relative_path << " out of its pack.";
+  std::string content(parent.ReadPackedChild(
+      &file_context, 0, static_cast<uint32_t>(file_context.meta_data.pack_extent->length)));
+  auto reservation(ReserveBuffer(file_context));
+  {
+    std::lock_guard<boost::shared_mutex> lock(parent.mutex_);
+    // A concurrent write may already have promoted the file.
+    if (!file_context.open_file) {
+      InitialiseEncryptor(relative_path, file_context, std::move(reservation));
+      if (!file_context.open_file->self_encryptor->Write(content.data(),
+                                                         static_cast<uint32_t>(content.size()),
+                                                         0)) {
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+      }
+    }
+  }
+  parent.ReleasePackExtent(&file_context);
+}
+
+template <typename Storage>
+void Drive<Storage>::ScheduleDeletionOfEncryptor(detail::FileContext* file_context,
+                                                 detail::OpenFile& open_file,
+                                                 std::chrono::steady_clock::duration delay) {
+  auto cancelled_count(open_file.timer.expires_from_now(delay));
 #ifndef NDEBUG
   if (cancelled_count > 0) {
     LOG(kInfo) << "Successfully cancelled " << cancelled_count << " encryptor deletion.";
     assert(cancelled_count == 1);
   }
-  auto name(file_context->meta_data.name);
+  auto name(file_context->meta_data.name());
 #endif
   static_cast<void>(cancelled_count);
-  file_context->timer->async_wait([=](const boost::system::error_code& ec) {
+  open_file.timer.async_wait([=](const boost::system::error_code& ec) {
       if (ec != boost::asio::error::operation_aborted) {
-        if (*file_context->open_count == 0) {
+        if (file_context->open_count == 0) {
 #ifndef NDEBUG
           LOG(kInfo) << "Deleting encryptor and buffer for " << name;
 #endif
           file_context->Flush();
         } else {
           LOG(kWarning) << "About to delete encryptor and buffer for "
-                        << file_context->meta_data.name << " but open_count > 0";
+                        << file_context->meta_data.name() << " but open_count > 0";
         }
       } else {
 #ifndef NDEBUG
@@ -220,6 +330,29 @@ void Drive<Storage>::ScheduleDeletionOfEncryptor(detail::FileContext* file_conte
   });
 }
 
+template <typename Storage>
+void Drive<Storage>::ReleaseEncryptor(detail::FileContext* file_context) {
+  detail::OpenFile* open_file(file_context->open_file.get());
+  ScheduleDeletionOfEncryptor(file_context, *open_file);
+  // If the budget runs short before the inactivity timer fires, bring the deletion forward.  The
+  // budget may invoke this as 'open_file' is being destroyed, so the work is posted and only done
+  // if, under the parent's mutex, the file is still idle and still owns 'open_file'.
+  if (open_file->buffer_reservation) {
+    open_file->buffer_reservation->SetIdle([this, file_context, open_file] {
+      asio_service_.service().post([this, file_context, open_file] {
+        auto parent(file_context->parent.lock());
+        if (!parent)
+          return;
+        std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+        if (file_context->open_file.get() == open_file && file_context->open_count == 0) {
+          ScheduleDeletionOfEncryptor(file_context, *open_file,
+                                      std::chrono::steady_clock::duration::zero());
+        }
+      });
+    });
+  }
+}
+
 template <typename Storage>
 const detail::FileContext* Drive<Storage>::GetContext(
     const boost::filesystem::path& relative_path) {
@@ -227,6 +360,13 @@ const detail::FileContext* Drive<Storage>::GetContext(
   return parent->GetChild(relative_path.filename());
 }
 
+template <typename Storage>
+const detail::FileContext* Drive<Storage>::FindContext(
+    const boost::filesystem::path& relative_path) {
+  auto parent(directory_handler_->Find(relative_path.parent_path()));
+  return parent ? parent->FindChild(relative_path.filename()) : nullptr;
+}
+
 template <typename Storage>
 detail::FileContext* Drive<Storage>::GetMutableContext(
     const boost::filesystem::path& relative_path) {
@@ -239,8 +379,14 @@ template <typename Storage>
 void Drive<Storage>::Create(const boost::filesystem::path& relative_path,
                             detail::FileContext&& file_context) {
   if (!file_context.meta_data.directory_id) {
-    InitialiseEncryptor(relative_path, file_context);
-    *file_context.open_count = 1;
+    if (detail::kMaxInlineFileSize != 0 && file_context.meta_data.data_map &&
+        file_context.meta_data.data_map->chunks.empty() &&
+        file_context.meta_data.data_map->content.empty()) {
+      file_context.meta_data.inline_content.reset(new std::string());
+    } else {
+      InitialiseEncryptor(relative_path, file_context, ReserveBuffer(file_context));
+    }
+    file_context.open_count = 1;
   }
   directory_handler_->Add(relative_path, std::move(file_context));
 }
@@ -250,10 +396,19 @@ void Drive<Storage>::Open(const boost::filesystem::path& relative_path) {
   auto parent(directory_handler_->Get(relative_path.parent_path()));
   auto file_context(parent->GetMutableChild(relative_path.filename()));
   if (!file_context->meta_data.directory_id) {
-    LOG(kInfo) << "Opening " << relative_path << " open count: " << *file_context->open_count + 1;
-    if (++(*file_context->open_count) == 1) {
-      std::lock_guard<std::mutex> lock(parent->mutex_);
-      InitialiseEncryptor(relative_path, *file_context);
+    LOG(kInfo) << "Opening " << relative_path << " open count: " << file_context->open_count + 1;
+    if (++file_context->open_count == 1) {
+      try {
+        if (!file_context->meta_data.inline_content && !file_context->meta_data.pack_extent) {
+          auto reservation(ReserveBuffer(*file_context));
+          std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+          InitialiseEncryptor(relative_path, *file_context, std::move(reservation));
+        }
+      } catch (const std::exception&) {
+        // The buffer budget is exhausted.
+        --file_context->open_count;
+        throw;
+      }
     }
   }
 }
@@ -261,7 +416,7 @@ void Drive<Storage>::Open(const boost::filesystem::path& relative_path) {
 template <typename Storage>
 void Drive<Storage>::Flush(const boost::filesystem::path& relative_path) {
   auto file_context(GetMutableContext(relative_path));
-  if (file_context->self_encryptor && !file_context->self_encryptor->Flush()) {
+  if (file_context->open_file && !file_context->open_file->self_encryptor->Flush()) {
     LOG(kError) << "Failed to flush " << relative_path;
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
   }
@@ -272,10 +427,10 @@ void Drive<Storage>::Release(const boost::filesystem::path& relative_path) {
   SCOPED_PROFILE
   auto file_context(GetMutableContext(relative_path));
   if (!file_context->meta_data.directory_id) {
-    LOG(kInfo) << "Releasing " << relative_path << " open count: " << *file_context->open_count - 1;
-    --(*file_context->open_count);
-    if (*file_context->open_count == 0)
-      ScheduleDeletionOfEncryptor(file_context);
+    LOG(kInfo) << "Releasing " << relative_path << " open count: " << file_context->open_count - 1;
+    --file_context->open_count;
+    if (file_context->open_count == 0 && file_context->open_file)
+      ReleaseEncryptor(file_context);
   }
 }
 
@@ -300,16 +455,51 @@ void Drive<Storage>::Rename(const boost::filesystem::path& old_relative_path,
 template <typename Storage>
 uint32_t Drive<Storage>::Read(const boost::filesystem::path& relative_path, char* data,
                               uint32_t size, uint64_t offset) {
-  auto file_context(GetContext(relative_path));
-  assert(file_context->self_encryptor);
-  LOG(kInfo) << "For "  << relative_path << ", reading " << size << " of "
-             << file_context->self_encryptor->size() << " bytes at offset " << offset;
-  if (offset + size > file_context->self_encryptor->size())
-    size = offset > file_context->self_encryptor->size() ? 0 :
-           static_cast<uint32_t>(file_context->self_encryptor->size() - offset);
-
-  if ((size > 0) && (!file_context->self_encryptor->Read(data, size, offset)))
-    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+  auto parent(directory_handler_->Get(relative_path.parent_path()));
+  auto file_context(parent->GetChild(relative_path.filename()));
+  bool is_inline(false), packed(false);
+  const detail::OpenFile* open_file(nullptr);
+  uint32_t content_size(0);
+  {
+    // 'Write' resizes inline content and 'PromoteInlineContent' resets it under the parent's
+    // mutex, so the requested range is copied out before the lock is released.
+    boost::shared_lock<boost::shared_mutex> lock(parent->mutex_);
+    const std::string* inline_content(file_context->meta_data.inline_content.get());
+    is_inline = (inline_content != nullptr);
+    // An encryptor takes precedence over a pack extent which is in the middle of being released.
+    open_file = file_context->open_file.get();
+    packed = !open_file && file_context->meta_data.pack_extent;
+    assert(inline_content || packed || open_file);
+    // A file extended by truncation is longer than its content; the tail reads as zeros.
+    uint64_t data_size(inline_content ? inline_content->size() :
+                       packed ? file_context->meta_data.pack_extent->length :
+                                open_file->self_encryptor->size());
+    uint64_t file_size(std::max(data_size, file_context->meta_data.GetSize()));
+    LOG(kInfo) << "For "  << relative_path << ", reading " << size << " of " << file_size
+               << " bytes at offset " << offset;
+    if (offset + size > file_size)
+      size = offset > file_size ? 0 : static_cast<uint32_t>(file_size - offset);
+
+    content_size = offset >= data_size ? 0 :
+                   static_cast<uint32_t>(std::min<uint64_t>(size, data_size - offset));
+    if (inline_content && content_size > 0)
+      std::copy_n(inline_content->data() + offset, content_size, data);
+  }
+  if (content_size > 0 && !is_inline) {
+    if (packed) {
+      std::string content(parent->ReadPackedChild(file_context, offset, content_size));
+      if (content.size() != content_size)
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+      std::copy(std::begin(content), std::end(content), data);
+    } else if (!open_file->self_encryptor->Read(data, content_size, offset)) {
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+    }
+  }
+  std::fill(data + content_size, data + size, 0);
+  {
+    boost::shared_lock<boost::shared_mutex> lock(parent->mutex_);
+    file_context->meta_data.ZeroFillHoles(data, size, offset);
+  }
   // TODO(Fraser#5#): 2013-12-02 - Update last access time?
   return size;
 }
@@ -317,11 +507,44 @@ uint32_t Drive<Storage>::Read(const boost::filesystem::path& relative_path, char
 template <typename Storage>
 uint32_t Drive<Storage>::Write(const boost::filesystem::path& relative_path, const char* data,
                                uint32_t size, uint64_t offset) {
-  auto file_context(GetMutableContext(relative_path));
-  assert(file_context->self_encryptor);
+  auto parent(directory_handler_->Get(relative_path.parent_path()));
+  auto file_context(parent->GetMutableChild(relative_path.filename()));
   LOG(kInfo) << "For "  << relative_path << ", writing " << size << " bytes at offset " << offset;
-  if (!file_context->self_encryptor->Write(data, size, offset))
+  bool written(false);
+  if (std::all_of(data, data + size, [](char byte) { return byte == 0; })) {
+    // Zeros landing beyond the end of the content or inside a recorded hole already read as zeros,
+    // so only the logical size changes; nothing is encrypted or stored for them.
+    boost::shared_lock<boost::shared_mutex> lock(parent->mutex_);
+    if (offset >= ContentSize(*file_context) || file_context->meta_data.IsHole(offset, size)) {
+      LOG(kInfo) << "Not materialising " << size << " zeros in " << relative_path;
+      written = true;
+    }
+  }
+  const bool zeros_skipped(written);
+  if (!written && file_context->meta_data.pack_extent)
+    PromotePackedContent(relative_path, *parent, *file_context);
+  if (!written && file_context->meta_data.inline_content) {
+    BufferReservation reservation;
+    if (offset + size > detail::kMaxInlineFileSize)
+      reservation = ReserveBuffer(*file_context);
+    std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+    std::string& content(*file_context->meta_data.inline_content);
+    if (offset + size <= detail::kMaxInlineFileSize) {
+      if (content.size() < offset + size)
+        content.resize(static_cast<size_t>(offset + size), 0);
+      std::copy_n(data, size, std::begin(content) + static_cast<size_t>(offset));
+      written = true;
+    } else {
+      PromoteInlineContent(relative_path, *file_context, std::move(reservation));
+    }
+  }
+  assert(written || file_context->open_file);
+  if (!written && !file_context->open_file->self_encryptor->Write(data, size, offset))
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::unknown));
+  if (!zeros_skipped && !file_context->meta_data.holes.empty()) {
+    std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+    file_context->meta_data.RemoveHoles(offset, size);
+  }
   // TODO(Fraser#5#): 2013-12-02 - Update last write time?
 #ifndef MAIDSAFE_WIN32
   int64_t max_size(
@@ -333,6 +556,108 @@ uint32_t Drive<Storage>::Write(const boost::filesystem::path& relative_path, con
   return size;
 }
 
+template <typename Storage>
+detail::FileContext* Drive<Storage>::Truncate(const boost::filesystem::path& relative_path,
+                                              uint64_t size) {
+  auto parent(directory_handler_->Get(relative_path.parent_path()));
+  auto file_context(parent->GetMutableChild(relative_path.filename()));
+  if (file_context->meta_data.directory_id)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_argument));
+  LOG(kInfo) << "Truncating " << relative_path << " to " << size << " bytes.";
+  TruncateContent(relative_path, *parent, file_context, size);
+  {
+    std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+    file_context->meta_data.TrimHoles(size);
+  }
+  file_context->meta_data.SetSize(size);
+  file_context->meta_data.UpdateLastModifiedTime();
+  file_context->ScheduleForStoring();
+  return file_context;
+}
+
+template <typename Storage>
+void Drive<Storage>::Allocate(const boost::filesystem::path& relative_path, uint64_t offset,
+                              uint64_t length, bool keep_size) {
+  auto file_context(GetMutableContext(relative_path));
+  if (file_context->meta_data.directory_id)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_argument));
+  if (keep_size || offset + length <= file_context->meta_data.GetSize())
+    return;
+  LOG(kInfo) << "Preallocating " << relative_path << " to " << offset + length << " bytes.";
+  file_context->meta_data.SetSize(offset + length);
+  file_context->meta_data.UpdateLastModifiedTime();
+  file_context->ScheduleForStoring();
+}
+
+template <typename Storage>
+void Drive<Storage>::PunchHole(const boost::filesystem::path& relative_path, uint64_t offset,
+                               uint64_t length) {
+  auto parent(directory_handler_->Get(relative_path.parent_path()));
+  auto file_context(parent->GetMutableChild(relative_path.filename()));
+  if (file_context->meta_data.directory_id)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_argument));
+  uint64_t file_size(file_context->meta_data.GetSize());
+  if (offset >= file_size || length == 0)
+    return;
+  uint64_t end(length > file_size - offset ? file_size : offset + length);
+  uint64_t data_size(ContentSize(*file_context));
+  LOG(kInfo) << "Punching hole in " << relative_path << " from " << offset << " to " << end;
+  if (end >= data_size) {
+    // Everything from 'offset' onwards reads as zeros once the content is discarded.
+    if (offset < data_size)
+      TruncateContent(relative_path, *parent, file_context, offset);
+  } else {
+    std::lock_guard<boost::shared_mutex> lock(parent->mutex_);
+    file_context->meta_data.AddHole(offset, end - offset);
+  }
+  file_context->meta_data.UpdateLastModifiedTime();
+  file_context->ScheduleForStoring();
+}
+
+template <typename Storage>
+uint64_t Drive<Storage>::ContentSize(const detail::FileContext& file_context) const {
+  return file_context.meta_data.inline_content ? file_context.meta_data.inline_content->size() :
+         file_context.open_file ? file_context.open_file->self_encryptor->size() :
+         file_context.meta_data.pack_extent ? file_context.meta_data.pack_extent->length :
+         file_context.meta_data.data_map ? file_context.meta_data.data_map->size() : 0;
+}
+
+template <typename Storage>
+void Drive<Storage>::TruncateContent(const boost::filesystem::path& relative_path,
+                                     detail::Directory& parent, detail::FileContext* file_context,
+                                     uint64_t size) {
+  if (file_context->meta_data.inline_content) {
+    std::lock_guard<boost::shared_mutex> lock(parent.mutex_);
+    if (size < file_context->meta_data.inline_content->size())
+      file_context->meta_data.inline_content->resize(static_cast<size_t>(size));
+  } else if (file_context->open_file && size != 0) {
+    // Extending is purely logical, so only truncate the encryptor if content is being discarded.
+    if (size < file_context->open_file->self_encryptor->size())
+      file_context->open_file->self_encryptor->Truncate(size);
+  } else if (size == 0 || !file_context->meta_data.data_map) {
+    // Nothing needs to be decrypted or fetched; the old chunks are simply released, along with any
+    // encryptor and its buffer, even if the file is open.  The emptied file can be held inline
+    // again.
+    parent.DiscardChildContent(file_context);
+  } else if (file_context->meta_data.pack_extent) {
+    if (size < file_context->meta_data.pack_extent->length) {
+      PromotePackedContent(relative_path, parent, *file_context);
+      file_context->open_file->self_encryptor->Truncate(size);
+      if (file_context->open_count == 0)
+        ReleaseEncryptor(file_context);
+    }
+  } else if (size < file_context->meta_data.data_map->size()) {
+    auto reservation(ReserveBuffer(*file_context));
+    {
+      std::lock_guard<boost::shared_mutex> lock(parent.mutex_);
+      InitialiseEncryptor(relative_path, *file_context, std::move(reservation));
+    }
+    file_context->open_file->self_encryptor->Truncate(size);
+    if (file_context->open_count == 0)
+      ReleaseEncryptor(file_context);
+  }
+}
+
 }  // namespace drive
 
 }  // namespace maidsafe
@@ -0,0 +1,174 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#ifndef MAIDSAFE_DRIVE_LISTING_H_
+#define MAIDSAFE_DRIVE_LISTING_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/drive/config.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+struct ChildName;
+
+// The binary directory listing.  All integers are little-endian and every section is located by
+// offsets in the header, so a listing can be read in place from the decrypted buffer:
+//
+//   header          magic "MSDL", then u32 version, max_versions, child_count, pack_count,
+//                   directory_id_size, names_size and extras_size
+//   directory_id    directory_id_size bytes
+//   child records   child_count fixed-width 96 byte records
+//   pack records    pack_count 28 byte records
+//   name index      u32 offset into the names section of every 16th name
+//   names           u16 shared prefix length, u16 suffix length and the suffix, in collation order;
+//                   names listed in the index are stored in full
+//   extras          variable-length child and pack data referenced from the records
+//
+// A child's entry is its record followed by its extras, each extra being a u8 'ListingExtra', a
+// u32 length and the value.  Unknown extras are skipped when reading.
+
+// A time since the Unix epoch.  'nanoseconds' is always less than a second.
+struct ListingTime {
+  ListingTime() : seconds(0), nanoseconds(0) {}
+  ListingTime(int64_t seconds_in, uint32_t nanoseconds_in)
+      : seconds(seconds_in), nanoseconds(nanoseconds_in) {}
+
+  int64_t seconds;
+  uint32_t nanoseconds;
+};
+
+// The fixed-width part of a child's entry.
+struct ListingRecord {
+  ListingRecord();
+
+  uint64_t size, blocks;
+  ListingTime creation_time, last_access_time, last_write_time;
+  uint32_t mode, win_attributes, dev, ino, nlink, uid, gid, rdev, blksize;
+};
+
+enum class ListingExtra : uint8_t {
+  kDataMap = 1,
+  kDirectoryId = 2,
+  kInlineContent = 3,
+  kPackExtent = 4,
+  kHoles = 5,
+  kLinkTo = 6
+};
+
+void AppendUint32(uint32_t value, std::string* output);
+void AppendUint64(uint64_t value, std::string* output);
+uint32_t ReadUint32(const char* input);
+uint64_t ReadUint64(const char* input);
+
+// Appends the record which starts a child's entry.  Extras are appended after it.
+void AppendListingRecord(const ListingRecord& record, std::string* entry);
+void AppendListingExtra(ListingExtra type, const std::string& value, std::string* entry);
+// Parses an entry built by the two functions above, calling 'functor' for each known extra.
+// Throws parsing_error if the entry is malformed.
+ListingRecord ParseListingEntry(
+    const char* entry, size_t size,
+    const std::function<void(ListingExtra, const char*, size_t)>& functor);
+
+// Assembles a listing from children added in collation order.
+class ListingWriter {
+ public:
+  ListingWriter(const DirectoryId& directory_id, MaxVersions max_versions);
+  // 'entry' is as built by 'AppendListingRecord' and 'AppendListingExtra'.
+  void AddChild(const boost::filesystem::path& name, const std::string& entry);
+  void AddPack(uint32_t pack_id, const std::string& serialised_data_map, uint64_t size,
+               uint64_t live_size);
+  std::string Finish() const;
+
+ private:
+  std::string directory_id_;
+  MaxVersions max_versions_;
+  uint32_t child_count_, pack_count_;
+  std::string records_, pack_records_, name_index_, names_, extras_, previous_name_;
+};
+
+// Reads a listing in place.  The listing must outlive the reader.  Throws parsing_error if the
+// listing is malformed.
+class ListingReader {
+ public:
+  struct Pack {
+    uint32_t pack_id;
+    std::string serialised_data_map;
+    uint64_t size, live_size;
+  };
+
+  // Decodes the children's names in order from any child onwards, without reading their entries.
+  class NameIterator {
+   public:
+    NameIterator(const ListingReader& reader, uint32_t index);
+    bool AtEnd() const { return index_ == reader_.child_count_; }
+    uint32_t index() const { return index_; }
+    // The name as held in the listing (see 'NameFromProtobuf').
+    const std::string& name() const { return name_; }
+    NameIterator& operator++();
+
+   private:
+    const ListingReader& reader_;
+    uint32_t index_;
+    size_t next_offset_;
+    std::string name_;
+  };
+
+  // Returns false for anything other than a binary listing, i.e. a legacy protobuf listing.
+  static bool IsListing(const std::string& serialised_listing);
+
+  explicit ListingReader(const std::string& serialised_listing);
+  DirectoryId directory_id() const;
+  MaxVersions max_versions() const { return MaxVersions(max_versions_); }
+  uint32_t child_count() const { return child_count_; }
+  uint32_t pack_count() const { return pack_count_; }
+  // Returns a copy of the child's entry, suitable for 'ParseListingEntry'.
+  std::string Entry(uint32_t index) const;
+  // Returns the index of the named child using the name index, or 'child_count()' if absent.
+  // Allocates nothing for names in ASCII.
+  uint32_t Find(const ChildName& name) const;
+  Pack GetPack(uint32_t index) const;
+
+ private:
+  // Decodes the name at 'offset' into 'name', which must hold the previous name, and returns the
+  // offset of the following name.
+  size_t NextName(size_t offset, std::string& name) const;
+  // Returns the offset of the name held in full at the given position in the name index.
+  size_t RestartOffset(uint32_t restart) const;
+
+  const std::string& listing_;
+  uint32_t max_versions_, child_count_, pack_count_, directory_id_size_;
+  size_t records_offset_, packs_offset_, index_offset_, names_offset_, extras_offset_;
+};
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_DRIVE_LISTING_H_
@@ -27,7 +27,9 @@
 #endif
 
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <string>
 
 #include "boost/filesystem/path.hpp"
 #include "boost/date_time/posix_time/posix_time.hpp"
@@ -45,23 +47,79 @@ namespace detail {
 
 namespace protobuf { class MetaData; }
 
+// Locates a file's content within one of its parent directory's pack objects.
+struct PackExtent {
+  PackExtent(uint32_t pack_id_in, uint64_t offset_in, uint64_t length_in)
+      : pack_id(pack_id_in), offset(offset_in), length(length_in) {}
+
+  uint32_t pack_id;
+  uint64_t offset, length;
+};
+
+// A name with its key computed by 'CollationKey'.  Never modified once created, so that it can be
+// shared by readers of the parent directory's children without locking.
+struct ChildName {
+  explicit ChildName(boost::filesystem::path name_in);
+  const boost::filesystem::path name;
+  const std::wstring collation_key;
+};
+
 // Represents directory and file information
 struct MetaData {
   MetaData();
   MetaData(const boost::filesystem::path& name, bool is_directory);
   explicit MetaData(const protobuf::MetaData& protobuf_meta_data);
+  // Parses an entry of a binary listing, as produced by 'ToListingEntry'.
+  MetaData(std::shared_ptr<const ChildName> name, const char* entry, size_t entry_size);
+  MetaData(const boost::filesystem::path& name, const char* entry, size_t entry_size);
   MetaData(MetaData&& other);
   MetaData& operator=(MetaData other);
 
   void ToProtobuf(protobuf::MetaData* protobuf_meta_data) const;
+  // Appends this entry as held in a binary listing.  The name is held separately in the listing.
+  void ToListingEntry(std::string* entry) const;
 
   boost::posix_time::ptime creation_posix_time() const;
   boost::posix_time::ptime last_write_posix_time() const;
+  // Orders case-insensitively by 'collation_key()', falling back to the exact name so that names
+  // differing only in case remain distinct.
   bool operator<(const MetaData& other) const;
+  const boost::filesystem::path& name() const { return name_->name; }
+  // Case-folded copy of 'name()', computed once so that ordering children needs no conversion or
+  // allocation per comparison.
+  const std::wstring& collation_key() const { return name_->collation_key; }
+  // The name and key together, shared with the parent directory's index of its children.
+  const std::shared_ptr<const ChildName>& child_name() const { return name_; }
+  // Replaces the name and its collation key, so the two can't disagree.
+  void SetName(const boost::filesystem::path& new_name);
+  // Sets the last write time to now, at full precision.  On POSIX the status change time is set
+  // with it.
   void UpdateLastModifiedTime();
+#ifndef MAIDSAFE_WIN32
+  // Sets the status change time to now, as for a change of mode or owner.
+  void UpdateLastStatusChangeTime();
+#endif
   uint64_t GetAllocatedSize() const;
+  // The logical size of the file, which may exceed the size of its data map's content if the file
+  // has been extended by truncation (the remainder reads as zeros).
+  uint64_t GetSize() const;
+  void SetSize(uint64_t size);
+  // Hole tracking for sparse files.  Adding merges with any overlapping or adjacent holes; removing
+  // splits holes which straddle the removed range.
+  void AddHole(uint64_t offset, uint64_t length);
+  void RemoveHoles(uint64_t offset, uint64_t length);
+  void TrimHoles(uint64_t size);
+  // Returns whether the whole range lies within a recorded hole.
+  bool IsHole(uint64_t offset, uint64_t length) const;
+  void ZeroFillHoles(char* data, uint32_t size, uint64_t offset) const;
+
+  friend void swap(MetaData& lhs, MetaData& rhs) MAIDSAFE_NOEXCEPT;
 
-  boost::filesystem::path name;
+ private:
+  // Declared ahead of the other members, which are initialised after them.  Never null.
+  std::shared_ptr<const ChildName> name_;
+
+ public:
 #ifdef MAIDSAFE_WIN32
   uint64_t end_of_file;
   uint64_t allocation_size;
@@ -74,6 +132,13 @@ struct MetaData {
   boost::filesystem::path link_to;
 #endif
   std::unique_ptr<encrypt::DataMap> data_map;
+  // Set for files small enough to be held in the parent listing; 'data_map' is then empty.
+  std::unique_ptr<std::string> inline_content;
+  // Set for small files whose content has been written into a pack object; 'data_map' is then
+  // empty.
+  std::unique_ptr<PackExtent> pack_extent;
+  // Ranges of the file (offset to length) which read as zeros regardless of 'data_map' content.
+  std::map<uint64_t, uint64_t> holes;
   std::unique_ptr<DirectoryId> directory_id;
 
  private:
@@ -82,6 +147,18 @@ struct MetaData {
 
 void swap(MetaData& lhs, MetaData& rhs) MAIDSAFE_NOEXCEPT;
 
+std::wstring CollationKey(const boost::filesystem::path& name);
+
+// Converts a name as held in a serialised MetaData, mapping either separator to 'kRoot'.
+boost::filesystem::path NameFromProtobuf(const std::string& name);
+
+// Three-way comparison of two names given with their keys computed by 'CollationKey'.  Consistent
+// with MetaData::operator<.
+int CompareCollation(const std::wstring& lhs_key, const boost::filesystem::path& lhs_name,
+                     const std::wstring& rhs_key, const boost::filesystem::path& rhs_name);
+
+int CompareCollation(const ChildName& lhs, const ChildName& rhs);
+
 }  // namespace detail
 
 }  // namespace drive
@@ -34,11 +34,17 @@
 #ifdef MAIDSAFE_APPLE
 #include "sys/statvfs.h"
 #endif
+#include <fcntl.h>
 #include "fuse/fuse.h"
 #include "fuse/fuse_common.h"
 #include "fuse/fuse_lowlevel.h"
 #include "fuse/fuse_opt.h"
 
+// The fallocate operation was added to the high-level FUSE API in version 2.9.
+#if FUSE_VERSION >= 29 && defined(FALLOC_FL_KEEP_SIZE) && defined(FALLOC_FL_PUNCH_HOLE)
+#define MAIDSAFE_DRIVE_HAS_FALLOCATE
+#endif
+
 #include "maidsafe/common/on_scope_exit.h"
 
 #include "maidsafe/drive/drive.h"
@@ -120,6 +126,10 @@ class FuseDrive : public Drive<Storage> {
   static int OpsChown(const char* path, uid_t uid, gid_t gid);
   static int OpsCreate(const char* path, mode_t mode, struct fuse_file_info* file_info);
   static void OpsDestroy(void* fuse);
+#ifdef MAIDSAFE_DRIVE_HAS_FALLOCATE
+  static int OpsFallocate(const char* path, int mode, off_t offset, off_t length,
+                          struct fuse_file_info* file_info);
+#endif
   static int OpsFgetattr(const char* path, struct stat* stbuf, struct fuse_file_info* file_info);
   static int OpsFlush(const char* path, struct fuse_file_info* file_info);
   static int OpsFsync(const char* path, int isdatasync, struct fuse_file_info* file_info);
@@ -217,6 +227,9 @@ void FuseDrive<Storage>::Init() {
   maidsafe_ops_.chown = OpsChown;
   maidsafe_ops_.create = OpsCreate;
   maidsafe_ops_.destroy = OpsDestroy;
+#ifdef MAIDSAFE_DRIVE_HAS_FALLOCATE
+  maidsafe_ops_.fallocate = OpsFallocate;
+#endif
   maidsafe_ops_.fgetattr = OpsFgetattr;
   maidsafe_ops_.flush = OpsFlush;
 //  maidsafe_ops_.fsync = OpsFsync;
@@ -373,7 +386,7 @@ int FuseDrive<Storage>::OpsChmod(const char* path, mode_t mode) {
   try {
     auto file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path));
     file_context->meta_data.attributes.st_mode = mode;
-    time(&file_context->meta_data.attributes.st_ctime);
+    file_context->meta_data.UpdateLastStatusChangeTime();
     file_context->ScheduleForStoring();
   }
   catch (const std::exception& e) {
@@ -399,7 +412,7 @@ int FuseDrive<Storage>::OpsChown(const char* path, uid_t uid, gid_t gid) {
       file_context->meta_data.attributes.st_uid = uid;
     if (change_gid)
       file_context->meta_data.attributes.st_gid = gid;
-    time(&file_context->meta_data.attributes.st_ctime);
+    file_context->meta_data.UpdateLastStatusChangeTime();
     file_context->ScheduleForStoring();
   }
   catch (const std::exception& e) {
@@ -434,6 +447,49 @@ void FuseDrive<Storage>::OpsDestroy(void* /*fuse*/) {
   LOG(kInfo) << "OpsDestroy";
 }
 
+#ifdef MAIDSAFE_DRIVE_HAS_FALLOCATE
+// Quote from FUSE documentation:
+//
+// Allocates space for an open file
+//
+// This function ensures that required space is allocated for specified file.  If this function
+// returns success then any subsequent write request to specified range is guaranteed not to fail
+// because of lack of space on the file system media.
+template <typename Storage>
+int FuseDrive<Storage>::OpsFallocate(const char* path, int mode, off_t offset, off_t length,
+                                     struct fuse_file_info* /*file_info*/) {
+  LOG(kInfo) << "OpsFallocate: " << path << ", mode: " << mode << ", offset: " << offset
+             << ", length: " << length;
+  if (offset < 0 || length <= 0)
+    return -EINVAL;
+  try {
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+      Global<Storage>::g_fuse_drive->PunchHole(path, offset, length);
+    } else if (mode == 0 || mode == FALLOC_FL_KEEP_SIZE) {
+      Global<Storage>::g_fuse_drive->Allocate(path, offset, length,
+                                              mode == FALLOC_FL_KEEP_SIZE);
+    } else {
+      return -EOPNOTSUPP;
+    }
+  }
+  catch (const maidsafe_error& error) {
+    LOG(kWarning) << "OpsFallocate: " << path << ": " << error.what();
+    if (error.code() == make_error_code(DriveErrors::no_such_file))
+      return -ENOENT;
+    if (error.code() == make_error_code(CommonErrors::invalid_argument))
+      return -EINVAL;
+    if (error.code() == make_error_code(CommonErrors::cannot_exceed_limit))
+      return -ENOSPC;
+    return -EIO;
+  }
+  catch (const std::exception& e) {
+    LOG(kWarning) << "OpsFallocate: " << path << ": " << e.what();
+    return -EIO;
+  }
+  return 0;
+}
+#endif
+
 // Quote from FUSE documentation:
 //
 // Get attributes from an open file.
@@ -605,7 +661,7 @@ int FuseDrive<Storage>::OpsLink(const char* to, const char* from) {
     }
 
     MetaData meta_data_from(file_context_to.meta_data);
-    meta_data_from.name = path_from.filename();
+    meta_data_from.SetName(path_from.filename());
 
     result = Global<Storage>::g_fuse_drive->AddNewMetaData(path_from, &meta_data_from, nullptr);
     if (result != kSuccess) {
@@ -678,6 +734,13 @@ int FuseDrive<Storage>::OpsOpen(const char* path, struct fuse_file_info* file_in
   try {
     Global<Storage>::g_fuse_drive->Open(path);
   }
+  catch (const maidsafe_error& error) {
+    LOG(kError) << "OpsOpen: " << fs::path(path) << ": " << error.what();
+    // Every buffer is in use and none could be evicted.
+    if (error.code() == make_error_code(CommonErrors::cannot_exceed_limit))
+      return -ENFILE;
+    return -ENOENT;
+  }
   catch (const std::exception& e) {
     LOG(kError) << "OpsOpen: " << fs::path(path) << ": " << e.what();
     return -ENOENT;
@@ -772,12 +835,15 @@ int FuseDrive<Storage>::OpsReaddir(const char* path, void* buf, fuse_fill_dir_t
   assert(directory);
 
   // TODO(Fraser#5#): 2011-05-18 - Handle offset properly.
-  if (offset == 0)
+  if (offset == 0) {
     directory->ResetChildrenCounter();
+    // Recursive tools descend into the subdirectories next, so start fetching them now.
+    Global<Storage>::g_fuse_drive->directory_handler_->Prefetch(path);
+  }
 
   const detail::FileContext* file_context(directory->GetChildAndIncrementCounter());
   while (file_context) {
-    if (filler(buf, file_context->meta_data.name.c_str(), &file_context->meta_data.attributes, 0))
+    if (filler(buf, file_context->meta_data.name().c_str(), &file_context->meta_data.attributes, 0))
       break;
     file_context = directory->GetChildAndIncrementCounter();
   }
@@ -940,6 +1006,7 @@ int FuseDrive<Storage>::OpsSymlink(const char* to, const char* from) {
     CreateNew(path_from, S_IFLNK);
     detail::FileContext* file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path_from));
     file_context->meta_data.link_to = path_to;
+    file_context->ScheduleForStoring();
   }
   catch (const std::exception&) {
     return -EIO;
@@ -1033,6 +1100,12 @@ int FuseDrive<Storage>::OpsWrite(const char* path, const char* buf, size_t size,
   try {
     return static_cast<int>(Global<Storage>::g_fuse_drive->Write(path, buf, size, offset));
   }
+  catch (const maidsafe_error& error) {
+    LOG(kWarning) << "Failed to write " << path << ": " << error.what();
+    if (error.code() == make_error_code(CommonErrors::cannot_exceed_limit))
+      return -ENOSPC;
+    return -EINVAL;
+  }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to write " << path << ": " << e.what();
     return -EINVAL;
@@ -1098,10 +1171,6 @@ int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t
   }
   bool is_directory(S_ISDIR(mode));
   detail::FileContext file_context(full_path.filename(), is_directory);
-
-  time(&file_context.meta_data.attributes.st_atime);
-  file_context.meta_data.attributes.st_ctime = file_context.meta_data.attributes.st_mtime =
-      file_context.meta_data.attributes.st_atime;
   file_context.meta_data.attributes.st_mode = mode;
   file_context.meta_data.attributes.st_rdev = rdev;
   file_context.meta_data.attributes.st_nlink = (is_directory ? 2 : 1);
@@ -1122,10 +1191,16 @@ int FuseDrive<Storage>::CreateNew(const fs::path& full_path, mode_t mode, dev_t
 template <typename Storage>
 int FuseDrive<Storage>::GetAttributes(const char* path, struct stat* stbuf) {
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetContext(path));
+    // Probes for missing files are common (e.g. include path searches), so they're answered
+    // without an exception.
+    auto file_context(Global<Storage>::g_fuse_drive->FindContext(path));
+    if (!file_context) {
+      LOG(kVerbose) << "OpsGetattr: " << path << " doesn't exist.";
+      return -ENOENT;
+    }
     *stbuf = file_context->meta_data.attributes;
     LOG(kVerbose) << " meta_data info  = ";
-    LOG(kVerbose) << "     name =  " << file_context->meta_data.name.c_str();
+    LOG(kVerbose) << "     name =  " << file_context->meta_data.name().c_str();
     LOG(kVerbose) << "     st_dev = " << file_context->meta_data.attributes.st_dev;
     LOG(kVerbose) << "     st_ino = " << file_context->meta_data.attributes.st_ino;
     LOG(kVerbose) << "     st_mode = " << file_context->meta_data.attributes.st_mode;
@@ -1154,14 +1229,13 @@ int FuseDrive<Storage>::GetAttributes(const char* path, struct stat* stbuf) {
 template <typename Storage>
 int FuseDrive<Storage>::Truncate(const char* path, off_t size) {
   try {
-    auto file_context(Global<Storage>::g_fuse_drive->GetMutableContext(path));
-    assert(file_context->self_encryptor);
-    file_context->self_encryptor->Truncate(size);
-    file_context->meta_data.attributes.st_size = size;
-    time(&file_context->meta_data.attributes.st_mtime);
-    file_context->meta_data.attributes.st_ctime = file_context->meta_data.attributes.st_atime =
-        file_context->meta_data.attributes.st_mtime;
-    file_context->ScheduleForStoring();
+    auto file_context(Global<Storage>::g_fuse_drive->Drive<Storage>::Truncate(path, size));
+#ifdef MAIDSAFE_APPLE
+    file_context->meta_data.attributes.st_atimespec =
+        file_context->meta_data.attributes.st_mtimespec;
+#else
+    file_context->meta_data.attributes.st_atim = file_context->meta_data.attributes.st_mtim;
+#endif
   }
   catch (const std::exception& e) {
     LOG(kWarning) << "Failed to truncate " << path << ": " << e.what();
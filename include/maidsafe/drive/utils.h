@@ -20,6 +20,7 @@
 #define MAIDSAFE_DRIVE_UTILS_H_
 
 #include <string>
+#include <vector>
 
 #include "boost/filesystem/path.hpp"
 
@@ -34,6 +35,14 @@ std::string GetLowerCase(std::string input);
 bool ExcludedFilename(const boost::filesystem::path& path);
 bool MatchesMask(std::wstring mask, const boost::filesystem::path& file_name);
 
+// The chunks of a file before and after it was modified, classified in a single merge pass.
+struct ChunkDiff {
+  std::vector<std::string> added, kept, dropped;
+};
+// 'before' and 'after' must be sorted and free of duplicates.
+ChunkDiff DiffChunks(const std::vector<std::string>& before,
+                     const std::vector<std::string>& after);
+
 }  // namespace detail
 
 }  // namespace drive
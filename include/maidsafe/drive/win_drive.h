@@ -688,8 +688,8 @@ void CbfsDrive<Storage>::CbFsGetFileInfo(
   // *file_id = 0;
   *file_attributes = file_context->meta_data.attributes;
   if (real_file_name) {
-    wcscpy(real_file_name, file_context->meta_data.name.wstring().c_str());
-    *real_file_name_length = static_cast<WORD>(file_context->meta_data.name.wstring().size());
+    wcscpy(real_file_name, file_context->meta_data.name().wstring().c_str());
+    *real_file_name_length = static_cast<WORD>(file_context->meta_data.name().wstring().size());
   }
 }
 
@@ -751,6 +751,9 @@ void CbfsDrive<Storage>::CbFsEnumerateDirectory(
     directory = cbfs_drive->directory_handler_->Get(relative_path);
     if (restart)
       directory->ResetChildrenCounter();
+    // Recursive tools descend into the subdirectories next, so start fetching them now.
+    if (restart && !exact_match)
+      cbfs_drive->directory_handler_->Prefetch(relative_path);
   }
   catch (const std::exception& e) {
     LOG(kError) << "Failed enumerating " << relative_path << ": " << e.what();
@@ -763,7 +766,7 @@ void CbfsDrive<Storage>::CbFsEnumerateDirectory(
       file_context = directory->GetChildAndIncrementCounter();
       if (!file_context)
         break;
-      *file_found = detail::MatchesMask(mask_str, file_context->meta_data.name);
+      *file_found = detail::MatchesMask(mask_str, file_context->meta_data.name());
     }
   } else {
     file_context = directory->GetChildAndIncrementCounter();
@@ -774,8 +777,8 @@ void CbfsDrive<Storage>::CbFsEnumerateDirectory(
     // Need to use wcscpy rather than the secure wcsncpy_s as file_name has a size of 0 in some
     // cases.  CBFS docs specify that callers must assign MAX_PATH chars to file_name, so we assume
     // this is done.
-    wcscpy(file_name, file_context->meta_data.name.wstring().c_str());
-    *file_name_length = static_cast<DWORD>(file_context->meta_data.name.wstring().size());
+    wcscpy(file_name, file_context->meta_data.name().wstring().c_str());
+    *file_name_length = static_cast<DWORD>(file_context->meta_data.name().wstring().size());
     *creation_time = file_context->meta_data.creation_time;
     *last_access_time = file_context->meta_data.last_access_time;
     *last_write_time = file_context->meta_data.last_write_time;
@@ -824,7 +827,7 @@ void CbfsDrive<Storage>::CbFsSetAllocationSize(CallbackFileSystem* sender, CbFsF
   try {
     auto file_context(cbfs_drive->GetMutableContext(relative_path));
     file_context->meta_data.allocation_size = allocation_size;
-    file_context->parent.lock()->ScheduleForStoring();
+    file_context->ScheduleForStoring();
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
@@ -852,11 +855,7 @@ void CbfsDrive<Storage>::CbFsSetEndOfFile(CallbackFileSystem* sender, CbFsFileIn
   auto relative_path(detail::GetRelativePath<Storage>(cbfs_drive, file_info));
   LOG(kInfo) << "CbFsSetEndOfFile - " << relative_path << " to " << end_of_file << " bytes.";
   try {
-    auto file_context(cbfs_drive->GetMutableContext(relative_path));
-    assert(file_context->self_encryptor);
-    file_context->self_encryptor->Truncate(end_of_file);
-    file_context->meta_data.end_of_file = end_of_file;
-    file_context->parent.lock()->ScheduleForStoring();
+    cbfs_drive->Truncate(relative_path, end_of_file);
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
@@ -867,7 +866,7 @@ void CbfsDrive<Storage>::CbFsSetEndOfFile(CallbackFileSystem* sender, CbFsFileIn
   //     LOG(kError) << "CbFsSetEndOfFile: " << relative_path << ", failed to flush";
   //   }
   // } else {
-  //   LOG(kError) << "Truncate failed for " << file_context->meta_data.name;
+  //   LOG(kError) << "Truncate failed for " << file_context->meta_data.name();
   // }
 
   // if (file_context->meta_data.allocation_size == static_cast<uint64_t>(end_of_file))
@@ -901,7 +900,7 @@ void CbfsDrive<Storage>::CbFsSetFileAttributes(
       detail::SetFiletime(file_context->meta_data.last_access_time, last_access_time);
     changed |= detail::SetFiletime(file_context->meta_data.last_write_time, last_write_time);
     if (changed)
-      file_context->parent.lock()->ScheduleForStoring();
+      file_context->ScheduleForStoring();
   }
   catch (const std::exception&) {
     throw ECBFSError(ERROR_FILE_NOT_FOUND);
@@ -0,0 +1,188 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/buffer_budget.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+const MemoryUsage BufferBudget::kMinimumMemory(1024 * 1024);  // default chunk size
+
+BufferBudget::Reservation::Reservation(BufferBudget& budget, MemoryUsage memory, DiskUsage disk)
+    : budget_(budget), memory_(std::move(memory)), disk_(std::move(disk)), idle_(false),
+      evicted_(false), evict_(), idle_itr_() {}
+
+BufferBudget::Reservation::~Reservation() {
+  budget_.Release(this);
+}
+
+void BufferBudget::Reservation::SetIdle(EvictFunctor evict) {
+  std::lock_guard<std::mutex> lock(budget_.mutex_);
+  if (idle_)
+    budget_.idle_.erase(idle_itr_);
+  evict_ = std::move(evict);
+  idle_itr_ = budget_.idle_.insert(std::end(budget_.idle_), this);
+  idle_ = true;
+}
+
+void BufferBudget::Reservation::SetActive() {
+  std::lock_guard<std::mutex> lock(budget_.mutex_);
+  if (idle_) {
+    budget_.idle_.erase(idle_itr_);
+    idle_ = false;
+  }
+  if (evicted_) {
+    // The owner reclaimed the buffer before the eviction completed.
+    budget_.evicting_memory_ -= memory_.data;
+    budget_.evicting_disk_ -= disk_.data;
+    evicted_ = false;
+    budget_.space_released_.notify_all();
+  }
+  evict_ = nullptr;
+}
+
+BufferBudget::BufferBudget(MemoryUsage max_memory, DiskUsage max_disk,
+                           std::chrono::steady_clock::duration eviction_timeout)
+    : max_memory_(std::move(max_memory)), max_disk_(std::move(max_disk)),
+      eviction_timeout_(eviction_timeout), mutex_(), space_released_(), memory_in_use_(0),
+      disk_in_use_(0), evicting_memory_(0), evicting_disk_(0), idle_() {
+  if (max_memory_.data < kMinimumMemory.data || max_disk_.data < max_memory_.data)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+}
+
+BufferBudget::~BufferBudget() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(memory_in_use_ == 0 && disk_in_use_ == 0 && idle_.empty());
+}
+
+std::unique_ptr<BufferBudget::Reservation> BufferBudget::Reserve(MemoryUsage wanted_memory,
+                                                                 DiskUsage wanted_disk) {
+  const auto deadline(std::chrono::steady_clock::now() + eviction_timeout_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    auto evictions(EvictIdle(std::max(wanted_memory.data, kMinimumMemory.data),
+                             std::max(wanted_disk.data, kMinimumMemory.data)));
+    auto reservation(Grant(wanted_memory.data, wanted_disk.data));
+    if (!evictions.empty()) {
+      lock.unlock();
+      for (auto& evict : evictions)
+        evict();
+      if (reservation)
+        return reservation;
+      lock.lock();
+      continue;
+    }
+    if (reservation)
+      return reservation;
+    // The budget is full.  Wait for the evicted reservations to be destroyed.
+    if ((evicting_memory_ == 0 && evicting_disk_ == 0) ||
+        std::chrono::steady_clock::now() >= deadline) {
+      LOG(kWarning) << "Buffer budget exhausted: " << memory_in_use_ << " memory and "
+                    << disk_in_use_ << " disk in use, " << evicting_memory_ << " and "
+                    << evicting_disk_ << " being evicted.";
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::cannot_exceed_limit));
+    }
+    space_released_.wait_until(lock, deadline);
+  }
+}
+
+MemoryUsage BufferBudget::memory_in_use() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return MemoryUsage(memory_in_use_);
+}
+
+DiskUsage BufferBudget::disk_in_use() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return DiskUsage(disk_in_use_);
+}
+
+size_t BufferBudget::idle_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_.size();
+}
+
+void BufferBudget::Release(Reservation* reservation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (reservation->idle_)
+    idle_.erase(reservation->idle_itr_);
+  if (reservation->evicted_) {
+    evicting_memory_ -= reservation->memory_.data;
+    evicting_disk_ -= reservation->disk_.data;
+  }
+  memory_in_use_ -= reservation->memory_.data;
+  disk_in_use_ -= reservation->disk_.data;
+  space_released_.notify_all();
+}
+
+std::unique_ptr<BufferBudget::Reservation> BufferBudget::Grant(uint64_t wanted_memory,
+                                                               uint64_t wanted_disk) {
+  uint64_t available_memory(max_memory_.data - memory_in_use_);
+  uint64_t available_disk(max_disk_.data - disk_in_use_);
+  uint64_t memory(std::max(std::min(wanted_memory, available_memory), kMinimumMemory.data));
+  uint64_t disk(std::max(std::min(wanted_disk, available_disk), memory));
+  if (memory > available_memory || disk > available_disk)
+    return nullptr;
+  if (memory < wanted_memory || disk < wanted_disk) {
+    LOG(kInfo) << "Buffer budget under pressure: granted " << memory << " of " << wanted_memory
+               << " memory and " << disk << " of " << wanted_disk << " disk.";
+  }
+  memory_in_use_ += memory;
+  disk_in_use_ += disk;
+  return std::unique_ptr<Reservation>(new Reservation(*this, MemoryUsage(memory),
+                                                      DiskUsage(disk)));
+}
+
+std::vector<BufferBudget::EvictFunctor> BufferBudget::EvictIdle(uint64_t wanted_memory,
+                                                                uint64_t wanted_disk) {
+  // Space which will be available once all outstanding evictions have completed.
+  auto projected([](uint64_t max, uint64_t in_use, uint64_t evicting) -> uint64_t {
+    return max - (in_use - evicting);
+  });
+  std::vector<EvictFunctor> evictions;
+  while (!idle_.empty() &&
+         (projected(max_memory_.data, memory_in_use_, evicting_memory_) < wanted_memory ||
+          projected(max_disk_.data, disk_in_use_, evicting_disk_) < wanted_disk)) {
+    Reservation* reservation(idle_.front());
+    idle_.pop_front();
+    reservation->idle_ = false;
+    reservation->evicted_ = true;
+    evicting_memory_ += reservation->memory_.data;
+    evicting_disk_ += reservation->disk_.data;
+    if (reservation->evict_) {
+      evictions.emplace_back(std::move(reservation->evict_));
+      reservation->evict_ = nullptr;
+    }
+  }
+  return evictions;
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
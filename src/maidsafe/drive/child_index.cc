@@ -0,0 +1,262 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/child_index.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace {
+
+// The most entries in a leaf, or children of any other node.  Small enough that copying a node on
+// the path to a change stays cheap, large enough to keep the tree shallow.
+const size_t kMaxNodeSize(16);
+
+bool NameLess(const std::shared_ptr<const ChildName>& lhs, const ChildName& rhs) {
+  return CompareCollation(*lhs, rhs) < 0;
+}
+
+}  // unnamed namespace
+
+struct ChildIndex::Node {
+  Node() : entries(), keys(), children() {}
+  bool leaf() const { return children.empty(); }
+  const std::shared_ptr<const ChildName>& first_name() const {
+    return leaf() ? entries.front().name : keys.front();
+  }
+  // Returns the position of the child under which 'name' belongs.
+  size_t ChildPosition(const ChildName& name) const {
+    auto itr(std::upper_bound(
+        std::next(std::begin(keys)), std::end(keys), name,
+        [](const ChildName& lhs, const std::shared_ptr<const ChildName>& rhs) {
+          return CompareCollation(lhs, *rhs) < 0;
+        }));
+    return static_cast<size_t>(std::distance(std::begin(keys), itr)) - 1;
+  }
+  std::vector<Entry>::const_iterator LowerBound(const ChildName& name) const {
+    return std::lower_bound(std::begin(entries), std::end(entries), name,
+                            [](const Entry& lhs, const ChildName& rhs) {
+                              return NameLess(lhs.name, rhs);
+                            });
+  }
+
+  // Leaves hold entries.  Other nodes hold children, every name under 'children[i]' being no less
+  // than 'keys[i]' and less than 'keys[i + 1]'.
+  std::vector<Entry> entries;
+  std::vector<std::shared_ptr<const ChildName>> keys;
+  std::vector<std::shared_ptr<const Node>> children;
+};
+
+ChildIndex::ChildIndex() : root_(), size_(0) {}
+
+ChildIndex::ChildIndex(std::vector<Entry> entries) : root_(), size_(entries.size()) {
+  // Built bottom up from full nodes.
+  std::vector<std::shared_ptr<const Node>> level;
+  for (auto itr(std::begin(entries)); itr != std::end(entries);) {
+    auto leaf(std::make_shared<Node>());
+    auto end(itr + std::min<ptrdiff_t>(kMaxNodeSize, std::distance(itr, std::end(entries))));
+    leaf->entries.assign(std::make_move_iterator(itr), std::make_move_iterator(end));
+    level.push_back(std::move(leaf));
+    itr = end;
+  }
+  while (level.size() > 1) {
+    std::vector<std::shared_ptr<const Node>> parents;
+    for (size_t i(0); i < level.size(); i += kMaxNodeSize) {
+      auto parent(std::make_shared<Node>());
+      for (size_t j(i); j != std::min(level.size(), i + kMaxNodeSize); ++j) {
+        parent->keys.push_back(level[j]->first_name());
+        parent->children.push_back(std::move(level[j]));
+      }
+      parents.push_back(std::move(parent));
+    }
+    level.swap(parents);
+  }
+  if (!level.empty())
+    root_ = std::move(level.front());
+}
+
+ChildIndex::ChildIndex(std::shared_ptr<const Node> root, size_t size)
+    : root_(std::move(root)), size_(size) {}
+
+const ChildIndex::Entry* ChildIndex::Find(const ChildName& name) const {
+  const Node* node(root_.get());
+  if (!node)
+    return nullptr;
+  while (!node->leaf())
+    node = node->children[node->ChildPosition(name)].get();
+  auto itr(node->LowerBound(name));
+  return (itr != std::end(node->entries) && CompareCollation(*itr->name, name) == 0) ? &*itr :
+                                                                                       nullptr;
+}
+
+ChildIndex ChildIndex::Insert(Entry entry) const {
+  if (!root_) {
+    auto leaf(std::make_shared<Node>());
+    leaf->entries.push_back(std::move(entry));
+    return ChildIndex(std::move(leaf), 1);
+  }
+  bool added(false);
+  std::shared_ptr<const Node> sibling;
+  auto root(DoInsert(*root_, std::move(entry), added, sibling));
+  if (sibling) {
+    auto parent(std::make_shared<Node>());
+    parent->keys.push_back(root->first_name());
+    parent->keys.push_back(sibling->first_name());
+    parent->children.push_back(std::move(root));
+    parent->children.push_back(std::move(sibling));
+    root = std::move(parent);
+  }
+  return ChildIndex(std::move(root), added ? size_ + 1 : size_);
+}
+
+ChildIndex ChildIndex::Erase(const ChildName& name) const {
+  if (!root_)
+    return *this;
+  bool erased(false);
+  auto root(DoErase(root_, name, erased));
+  if (!erased)
+    return *this;
+  // Nodes are left underfull rather than merged, but a root with a single child is dropped.
+  while (root && !root->leaf() && root->children.size() == 1)
+    root = root->children.front();
+  return ChildIndex(std::move(root), size_ - 1);
+}
+
+std::shared_ptr<const ChildIndex::Node> ChildIndex::DoInsert(
+    const Node& node, Entry entry, bool& added, std::shared_ptr<const Node>& sibling) {
+  auto copy(std::make_shared<Node>(node));
+  if (node.leaf()) {
+    auto position(std::distance(std::begin(node.entries), node.LowerBound(*entry.name)));
+    auto itr(std::begin(copy->entries) + position);
+    added = itr == std::end(copy->entries) || CompareCollation(*itr->name, *entry.name) != 0;
+    if (added)
+      copy->entries.insert(itr, std::move(entry));
+    else
+      *itr = std::move(entry);
+    if (copy->entries.size() > kMaxNodeSize) {
+      auto second_half(std::make_shared<Node>());
+      auto middle(std::begin(copy->entries) + copy->entries.size() / 2);
+      second_half->entries.assign(std::make_move_iterator(middle),
+                                  std::make_move_iterator(std::end(copy->entries)));
+      copy->entries.erase(middle, std::end(copy->entries));
+      sibling = std::move(second_half);
+    }
+    return std::move(copy);
+  }
+
+  size_t position(node.ChildPosition(*entry.name));
+  std::shared_ptr<const Node> child_sibling;
+  copy->children[position] =
+      DoInsert(*node.children[position], std::move(entry), added, child_sibling);
+  if (child_sibling) {
+    copy->keys.insert(std::begin(copy->keys) + position + 1, child_sibling->first_name());
+    copy->children.insert(std::begin(copy->children) + position + 1, std::move(child_sibling));
+    if (copy->children.size() > kMaxNodeSize) {
+      auto second_half(std::make_shared<Node>());
+      size_t middle(copy->children.size() / 2);
+      second_half->keys.assign(std::begin(copy->keys) + middle, std::end(copy->keys));
+      second_half->children.assign(std::begin(copy->children) + middle,
+                                   std::end(copy->children));
+      copy->keys.resize(middle);
+      copy->children.resize(middle);
+      sibling = std::move(second_half);
+    }
+  }
+  return std::move(copy);
+}
+
+std::shared_ptr<const ChildIndex::Node> ChildIndex::DoErase(
+    const std::shared_ptr<const Node>& node, const ChildName& name, bool& erased) {
+  if (node->leaf()) {
+    auto itr(node->LowerBound(name));
+    erased = itr != std::end(node->entries) && CompareCollation(*itr->name, name) == 0;
+    if (!erased)
+      return node;
+    if (node->entries.size() == 1)
+      return nullptr;
+    auto copy(std::make_shared<Node>(*node));
+    copy->entries.erase(std::begin(copy->entries) +
+                        std::distance(std::begin(node->entries), itr));
+    return std::move(copy);
+  }
+
+  size_t position(node->ChildPosition(name));
+  auto child(DoErase(node->children[position], name, erased));
+  if (!erased)
+    return node;
+  if (!child && node->children.size() == 1)
+    return nullptr;
+  auto copy(std::make_shared<Node>(*node));
+  if (child) {
+    copy->children[position] = std::move(child);
+  } else {
+    copy->keys.erase(std::begin(copy->keys) + position);
+    copy->children.erase(std::begin(copy->children) + position);
+  }
+  return std::move(copy);
+}
+
+ChildIndex::Iterator::Iterator(const ChildIndex& index) : path_() {
+  if (index.root_)
+    Descend(index.root_.get());
+}
+
+const ChildIndex::Entry& ChildIndex::Iterator::operator*() const {
+  assert(!AtEnd());
+  return path_.back().first->entries[path_.back().second];
+}
+
+ChildIndex::Iterator& ChildIndex::Iterator::operator++() {
+  assert(!AtEnd());
+  if (++path_.back().second != path_.back().first->entries.size())
+    return *this;
+  path_.pop_back();
+  while (!path_.empty()) {
+    auto& level(path_.back());
+    if (++level.second != level.first->children.size()) {
+      Descend(level.first->children[level.second].get());
+      return *this;
+    }
+    path_.pop_back();
+  }
+  return *this;
+}
+
+void ChildIndex::Iterator::Descend(const Node* node) {
+  // Nodes are never empty, so the leftmost leaf holds the next entry.
+  for (;;) {
+    path_.emplace_back(node, 0);
+    if (node->leaf())
+      return;
+    node = node->children.front().get();
+  }
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
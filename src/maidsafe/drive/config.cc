@@ -31,6 +31,18 @@ const MaxVersions kMaxVersions(1);
 const std::chrono::steady_clock::duration kDirectoryInactivityDelay(std::chrono::seconds(3));
 const std::chrono::steady_clock::duration kFileInactivityDelay(std::chrono::seconds(2));
 
+const MemoryUsage kMaxBufferMemory(256 * 1024 * 1024);
+const size_t kExpectedOpenFiles(32);
+const std::chrono::steady_clock::duration kBufferEvictionTimeout(std::chrono::seconds(10));
+const uint32_t kMaxInlineFileSize(4096);
+const uint32_t kMaxPackedFileSize(1024 * 1024);
+const uint32_t kMaxPackSize(4 * 1024 * 1024);
+const size_t kMaxCachedPacks(8);
+const size_t kMaxCachedDirectories(1024);
+const size_t kMaxConcurrentPrefetches(8);
+const size_t kMaxPrefetchedDirectories(256);
+const size_t kMaxCachedMissingNames(256);
+
 }  // namespace detail
 
 }  // namespace drive
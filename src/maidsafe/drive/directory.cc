@@ -19,13 +19,18 @@
 #include "maidsafe/drive/directory.h"
 
 #include <algorithm>
+#include <functional>
 #include <iterator>
 
 #include "boost/asio/placeholders.hpp"
 
 #include "maidsafe/common/convert.h"
+#include "maidsafe/common/log.h"
 #include "maidsafe/common/profiler.h"
+#include "maidsafe/common/utils.h"
+#include "maidsafe/common/serialisation/serialisation.h"
 
+#include "maidsafe/drive/listing.h"
 #include "maidsafe/drive/meta_data.h"
 #include "maidsafe/drive/utils.h"
 #include "maidsafe/drive/proto_structs.pb.h"
@@ -40,42 +45,101 @@ namespace detail {
 
 namespace {
 
+std::vector<std::string> SortedChunkNames(const encrypt::DataMap& data_map) {
+  std::vector<std::string> names;
+  names.reserve(data_map.chunks.size());
+  for (const auto& chunk : data_map.chunks)
+    names.emplace_back(std::begin(chunk.hash), std::end(chunk.hash));
+  std::sort(std::begin(names), std::end(names));
+  names.erase(std::unique(std::begin(names), std::end(names)), std::end(names));
+  return names;
+}
+
+// Returns the chunks referenced by the encryptor's data map as of its last flush, or its original
+// data map if it hasn't been flushed yet.
+std::vector<std::string> BaselineChunkNames(const OpenFile& open_file) {
+  return open_file.flushed_chunk_names ?
+         *open_file.flushed_chunk_names :
+         SortedChunkNames(open_file.self_encryptor->original_data_map());
+}
+
+// Returns whether the encryptor's content differs from that of the data map it was opened with.
+// The encryptor must have been flushed.
+bool ContentChanged(const OpenFile& open_file) {
+  const encrypt::DataMap& original(open_file.self_encryptor->original_data_map());
+  const encrypt::DataMap& current(open_file.self_encryptor->data_map());
+  return original.content != current.content ||
+         SortedChunkNames(original) != SortedChunkNames(current);
+}
+
 template <typename PutChunkClosure>
 void FlushEncryptor(FileContext* file_context,
                     PutChunkClosure put_chunk_closure,
-                    std::vector<Identity>& chunks_to_be_incremented) {
-  file_context->self_encryptor->Flush();
-  if (file_context->self_encryptor->original_data_map().chunks.empty()) {
-    // If the original data map didn't contain any chunks, just store the new ones.
-    for (const auto& chunk : file_context->self_encryptor->data_map().chunks) {
-      auto content(
-          file_context->buffer->Get(DataBuffer::KeyType(Identity(chunk.hash), DataTypeId(0))));
-      put_chunk_closure(ImmutableData(content));
+                    std::vector<Identity>& chunks_to_be_incremented,
+                    std::vector<Identity>& chunks_to_be_decremented) {
+  OpenFile& open_file(*file_context->open_file);
+  open_file.self_encryptor->Flush();
+  file_context->meta_data_changed = true;
+  std::vector<std::string> names(SortedChunkNames(open_file.self_encryptor->data_map()));
+  auto diff(DiffChunks(BaselineChunkNames(open_file), names));
+  auto claim([&open_file](const std::string& name) {
+    return open_file.popped_chunks ? open_file.popped_chunks->Claim(name) :
+                                     PoppedChunks::Status::kNotPopped;
+  });
+
+  // Kept chunks already hold a reference, so any extra one from being popped and stored again since
+  // the last flush is surplus.  Added chunks popped since then already have the reference they
+  // need.
+  for (const auto& name : diff.kept) {
+    if (claim(name) == PoppedChunks::Status::kPoppedSinceLastFlush)
+      chunks_to_be_decremented.emplace_back(name);
+  }
+  for (const auto& name : diff.added) {
+    auto popped_status(claim(name));
+    if (popped_status == PoppedChunks::Status::kPoppedSinceLastFlush)
+      continue;
+    if (popped_status == PoppedChunks::Status::kPoppedEarlier) {  // Since dropped and decremented
+      chunks_to_be_incremented.emplace_back(name);
+      continue;
     }
-  } else {
-    // Check each new chunk against the original data map's chunks.  Store the new ones and
-    // increment the reference count on the existing chunks.
-    for (const auto& chunk : file_context->self_encryptor->data_map().chunks) {
-      if (std::any_of(std::begin(file_context->self_encryptor->original_data_map().chunks),
-                      std::end(file_context->self_encryptor->original_data_map().chunks),
-                      [&chunk](const encrypt::ChunkDetails& original_chunk) {
-                            return chunk.hash == original_chunk.hash;
-                      })) {
-        chunks_to_be_incremented.emplace_back(
-                    Identity(std::string(std::begin(chunk.hash), std::end(chunk.hash))));
-      } else {
-        auto content(
-            file_context->buffer->Get(DataBuffer::KeyType(Identity(chunk.hash), DataTypeId(0))));
-        put_chunk_closure(ImmutableData(content));
-      }
+    NonEmptyString content;
+    try {
+      content = open_file.buffer->Get(DataBuffer::KeyType(Identity(name), DataTypeId(0)));
     }
+    catch (const std::exception& e) {
+      if (!open_file.popped_chunks)
+        throw;
+      LOG(kInfo) << "Chunk " << HexSubstr(name) << " is being popped from the buffer for "
+                 << file_context->meta_data.name() << ": " << e.what();
+      open_file.popped_chunks->ExpectPop(name);
+      continue;
+    }
+    put_chunk_closure(ImmutableData(content));
+  }
+  for (const auto& name : diff.dropped)
+    chunks_to_be_decremented.emplace_back(name);
+  if (open_file.popped_chunks) {
+    for (const auto& superseded : open_file.popped_chunks->EndFlush())
+      chunks_to_be_decremented.emplace_back(superseded);
   }
-  if (*file_context->open_count == 0) {
-    file_context->self_encryptor->Close();
-    file_context->self_encryptor.reset();
-    file_context->buffer.reset();
+  open_file.flushed_chunk_names.reset(new std::vector<std::string>(std::move(names)));
+  if (file_context->open_count == 0) {
+    open_file.self_encryptor->Close();
+    file_context->open_file.reset();
   }
-  file_context->flushed = true;
+}
+
+// Few enough that a bucket of missing names is cheap to copy and search, enough that names probed
+// together rarely evict each other.
+const size_t kMissingNamesPerBucket(8);
+
+size_t MissingNameBuckets() {
+  return std::max<size_t>(1, kMaxCachedMissingNames / kMissingNamesPerBucket);
+}
+
+ChildIndex::Entry IndexEntry(std::shared_ptr<FileContext> context) {
+  auto name(context->meta_data.child_name());
+  return ChildIndex::Entry(std::move(name), std::move(context));
 }
 
 }  // unnamed namespace
@@ -92,12 +156,21 @@ Directory::Directory(ParentId parent_id,
     path_(path),
     weakListener(listener),
     chunks_to_be_incremented_(),
+    chunks_to_be_decremented_(),
     versions_(),
     max_versions_(kMaxVersions),
-    children_(),
-    children_count_position_(0),
+    children_(std::make_shared<Children>(nullptr, ChildIndex(), 0, 0)),
+    listing_mutex_(),
+    children_counter_mutex_(),
+    counted_children_(),
+    children_counter_(),
+    missing_names_(nullptr),
     store_state_(StoreState::kComplete),
-    pending_count_(0) {
+    pending_count_(0),
+    stores_complete_(),
+    packs_(),
+    next_pack_id_(1),
+    pending_pack_id_(0) {
 }
 
 Directory::Directory(ParentId parent_id,
@@ -112,17 +185,29 @@ Directory::Directory(ParentId parent_id,
     timer_(io_service), path_(path),
     weakListener(listener),
     chunks_to_be_incremented_(),
+    chunks_to_be_decremented_(),
     versions_(std::begin(versions), std::end(versions)),
     max_versions_(kMaxVersions),
-    children_(),
-    children_count_position_(0),
+    children_(std::make_shared<Children>(nullptr, ChildIndex(), 0, 0)),
+    listing_mutex_(),
+    children_counter_mutex_(),
+    counted_children_(),
+    children_counter_(),
+    missing_names_(nullptr),
     store_state_(StoreState::kComplete),
-    pending_count_(0) {
+    pending_count_(0),
+    stores_complete_(),
+    packs_(),
+    next_pack_id_(1),
+    pending_pack_id_(0) {
 }
 
 Directory::~Directory() {
-  std::unique_lock<std::mutex> lock(mutex_);
-  DoScheduleForStoring(false);
+  {
+    std::unique_lock<boost::shared_mutex> lock(mutex_);
+    DoScheduleForStoring(false);
+  }
+  delete[] missing_names_.load();
 }
 
 void Directory::Initialise(ParentId,
@@ -130,7 +215,7 @@ void Directory::Initialise(ParentId,
                            boost::asio::io_service&,
                            std::weak_ptr<Directory::Listener>,
                            const boost::filesystem::path&) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
   DoScheduleForStoring();
 }
 
@@ -140,68 +225,372 @@ void Directory::Initialise(ParentId,
                            boost::asio::io_service&,
                            std::weak_ptr<Directory::Listener>,
                            const boost::filesystem::path&) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    protobuf::Directory proto_directory;
-    if (!proto_directory.ParseFromString(serialised_directory))
-        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
-
-    directory_id_ = Identity(proto_directory.directory_id());
-    max_versions_ = MaxVersions(proto_directory.max_versions());
+    std::lock_guard<boost::shared_mutex> lock(mutex_);
+    if (!ListingReader::IsListing(serialised_directory)) {
+      std::vector<ChildIndex::Entry> children;
+      InitialiseFromProtobuf(serialised_directory, children);
+      // Protobuf listings written before names were ordered by collation key may be out of order.
+      std::sort(std::begin(children), std::end(children),
+                [](const ChildIndex::Entry& lhs, const ChildIndex::Entry& rhs) {
+                  return CompareCollation(*lhs.name, *rhs.name) < 0;
+                });
+      size_t size(children.size());
+      PublishChildren(ChildIndex(std::move(children)), size);
+      return;
+    }
 
-    for (int i(0); i != proto_directory.children_size(); ++i)
-        children_.emplace_back(new FileContext(MetaData(proto_directory.children(i)),
-                                               shared_from_this()));
-    SortAndResetChildrenCounter();
+    // Only the header and packs are read here; each child is decoded when first looked up.
+    auto listing(std::make_shared<Listing>(serialised_directory));
+    directory_id_ = listing->reader.directory_id();
+    max_versions_ = listing->reader.max_versions();
+    for (uint32_t i(0); i != listing->reader.pack_count(); ++i) {
+      ListingReader::Pack listed_pack(listing->reader.GetPack(i));
+      Pack& pack(packs_[listed_pack.pack_id]);
+      ConvertFromString(listed_pack.serialised_data_map, pack.data_map);
+      pack.size = listed_pack.size;
+      pack.live_size = listed_pack.live_size;
+      next_pack_id_ = std::max(next_pack_id_, listed_pack.pack_id + 1);
+    }
+    size_t size(listing->reader.child_count());
+    std::atomic_store(&children_, std::shared_ptr<const Children>(std::make_shared<Children>(
+                                      std::move(listing), ChildIndex(), size, 0)));
 }
 
-std::string Directory::Serialise() {
+void Directory::InitialiseFromProtobuf(const std::string& serialised_directory,
+                                       std::vector<ChildIndex::Entry>& children) {
   protobuf::Directory proto_directory;
+  if (!proto_directory.ParseFromString(serialised_directory))
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+
+  directory_id_ = Identity(proto_directory.directory_id());
+  max_versions_ = MaxVersions(proto_directory.max_versions());
+
+  bool live_sizes_stored(true);
+  for (int i(0); i != proto_directory.packs_size(); ++i) {
+    const auto& proto_pack(proto_directory.packs(i));
+    Pack& pack(packs_[proto_pack.pack_id()]);
+    ConvertFromString(proto_pack.serialised_data_map(), pack.data_map);
+    pack.size = proto_pack.size();
+    pack.live_size = proto_pack.live_size();
+    live_sizes_stored &= proto_pack.has_live_size();
+    next_pack_id_ = std::max(next_pack_id_, proto_pack.pack_id() + 1);
+  }
+  if (!live_sizes_stored) {
+    for (auto& pack : packs_)
+      pack.second.live_size = 0;
+  }
+
+  // Children are decoded in full and have no cached entry, so the whole listing is rewritten in
+  // the binary format when next stored.
+  children.reserve(proto_directory.children_size());
+  for (int i(0); i != proto_directory.children_size(); ++i) {
+    MetaData meta_data(proto_directory.children(i));
+    if (meta_data.pack_extent) {
+      auto pack(packs_.find(meta_data.pack_extent->pack_id));
+      if (pack == std::end(packs_))
+        BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+      // Listings from before pack live sizes were stored have them recounted from the children.
+      if (!live_sizes_stored)
+        pack->second.live_size += meta_data.pack_extent->length;
+    }
+    children.push_back(
+        IndexEntry(std::make_shared<FileContext>(std::move(meta_data), shared_from_this())));
+  }
+}
+
+std::string Directory::Serialise(std::vector<Identity>& superseded_chunks) {
+  std::string serialised_directory;
   {
-    std::unique_lock<std::mutex> lock(mutex_);
-    proto_directory.set_directory_id(convert::ToString(directory_id_.string()));
-    proto_directory.set_max_versions(max_versions_.data);
-
-    for (const auto& child : children_) {
-      child->meta_data.ToProtobuf(proto_directory.add_children());
-      if (child->self_encryptor) {  // Child is a file which has been opened
-        child->timer->cancel();
+    std::unique_lock<boost::shared_mutex> lock(mutex_);
+    // References are accounted for as deltas: flushing a child stores its new chunks and releases
+    // the ones it no longer uses, while untouched children and packs need nothing at all.
+    Repack(lock);
+    // The lock is released while chunks are stored, so the children may change meanwhile.  Only
+    // children which have been looked up can have been opened.
+    for (const auto& child : ContextsOf(*LoadChildren())) {
+      if (!child->open_file)  // Child isn't a file which has been opened
+        continue;
+      child->open_file->timer.cancel();
+      if (!PackChild(child.get())) {
         FlushEncryptor(child.get(),
                        [this, &lock](const ImmutableData& data) {
                          std::shared_ptr<Directory::Listener> listener = weakListener.lock();
                          listener->PutChunk(data, lock);
                        },
-                       chunks_to_be_incremented_);
-        child->flushed = false;
-      } else if (child->meta_data.data_map) {
-        if (child->flushed) {  // Child is a file which has already been flushed
-          child->flushed = false;
-        } else {  // Child is a file which has not been opened
-          for (const auto& chunk : child->meta_data.data_map->chunks)
-            chunks_to_be_incremented_.emplace_back(
-                        Identity(std::string(std::begin(chunk.hash), std::end(chunk.hash))));
+                       chunks_to_be_incremented_, chunks_to_be_decremented_);
+      }
+    }
+    StorePendingPacks(lock);
+
+    // The lock is held from here on.  Serialised after flushing so that the listing holds the
+    // flushed data maps and pack extents.  Unchanged listed children are copied as they are.
+    const std::shared_ptr<const Children> children(LoadChildren());
+    ListingWriter listing(directory_id_, max_versions_);
+    std::vector<std::pair<std::shared_ptr<FileContext>, uint32_t>> contexts;
+    contexts.reserve(children->size);
+    std::string entry;
+    for (ChildIterator child(*children); !child.AtEnd(); ++child) {
+      if (child.listed()) {
+        uint32_t index(child.listing_index());
+        auto context(std::atomic_load(&children->listing->contexts[index]));
+        if (!context || !context->meta_data_changed.exchange(false)) {
+          listing.AddChild(child.name(), children->listing->reader.Entry(index));
+          contexts.emplace_back(std::move(context), index);
+          continue;
         }
       }
+      auto context(Get(*children, child));
+      context->meta_data_changed = false;
+      entry.clear();
+      context->meta_data.ToListingEntry(&entry);
+      listing.AddChild(child.name(), entry);
+      contexts.emplace_back(std::move(context), 0);
+    }
+
+    for (const auto& pack : packs_) {
+      if (!pack.second.content.empty())  // Pack is still being filled
+        continue;
+      listing.AddPack(pack.first, ConvertToString(pack.second.data_map), pack.second.size,
+                      pack.second.live_size);
     }
+
     std::shared_ptr<Directory::Listener> listener = weakListener.lock();
-    listener->DirectoryIncrementChunks(chunks_to_be_incremented_);
-    chunks_to_be_incremented_.clear();
+    if (!chunks_to_be_incremented_.empty()) {
+      listener->DirectoryIncrementChunks(chunks_to_be_incremented_);
+      chunks_to_be_incremented_.clear();
+    }
+    superseded_chunks.insert(std::end(superseded_chunks), std::begin(chunks_to_be_decremented_),
+                             std::end(chunks_to_be_decremented_));
+    chunks_to_be_decremented_.clear();
 
     store_state_ = StoreState::kOngoing;
+    serialised_directory = listing.Finish();
+    AdoptListing(serialised_directory, *children, contexts);
+  }
+  return serialised_directory;
+}
+
+void Directory::AdoptListing(
+    const std::string& serialised, const Children& children,
+    const std::vector<std::pair<std::shared_ptr<FileContext>, uint32_t>>& contexts) {
+  auto listing(std::make_shared<Listing>(serialised));
+  assert(listing->reader.child_count() == contexts.size());
+  std::lock_guard<std::mutex> lock(listing_mutex_);
+  for (size_t i(0); i != contexts.size(); ++i) {
+    // Children first looked up since they were written have their context in the old listing.
+    listing->contexts[i] = contexts[i].first ? contexts[i].first :
+                           std::atomic_load(&children.listing->contexts[contexts[i].second]);
   }
-  return proto_directory.SerializeAsString();
+  // The names are unchanged, so lookups' cache of missing names and any listing in progress remain
+  // valid.
+  std::atomic_store(&children_, std::shared_ptr<const Children>(std::make_shared<Children>(
+                                    std::move(listing), ChildIndex(), contexts.size(),
+                                    children.generation)));
+}
+
+void Directory::RestoreSupersededChunks(const std::vector<Identity>& superseded_chunks) {
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  chunks_to_be_decremented_.insert(std::end(chunks_to_be_decremented_),
+                                   std::begin(superseded_chunks), std::end(superseded_chunks));
 }
 
 void Directory::FlushChildAndDeleteEncryptor(FileContext* child) {
-  std::unique_lock<std::mutex> lock(mutex_);
-  if (child->self_encryptor)  // Child could already have been flushed via 'Directory::Serialise'
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
+  // Child could already have been flushed via 'Directory::Serialise'
+  if (!child->open_file)
+    return;
+  if (PackChild(child)) {
+    // The new extent and pending pack reach storage with the next store of this directory.
+    DoScheduleForStoring();
+  } else {
     FlushEncryptor(child,
                    [this, &lock](const ImmutableData& data) {
                      std::shared_ptr<Directory::Listener> listener = weakListener.lock();
                      listener->PutChunk(data, lock);
                    },
-                   chunks_to_be_incremented_);
+                   chunks_to_be_incremented_, chunks_to_be_decremented_);
+  }
+}
+
+bool Directory::PackChild(FileContext* child) {
+  if (kMaxPackedFileSize == 0 || child->open_count != 0)
+    return false;
+  assert(!child->meta_data.pack_extent);
+  OpenFile& open_file(*child->open_file);
+  auto size(open_file.self_encryptor->size());
+  if (size == 0 || size > kMaxPackedFileSize)
+    return false;
+  // A file which was only read keeps its chunks; repacking it would rewrite storage for nothing.
+  if (!open_file.self_encryptor->Flush() || !ContentChanged(open_file))
+    return false;
+
+  std::string content(static_cast<size_t>(size), 0);
+  if (!open_file.self_encryptor->Read(&content[0], static_cast<uint32_t>(size), 0)) {
+    LOG(kWarning) << "Failed to read " << child->meta_data.name() << " for packing.";
+    return false;
+  }
+  // The file's chunks, including any streamed to storage while it was open, are superseded by the
+  // pack.
+  for (const auto& name : BaselineChunkNames(open_file))
+    chunks_to_be_decremented_.emplace_back(name);
+  if (open_file.popped_chunks) {
+    for (const auto& superseded : open_file.popped_chunks->EndFlush())
+      chunks_to_be_decremented_.emplace_back(superseded);
+  }
+  open_file.self_encryptor->Close();
+  child->open_file.reset();
+  child->meta_data.data_map.reset(new encrypt::DataMap());
+  AppendToPendingPack(child, content);
+  return true;
+}
+
+void Directory::AppendToPendingPack(FileContext* child, const std::string& content) {
+  auto itr(packs_.find(pending_pack_id_));
+  if (itr != std::end(packs_) && itr->second.size != 0 &&
+      itr->second.size + content.size() > kMaxPackSize) {
+    // The full pack is sealed and stored along with this one by 'StorePendingPacks'.
+    itr = std::end(packs_);
+  }
+  if (itr == std::end(packs_)) {
+    pending_pack_id_ = next_pack_id_++;
+    itr = packs_.emplace(pending_pack_id_, Pack()).first;
+  }
+  child->meta_data.pack_extent.reset(
+      new PackExtent(pending_pack_id_, itr->second.size, content.size()));
+  child->meta_data_changed = true;
+  itr->second.content += content;
+  itr->second.size += content.size();
+  itr->second.live_size += content.size();
+}
+
+std::string Directory::DoReadPacked(const PackExtent& extent, uint64_t offset, uint32_t size,
+                                    std::unique_lock<boost::shared_mutex>& lock) {
+  if (offset >= extent.length)
+    return std::string();
+  size = static_cast<uint32_t>(std::min<uint64_t>(size, extent.length - offset));
+  auto itr(packs_.find(extent.pack_id));
+  if (itr == std::end(packs_))
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::no_such_element));
+  if (!itr->second.content.empty())
+    return itr->second.content.substr(static_cast<size_t>(extent.offset + offset), size);
+  // Copied since the pack may be repacked away while the lock is released.
+  encrypt::DataMap data_map(itr->second.data_map);
+  std::shared_ptr<Directory::Listener> listener = weakListener.lock();
+  return listener->ReadPack(data_map, extent.offset + offset, size, lock);
+}
+
+void Directory::DoReleasePackExtent(const PackExtent& extent) {
+  auto itr(packs_.find(extent.pack_id));
+  if (itr != std::end(packs_)) {
+    assert(itr->second.live_size >= extent.length);
+    itr->second.live_size -= extent.length;
+  }
+}
+
+void Directory::Repack(std::unique_lock<boost::shared_mutex>& lock) {
+  // Only the sparsest pack is rewritten per store, bounding the time the store holds the lock.
+  uint32_t pack_id(0);
+  double live_fraction(0.5);
+  for (const auto& pack : packs_) {
+    if (!pack.second.content.empty() || pack.second.size == 0)
+      continue;
+    double fraction(static_cast<double>(pack.second.live_size) / pack.second.size);
+    if (fraction < live_fraction) {
+      pack_id = pack.first;
+      live_fraction = fraction;
+    }
+  }
+  if (pack_id == 0)
+    return;
+  auto itr(packs_.find(pack_id));
+  std::string content;
+  if (itr->second.live_size != 0) {
+    LOG(kInfo) << "Repacking pack " << pack_id << " of " << path_ << ": "
+               << itr->second.live_size << " of " << itr->second.size << " bytes live.";
+    encrypt::DataMap data_map(itr->second.data_map);
+    auto size(static_cast<uint32_t>(itr->second.size));
+    std::shared_ptr<Directory::Listener> listener = weakListener.lock();
+    content = listener->ReadPack(data_map, 0, size, lock);
+    // Only this drops stored packs, so the pack is still present.
+    itr = packs_.find(pack_id);
+    assert(itr != std::end(packs_));
+  }
+  const std::shared_ptr<const Children> children(LoadChildren());
+  for (ChildIterator itr(*children); !itr.AtEnd(); ++itr) {
+    if (itr.listed() && !std::atomic_load(&children->listing->contexts[itr.listing_index()])) {
+      // Children not yet looked up are only decoded if they are in the pack.
+      bool in_pack(false);
+      std::string entry(children->listing->reader.Entry(itr.listing_index()));
+      ParseListingEntry(entry.data(), entry.size(),
+                        [&](ListingExtra type, const char* value, size_t) {
+                          in_pack |= type == ListingExtra::kPackExtent &&
+                                     ReadUint32(value) == pack_id;
+                        });
+      if (!in_pack)
+        continue;
+    }
+    auto child(Get(*children, itr));
+    if (!child->meta_data.pack_extent || child->meta_data.pack_extent->pack_id != pack_id)
+      continue;
+    std::unique_ptr<PackExtent> extent(std::move(child->meta_data.pack_extent));
+    AppendToPendingPack(child.get(), content.substr(static_cast<size_t>(extent->offset),
+                                                    static_cast<size_t>(extent->length)));
+  }
+  for (const auto& chunk : itr->second.data_map.chunks)
+    chunks_to_be_decremented_.emplace_back(std::string(std::begin(chunk.hash),
+                                                       std::end(chunk.hash)));
+  packs_.erase(itr);
+}
+
+void Directory::StorePendingPacks(std::unique_lock<boost::shared_mutex>& lock) {
+  // Packs started while the lock is released are left for the next store.
+  pending_pack_id_ = 0;
+  std::vector<uint32_t> unstored_packs;
+  for (const auto& pack : packs_) {
+    if (!pack.second.content.empty())
+      unstored_packs.push_back(pack.first);
+  }
+  std::shared_ptr<Directory::Listener> listener = weakListener.lock();
+  for (auto pack_id : unstored_packs) {
+    auto itr(packs_.find(pack_id));
+    if (itr->second.live_size == 0) {
+      packs_.erase(itr);
+      continue;
+    }
+    // The pack is no longer pending, so its content is left untouched while the lock is released.
+    encrypt::DataMap data_map(listener->PutPack(itr->second.content, lock));
+    itr = packs_.find(pack_id);
+    assert(itr != std::end(packs_));
+    itr->second.data_map = std::move(data_map);
+    std::string().swap(itr->second.content);
+  }
+}
+
+void Directory::ReleaseContent(FileContext* child) {
+  if (child->meta_data.pack_extent) {
+    DoReleasePackExtent(*child->meta_data.pack_extent);
+    child->meta_data.pack_extent.reset();
+  }
+  if (child->open_file) {
+    child->open_file->timer.cancel();
+    for (const auto& name : BaselineChunkNames(*child->open_file))
+      chunks_to_be_decremented_.emplace_back(name);
+    if (child->open_file->popped_chunks) {
+      for (const auto& superseded : child->open_file->popped_chunks->EndFlush())
+        chunks_to_be_decremented_.emplace_back(superseded);
+    }
+    child->open_file.reset();
+  } else if (child->meta_data.data_map) {
+    for (const auto& chunk : child->meta_data.data_map->chunks)
+      chunks_to_be_decremented_.emplace_back(std::string(std::begin(chunk.hash),
+                                                         std::end(chunk.hash)));
+  }
+  if (child->meta_data.data_map)
+    child->meta_data.data_map.reset(new encrypt::DataMap());
+  child->meta_data_changed = true;
 }
 
+
 size_t Directory::VersionsCount() const {
   return versions_.size();
 }
@@ -210,7 +599,7 @@ std::tuple<DirectoryId, StructuredDataVersions::VersionName>
     Directory::InitialiseVersions(Identity version_id) {
   std::tuple<DirectoryId, StructuredDataVersions::VersionName> result;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<boost::shared_mutex> lock(mutex_);
     store_state_ = StoreState::kComplete;
     if (versions_.empty()) {
       versions_.emplace_back(0, version_id);
@@ -227,7 +616,7 @@ std::tuple<DirectoryId, StructuredDataVersions::VersionName, StructuredDataVersi
   std::tuple<DirectoryId, StructuredDataVersions::VersionName,
              StructuredDataVersions::VersionName> result;
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<boost::shared_mutex> lock(mutex_);
     store_state_ = StoreState::kComplete;
     if (versions_.empty()) {
       versions_.emplace_back(0, version_id);
@@ -243,24 +632,219 @@ std::tuple<DirectoryId, StructuredDataVersions::VersionName, StructuredDataVersi
   return result;
 }
 
-Directory::Children::iterator Directory::Find(const fs::path& name) {
-  return std::find_if(std::begin(children_), std::end(children_),
-                      [&name](const Children::value_type& file_context) {
-                           return file_context->meta_data.name == name; });
+std::shared_ptr<const Directory::Children> Directory::LoadChildren() const {
+  return std::atomic_load(&children_);
+}
+
+void Directory::PublishChildren(ChildIndex index, size_t size) {
+  std::shared_ptr<const Children> current(LoadChildren());
+  std::shared_ptr<const Children> children(std::make_shared<Children>(
+      current->listing, std::move(index), size, current->generation + 1));
+  std::atomic_store(&children_, std::move(children));
+}
+
+std::shared_ptr<FileContext> Directory::Lookup(const fs::path& name) const {
+  const std::shared_ptr<const Children> children(LoadChildren());
+  if (kMaxCachedMissingNames == 0)
+    return FindIn(*children, ChildName(name));
+  const uint64_t generation(children->generation);
+  const size_t bucket(std::hash<fs::path::string_type>()(name.native()) % MissingNameBuckets());
+  std::shared_ptr<const MissingNames>* missing_names(missing_names_.load());
+  std::shared_ptr<const MissingNames> missing;
+  if (missing_names) {
+    missing = std::atomic_load(&missing_names[bucket]);
+    if (missing && missing->generation != generation)
+      missing.reset();
+    if (missing && std::find(std::begin(missing->names), std::end(missing->names),
+                             name.native()) != std::end(missing->names)) {
+      return nullptr;
+    }
+  }
+
+  auto child(FindIn(*children, ChildName(name)));
+  if (child)
+    return child;
+
+  if (!missing_names) {
+    std::unique_ptr<std::shared_ptr<const MissingNames>[]> created(
+        new std::shared_ptr<const MissingNames>[MissingNameBuckets()]);
+    // On losing a race to create the buckets, 'missing_names' is set to the winner's.
+    if (missing_names_.compare_exchange_strong(missing_names, created.get()))
+      missing_names = created.release();
+  }
+  auto updated(std::make_shared<MissingNames>());
+  updated->generation = generation;
+  updated->names.reserve(kMissingNamesPerBucket);
+  updated->names.push_back(name.native());
+  if (missing) {
+    size_t kept(std::min(missing->names.size(), kMissingNamesPerBucket - 1));
+    updated->names.insert(std::end(updated->names), std::begin(missing->names),
+                          std::begin(missing->names) + kept);
+  }
+  // A concurrent miss in the same bucket may be overwritten here; that only costs it another
+  // search next time.
+  std::atomic_store(&missing_names[bucket],
+                    std::shared_ptr<const MissingNames>(std::move(updated)));
+  return nullptr;
+}
+
+std::shared_ptr<FileContext> Directory::FindIn(const Children& children,
+                                               const ChildName& name) const {
+  const ChildIndex::Entry* entry(children.index.Find(name));
+  if (entry)
+    return entry->context;
+  if (!children.listing)
+    return nullptr;
+  uint32_t index(children.listing->reader.Find(name));
+  if (index == children.listing->reader.child_count())
+    return nullptr;
+  return GetListed(*children.listing, index, name.name);
+}
+
+std::shared_ptr<FileContext> Directory::Get(const Children& children,
+                                            const ChildIterator& child) const {
+  return child.listed() ? GetListed(*children.listing, child.listing_index(), child.name()) :
+                          child.entry().context;
+}
+
+std::shared_ptr<FileContext> Directory::GetListed(const Listing& listing, uint32_t index,
+                                                  const fs::path& name) const {
+  auto context(std::atomic_load(&listing.contexts[index]));
+  if (context)
+    return context;
+  std::lock_guard<std::mutex> lock(listing_mutex_);
+  return FindCurrentLocked(std::make_shared<ChildName>(name));
+}
+
+std::shared_ptr<FileContext> Directory::FindCurrentLocked(
+    std::shared_ptr<const ChildName> name) const {
+  // 'listing' may have been replaced by a store since it was loaded, so the child is looked up
+  // again in the current children; it may also have been removed or renamed meanwhile.
+  const std::shared_ptr<const Children> children(LoadChildren());
+  const ChildIndex::Entry* entry(children->index.Find(*name));
+  if (entry)
+    return entry->context;
+  if (!children->listing)
+    return nullptr;
+  const Listing& listing(*children->listing);
+  uint32_t index(listing.reader.Find(*name));
+  if (index == listing.reader.child_count())
+    return nullptr;
+  auto context(std::atomic_load(&listing.contexts[index]));
+  if (context)
+    return context;
+  std::string serialised(listing.reader.Entry(index));
+  context = std::make_shared<FileContext>(
+      MetaData(std::move(name), serialised.data(), serialised.size()),
+      std::const_pointer_cast<Directory>(shared_from_this()));
+  context->meta_data_changed = false;
+  std::atomic_store(&listing.contexts[index], context);
+  return context;
+}
+
+std::vector<std::shared_ptr<FileContext>> Directory::ContextsOf(const Children& children) {
+  std::vector<std::shared_ptr<FileContext>> contexts;
+  for (ChildIndex::Iterator entry(children.index); !entry.AtEnd(); ++entry) {
+    if (entry->context)
+      contexts.push_back(entry->context);
+  }
+  if (children.listing) {
+    for (uint32_t i(0); i != children.listing->reader.child_count(); ++i) {
+      auto context(std::atomic_load(&children.listing->contexts[i]));
+      if (context)
+        contexts.push_back(std::move(context));
+    }
+  }
+  // A renamed listed child is in both, and the context of a removed one is left in the listing.
+  std::sort(std::begin(contexts), std::end(contexts));
+  contexts.erase(std::unique(std::begin(contexts), std::end(contexts)), std::end(contexts));
+  return contexts;
+}
+
+ChildIndex Directory::Without(const Children& children, std::shared_ptr<const ChildName> name) {
+  // A listed child is removed by an entry without a context, which overrides it.
+  if (children.listing &&
+      children.listing->reader.Find(*name) != children.listing->reader.child_count()) {
+    return children.index.Insert(ChildIndex::Entry(std::move(name), nullptr));
+  }
+  return children.index.Erase(*name);
+}
+
+Directory::Listing::Listing(const std::string& serialised_in)
+    : serialised(serialised_in),
+      reader(serialised),
+      contexts(new std::shared_ptr<FileContext>[reader.child_count()]) {}
+
+Directory::ChildIterator::ChildIterator(const Children& children)
+    : children_(children),
+      names_(),
+      listed_path_(),
+      listed_name_(),
+      entries_(children.index),
+      listed_(false) {
+  if (children.listing) {
+    names_.reset(new ListingReader::NameIterator(children.listing->reader, 0));
+    if (!names_->AtEnd())
+      listed_path_ = NameFromProtobuf(names_->name());
+  }
+  Settle();
+}
+
+const fs::path& Directory::ChildIterator::name() const {
+  assert(!AtEnd());
+  return listed_ ? listed_path_ : entries_->name->name;
+}
+
+Directory::ChildIterator& Directory::ChildIterator::operator++() {
+  assert(!AtEnd());
+  if (listed_)
+    AdvanceName();
+  else
+    ++entries_;
+  Settle();
+  return *this;
 }
 
-Directory::Children::const_iterator Directory::Find(const fs::path& name) const {
-  return std::find_if(std::begin(children_), std::end(children_),
-                      [&name](const Children::value_type& file_context) {
-                           return file_context->meta_data.name == name; });
+void Directory::ChildIterator::AdvanceName() {
+  ++*names_;
+  listed_name_.reset();
+  if (!names_->AtEnd())
+    listed_path_ = NameFromProtobuf(names_->name());
+}
+
+void Directory::ChildIterator::Settle() {
+  for (;;) {
+    if (!names_ || names_->AtEnd()) {
+      while (!entries_.AtEnd() && !entries_->context)
+        ++entries_;
+      listed_ = false;
+      return;
+    }
+    // Collation keys are only needed once there are entries to merge.
+    if (entries_.AtEnd()) {
+      listed_ = true;
+      return;
+    }
+    if (!listed_name_)
+      listed_name_.reset(new ChildName(listed_path_));
+    int order(CompareCollation(*listed_name_, *entries_->name));
+    if (order < 0) {
+      listed_ = true;
+      return;
+    }
+    if (order == 0)  // The listed child is replaced or removed by the entry.
+      AdvanceName();
+    if (entries_->context) {
+      listed_ = false;
+      return;
+    }
+    ++entries_;
+  }
 }
 
 void Directory::SortAndResetChildrenCounter() {
-  std::sort(std::begin(children_), std::end(children_),
-            [](const std::unique_ptr<FileContext>& lhs, const std::unique_ptr<FileContext>& rhs) {
-              return *lhs < *rhs;
-            });
-  children_count_position_ = 0;
+  // The children are always in order.
+  ResetChildrenCounter();
 }
 
 void Directory::DoScheduleForStoring(bool use_delay) {
@@ -305,7 +889,7 @@ void Directory::DoScheduleForStoring(bool use_delay) {
 }
 
 void Directory::ProcessTimer(const boost::system::error_code& ec) {
-  std::unique_lock<std::mutex> lock(mutex_);
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
   switch (ec.value()) {
     case 0: {
       LOG(kInfo) << "Storing " << path_ << ", " << ec;
@@ -320,134 +904,268 @@ void Directory::ProcessTimer(const boost::system::error_code& ec) {
       LOG(kWarning) << "Timer aborted with error code " << ec;
       break;
   }
-  // Update pending parent change
+  ApplyNewParent();
+  if (--pending_count_ == 0)
+    stores_complete_.notify_all();
+}
+
+void Directory::ApplyNewParent() {
   if (newParent_) {
     parent_id_ = newParent_->parent_id_;
     path_ = newParent_->path_;
     newParent_ = nullptr;
   }
-  --pending_count_;
 }
 
 bool Directory::HasChild(const fs::path& name) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return std::any_of(std::begin(children_), std::end(children_),
-      [&name](const Children::value_type& file_context) {
-          return file_context->meta_data.name == name; });
+  return Lookup(name) != nullptr;
 }
 
 const FileContext* Directory::GetChild(const fs::path& name) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto itr(Find(name));
-  if (itr == std::end(children_))
+  const FileContext* child(FindChild(name));
+  if (!child)
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, the buffer
-  // and encryptor should be non-null.
-  assert(*(*itr)->open_count == 0 || (*(*itr)->open_count > 0 &&
-      ((*itr)->meta_data.directory_id ||
-          ((*itr)->buffer && (*itr)->self_encryptor && (*itr)->timer))));
-  return itr->get();
+  return child;
+}
+
+const FileContext* Directory::FindChild(const fs::path& name) const {
+  const FileContext* child(Lookup(name).get());
+  if (!child)
+    return nullptr;
+  // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, an inline
+  // file or a packed file, the buffer and encryptor should be non-null.
+  assert(child->open_count == 0 || (child->open_count > 0 &&
+      (child->meta_data.directory_id || child->meta_data.inline_content ||
+          child->meta_data.pack_extent ||
+          (child->open_file && child->open_file->buffer && child->open_file->self_encryptor))));
+  return child;
 }
 
 FileContext* Directory::GetMutableChild(const fs::path& name) {
   SCOPED_PROFILE
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto itr(Find(name));
-  if (itr == std::end(children_))
+  FileContext* child(Lookup(name).get());
+  if (!child)
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, the buffer
-  // and encryptor should be non-null.
-  assert(*(*itr)->open_count == 0 || (*(*itr)->open_count > 0 &&
-      ((*itr)->meta_data.directory_id ||
-          ((*itr)->buffer && (*itr)->self_encryptor && (*itr)->timer))));
-  return itr->get();
+  // The open_count must be >=0.  If > 0 and the context doesn't represent a directory, an inline
+  // file or a packed file, the buffer and encryptor should be non-null.
+  assert(child->open_count == 0 || (child->open_count > 0 &&
+      (child->meta_data.directory_id || child->meta_data.inline_content ||
+          child->meta_data.pack_extent ||
+          (child->open_file && child->open_file->buffer && child->open_file->self_encryptor))));
+  return child;
 }
 
 const FileContext* Directory::GetChildAndIncrementCounter() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  if (children_count_position_ < children_.size()) {
-    const FileContext* file_context(children_[children_count_position_].get());
-    ++children_count_position_;
-    return file_context;
+  std::lock_guard<std::mutex> lock(children_counter_mutex_);
+  std::shared_ptr<const Children> children(LoadChildren());
+  // Any change to the children restarts the listing.
+  if (!children_counter_ || counted_children_->generation != children->generation) {
+    counted_children_ = std::move(children);
+    children_counter_.reset(new ChildIterator(*counted_children_));
   }
-  return nullptr;
+  if (children_counter_->AtEnd())
+    return nullptr;
+  // Held by the listing or index the counter is in, which the directory keeps.
+  const FileContext* child(Get(*counted_children_, *children_counter_).get());
+  ++*children_counter_;
+  return child;
+}
+
+std::vector<std::pair<fs::path, DirectoryId>> Directory::ChildDirectories() const {
+  const std::shared_ptr<const Children> children(LoadChildren());
+  std::vector<std::pair<fs::path, DirectoryId>> child_directories;
+  for (ChildIterator child(*children); !child.AtEnd(); ++child) {
+    std::shared_ptr<FileContext> context;
+    if (child.listed())
+      context = std::atomic_load(&children->listing->contexts[child.listing_index()]);
+    else
+      context = child.entry().context;
+    if (context) {
+      if (context->meta_data.directory_id)
+        child_directories.emplace_back(child.name(), *context->meta_data.directory_id);
+      continue;
+    }
+    // Read from the listing, leaving the child undecoded.
+    std::string entry(children->listing->reader.Entry(child.listing_index()));
+    ParseListingEntry(entry.data(), entry.size(),
+                      [&](ListingExtra type, const char* value, size_t size) {
+                        if (type == ListingExtra::kDirectoryId)
+                          child_directories.emplace_back(child.name(),
+                                                         DirectoryId(std::string(value, size)));
+                      });
+  }
+  return child_directories;
 }
 
 void Directory::AddChild(FileContext&& child) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto itr(Find(child.meta_data.name));
-  if (itr != std::end(children_))
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  const std::shared_ptr<const Children> children(LoadChildren());
+  auto name(child.meta_data.child_name());
+  if (FindIn(*children, *name))
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::file_exists));
   child.parent = shared_from_this();
-  children_.emplace_back(new FileContext(std::move(child)));
-  SortAndResetChildrenCounter();
+  auto context(std::make_shared<FileContext>(std::move(child)));
+  context->meta_data_changed = true;
+  if (context->unpacked_content) {
+    std::unique_ptr<std::string> content(std::move(context->unpacked_content));
+    AppendToPendingPack(context.get(), *content);
+  }
+  PublishChildren(children->index.Insert(ChildIndex::Entry(std::move(name), std::move(context))),
+                  children->size + 1);
   DoScheduleForStoring();
 }
 
 FileContext Directory::RemoveChild(const fs::path& name) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto itr(Find(name));
-  if (itr == std::end(children_))
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
+  const std::shared_ptr<const Children> children(LoadChildren());
+  auto child_name(std::make_shared<ChildName>(name));
+  std::shared_ptr<FileContext> child(FindIn(*children, *child_name));
+  if (!child)
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  FileContext file_context(std::move(*(*itr)));
-  children_.erase(itr);
-  SortAndResetChildrenCounter();
+  // The child is detached before its context is moved from, so no new lookup can reach the husk.
+  // As with any pointer to a child, one returned by a lookup already in progress must not be used
+  // once the child has been removed.
+  PublishChildren(Without(*children, std::move(child_name)), children->size - 1);
+  FileContext file_context(std::move(*child));
   DoScheduleForStoring();
+  if (file_context.meta_data.pack_extent) {
+    // The pack belongs to this directory, so the content has to travel with the file.
+    std::unique_ptr<PackExtent> extent(std::move(file_context.meta_data.pack_extent));
+    file_context.unpacked_content.reset(new std::string(
+        DoReadPacked(*extent, 0, static_cast<uint32_t>(extent->length), lock)));
+    DoReleasePackExtent(*extent);
+  }
   return std::move(file_context);
 }
 
+void Directory::DeleteChild(const fs::path& name) {
+  // Declared before the lock so that the child is destroyed after the lock is released.
+  std::shared_ptr<FileContext> child;
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  const std::shared_ptr<const Children> children(LoadChildren());
+  auto child_name(std::make_shared<ChildName>(name));
+  child = FindIn(*children, *child_name);
+  if (!child)
+    BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
+  PublishChildren(Without(*children, std::move(child_name)), children->size - 1);
+  ReleaseContent(child.get());
+  DoScheduleForStoring();
+}
+
 void Directory::RenameChild(const fs::path& old_name, const fs::path& new_name) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  assert(Find(new_name) == std::end(children_));
-  auto itr(Find(old_name));
-  if (itr == std::end(children_))
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  const std::shared_ptr<const Children> children(LoadChildren());
+  assert(!FindIn(*children, ChildName(new_name)));
+  auto old_child_name(std::make_shared<ChildName>(old_name));
+  std::shared_ptr<FileContext> child(FindIn(*children, *old_child_name));
+  if (!child)
     BOOST_THROW_EXCEPTION(MakeError(DriveErrors::no_such_file));
-  (*itr)->meta_data.name = new_name;
-  SortAndResetChildrenCounter();
+  child->meta_data.SetName(new_name);
+  child->meta_data_changed = true;
+  PublishChildren(
+      Without(*children, std::move(old_child_name)).Insert(IndexEntry(std::move(child))),
+      children->size);
   DoScheduleForStoring();
 }
 
 void Directory::ResetChildrenCounter() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  children_count_position_ = 0;
+  std::lock_guard<std::mutex> lock(children_counter_mutex_);
+  children_counter_.reset();
+  counted_children_.reset();
 }
 
 bool Directory::empty() const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return children_.empty();
+  return LoadChildren()->size == 0;
 }
 
 ParentId Directory::parent_id() const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  boost::shared_lock<boost::shared_mutex> lock(mutex_);
   return parent_id_;
 }
 
 void Directory::SetNewParent(const ParentId parent_id,
                              const boost::filesystem::path& path) {
-  std::unique_lock<std::mutex> lock(mutex_);
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
   newParent_.reset(new NewParent(parent_id, path));
 }
 
 DirectoryId Directory::directory_id() const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  boost::shared_lock<boost::shared_mutex> lock(mutex_);
   return directory_id_;
 }
 
 void Directory::ScheduleForStoring() {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
   DoScheduleForStoring();
 }
 
 void Directory::StoreImmediatelyIfPending() {
-  std::lock_guard<std::mutex> lock(mutex_);
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
   DoScheduleForStoring(false);
 }
 
 bool Directory::HasPending() const {
-  std::lock_guard<std::mutex> lock(mutex_);
+  boost::shared_lock<boost::shared_mutex> lock(mutex_);
   return (pending_count_ != 0);
 }
 
+void Directory::CompletePendingStores() {
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
+  DoScheduleForStoring(false);
+  stores_complete_.wait(lock, [this] { return pending_count_ == 0; });
+  ApplyNewParent();
+}
+
+bool Directory::CanBeEvicted() const {
+  boost::shared_lock<boost::shared_mutex> lock(mutex_);
+  if (store_state_ != StoreState::kComplete || pending_count_ != 0 || newParent_ ||
+      pending_pack_id_ != 0 || !chunks_to_be_incremented_.empty() ||
+      !chunks_to_be_decremented_.empty()) {
+    return false;
+  }
+  // Sealed packs are only held in memory until stored.
+  if (std::any_of(std::begin(packs_), std::end(packs_),
+                  [](const std::pair<const uint32_t, Pack>& pack) {
+                    return !pack.second.content.empty();
+                  })) {
+    return false;
+  }
+  // Only children which have been looked up can have changed.
+  for (const auto& child : ContextsOf(*LoadChildren())) {
+    if (child->open_count != 0 || child->open_file || child->meta_data_changed)
+      return false;
+  }
+  return true;
+}
+
+std::string Directory::ReadPackedChild(const FileContext* child, uint64_t offset, uint32_t size) {
+  std::unique_lock<boost::shared_mutex> lock(mutex_);
+  if (!child->meta_data.pack_extent)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  PackExtent extent(*child->meta_data.pack_extent);
+  return DoReadPacked(extent, offset, size, lock);
+}
+
+void Directory::DiscardChildContent(FileContext* child) {
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  assert(!child->meta_data.directory_id);
+  ReleaseContent(child);
+  child->meta_data.data_map.reset(new encrypt::DataMap());
+  if (kMaxInlineFileSize != 0)
+    child->meta_data.inline_content.reset(new std::string());
+  DoScheduleForStoring();
+}
+
+void Directory::ReleasePackExtent(FileContext* child) {
+  std::lock_guard<boost::shared_mutex> lock(mutex_);
+  if (!child->meta_data.pack_extent)
+    return;
+  DoReleasePackExtent(*child->meta_data.pack_extent);
+  child->meta_data.pack_extent.reset();
+  child->meta_data_changed = true;
+  DoScheduleForStoring();
+}
+
 bool operator<(const Directory& lhs, const Directory& rhs) {
   return lhs.directory_id() < rhs.directory_id();
 }
@@ -28,22 +28,64 @@ namespace drive {
 
 namespace detail {
 
+PoppedChunks::PoppedChunks() : mutex_(), unclaimed_(), stored_(), expected_() {}
+
+void PoppedChunks::Add(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (expected_.erase(name) != 0)
+    stored_.insert(name);
+  else
+    unclaimed_.insert(name);
+}
+
+PoppedChunks::Status PoppedChunks::Claim(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (unclaimed_.erase(name) != 0) {
+    stored_.insert(name);
+    return Status::kPoppedSinceLastFlush;
+  }
+  return stored_.count(name) != 0 ? Status::kPoppedEarlier : Status::kNotPopped;
+}
+
+void PoppedChunks::ExpectPop(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  expected_.insert(name);
+}
+
+std::vector<std::string> PoppedChunks::EndFlush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> superseded(std::begin(unclaimed_), std::end(unclaimed_));
+  unclaimed_.clear();
+  return superseded;
+}
+
+OpenFile::OpenFile(boost::asio::io_service& io_service)
+    : timer(io_service), buffer_reservation(), popped_chunks(), buffer(), self_encryptor(),
+      flushed_chunk_names() {}
+
+OpenFile::~OpenFile() {
+  self_encryptor.reset();
+  buffer.reset();
+  buffer_reservation.reset();
+}
+
 FileContext::FileContext()
-    : meta_data(), buffer(), self_encryptor(), timer(), open_count(new std::atomic<int>(0)),
-      parent(), flushed(false) {}
+    : meta_data(), meta_data_changed(true), open_count(0), open_file(), unpacked_content(),
+      parent() {}
 
 FileContext::FileContext(FileContext&& other)
-    : meta_data(std::move(other.meta_data)), buffer(std::move(other.buffer)),
-      self_encryptor(std::move(other.self_encryptor)), timer(std::move(other.timer)),
-      open_count(std::move(other.open_count)), parent(other.parent), flushed(other.flushed) {}
+    : meta_data(std::move(other.meta_data)),
+      meta_data_changed(other.meta_data_changed.load()), open_count(other.open_count.load()),
+      open_file(std::move(other.open_file)), unpacked_content(std::move(other.unpacked_content)),
+      parent(other.parent) {}
 
 FileContext::FileContext(MetaData meta_data_in, std::shared_ptr<Directory> parent_in)
-    : meta_data(std::move(meta_data_in)), buffer(), self_encryptor(), timer(),
-      open_count(new std::atomic<int>(0)), parent(parent_in), flushed(false) {}
+    : meta_data(std::move(meta_data_in)), meta_data_changed(true), open_count(0), open_file(),
+      unpacked_content(), parent(parent_in) {}
 
 FileContext::FileContext(const boost::filesystem::path& name, bool is_directory)
-    : meta_data(name, is_directory), buffer(), self_encryptor(), timer(),
-      open_count(new std::atomic<int>(0)), parent(), flushed(false) {}
+    : meta_data(name, is_directory), meta_data_changed(true), open_count(0), open_file(),
+      unpacked_content(), parent() {}
 
 FileContext& FileContext::operator=(FileContext other) {
   swap(*this, other);
@@ -51,8 +93,8 @@ FileContext& FileContext::operator=(FileContext other) {
 }
 
 FileContext::~FileContext() {
-  if (timer) {
-    timer->cancel();
+  if (open_file) {
+    open_file->timer.cancel();
     Flush();
   }
 }
@@ -65,6 +107,7 @@ void FileContext::Flush() {
 }
 
 void FileContext::ScheduleForStoring() {
+  meta_data_changed = true;
   std::shared_ptr<Directory> p = parent.lock();
   if (p) {
       p->ScheduleForStoring();
@@ -74,16 +117,16 @@ void FileContext::ScheduleForStoring() {
 void swap(FileContext& lhs, FileContext& rhs) MAIDSAFE_NOEXCEPT {
   using std::swap;
   swap(lhs.meta_data, rhs.meta_data);
-  swap(lhs.buffer, rhs.buffer);
-  swap(lhs.self_encryptor, rhs.self_encryptor);
-  swap(lhs.timer, rhs.timer);
-  swap(lhs.open_count, rhs.open_count);
+  // Atomics can't be swapped as a whole; contexts are only swapped while neither is shared.
+  lhs.meta_data_changed = rhs.meta_data_changed.exchange(lhs.meta_data_changed);
+  lhs.open_count = rhs.open_count.exchange(lhs.open_count);
+  swap(lhs.open_file, rhs.open_file);
+  swap(lhs.unpacked_content, rhs.unpacked_content);
   swap(lhs.parent, rhs.parent);
-  swap(lhs.flushed, rhs.flushed);
 }
 
 bool operator<(const FileContext& lhs, const FileContext& rhs) {
-  return lhs.meta_data.name < rhs.meta_data.name;
+  return lhs.meta_data < rhs.meta_data;
 }
 
 }  // namespace detail
@@ -0,0 +1,422 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include "maidsafe/drive/listing.h"
+
+#include <algorithm>
+#include <cctype>
+#include <initializer_list>
+#include <limits>
+
+#include "maidsafe/common/convert.h"
+#include "maidsafe/common/error.h"
+
+#include "maidsafe/drive/meta_data.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace {
+
+const char kMagic[] = { 'M', 'S', 'D', 'L' };
+const uint32_t kVersion(1);
+const size_t kHeaderSize(sizeof(kMagic) + 7 * sizeof(uint32_t));
+const size_t kRecordSize(96);
+const size_t kPackRecordSize(28);
+const uint32_t kRestartInterval(16);
+const uint32_t kNanosecondsPerSecond(1000000000);
+// Offsets within a child record of the location of its extras in the listing.
+const size_t kRecordExtrasOffset(88), kRecordExtrasSize(92);
+
+void ThrowParsingError() {
+  BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+}
+
+void WriteUint32(uint32_t value, char* output) {
+  for (int i(0); i != 4; ++i)
+    output[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+uint16_t ReadUint16(const char* input) {
+  return static_cast<uint16_t>(static_cast<unsigned char>(input[0]) |
+                               (static_cast<unsigned char>(input[1]) << 8));
+}
+
+void AppendUint16(uint16_t value, std::string* output) {
+  output->push_back(static_cast<char>(value & 0xFF));
+  output->push_back(static_cast<char>(value >> 8));
+}
+
+uint32_t CheckedSize(size_t size) {
+  if (size > std::numeric_limits<uint32_t>::max())
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  return static_cast<uint32_t>(size);
+}
+
+// Three-way comparison of a name as held in the listing with 'name'.  The collation key of an ASCII
+// name is its upper case, so such names are compared in place; others are decoded first.
+int CompareListedName(const std::string& listed, const ChildName& name) {
+  bool ascii(listed != "\\" && listed != "/");
+  for (size_t i(0); ascii && i != listed.size(); ++i)
+    ascii = static_cast<unsigned char>(listed[i]) < 0x80;
+  if (!ascii)
+    return CompareCollation(ChildName(NameFromProtobuf(listed)), name);
+
+  const std::wstring& key(name.collation_key);
+  for (size_t i(0); i != listed.size() && i != key.size(); ++i) {
+    auto upper(static_cast<wchar_t>(std::toupper(static_cast<unsigned char>(listed[i]))));
+    if (upper != key[i])
+      return upper < key[i] ? -1 : 1;
+  }
+  if (listed.size() != key.size())
+    return listed.size() < key.size() ? -1 : 1;
+  typedef fs::path::value_type Char;
+  const fs::path::string_type& native(name.name.native());
+  for (size_t i(0); i != listed.size() && i != native.size(); ++i) {
+    auto listed_char(static_cast<Char>(listed[i]));
+    if (listed_char != native[i])
+      return std::char_traits<Char>::lt(listed_char, native[i]) ? -1 : 1;
+  }
+  return listed.size() == native.size() ? 0 : (listed.size() < native.size() ? -1 : 1);
+}
+
+ListingTime ReadTime(const char* seconds, const char* nanoseconds) {
+  ListingTime time(static_cast<int64_t>(ReadUint64(seconds)), ReadUint32(nanoseconds));
+  if (time.nanoseconds >= kNanosecondsPerSecond)
+    ThrowParsingError();
+  return time;
+}
+
+void ReadFields(const char* input, ListingRecord& record) {
+  uint32_t* fields[] = { &record.mode, &record.win_attributes, &record.dev, &record.ino,
+                         &record.nlink, &record.uid, &record.gid, &record.rdev, &record.blksize };
+  for (size_t i(0); i != sizeof(fields) / sizeof(fields[0]); ++i)
+    *fields[i] = ReadUint32(input + 4 * i);
+}
+
+}  // unnamed namespace
+
+ListingRecord::ListingRecord()
+    : size(0), blocks(0), creation_time(), last_access_time(), last_write_time(), mode(0),
+      win_attributes(0), dev(0), ino(0), nlink(0), uid(0), gid(0), rdev(0), blksize(0) {}
+
+void AppendUint32(uint32_t value, std::string* output) {
+  char bytes[4];
+  WriteUint32(value, bytes);
+  output->append(bytes, sizeof(bytes));
+}
+
+void AppendUint64(uint64_t value, std::string* output) {
+  AppendUint32(static_cast<uint32_t>(value & 0xFFFFFFFF), output);
+  AppendUint32(static_cast<uint32_t>(value >> 32), output);
+}
+
+uint32_t ReadUint32(const char* input) {
+  uint32_t value(0);
+  for (int i(3); i >= 0; --i)
+    value = (value << 8) | static_cast<unsigned char>(input[i]);
+  return value;
+}
+
+uint64_t ReadUint64(const char* input) {
+  return static_cast<uint64_t>(ReadUint32(input)) |
+         (static_cast<uint64_t>(ReadUint32(input + 4)) << 32);
+}
+
+void AppendListingRecord(const ListingRecord& record, std::string* entry) {
+  AppendUint64(record.size, entry);
+  AppendUint64(record.blocks, entry);
+  const ListingTime* times[] = { &record.creation_time, &record.last_access_time,
+                                &record.last_write_time };
+  for (const ListingTime* listing_time : times)
+    AppendUint64(static_cast<uint64_t>(listing_time->seconds), entry);
+  for (const ListingTime* listing_time : times)
+    AppendUint32(listing_time->nanoseconds, entry);
+  for (uint32_t value : { record.mode, record.win_attributes, record.dev, record.ino,
+                          record.nlink, record.uid, record.gid, record.rdev, record.blksize })
+    AppendUint32(value, entry);
+  // The extras' location is filled in by the listing writer.
+  AppendUint32(0, entry);
+  AppendUint32(0, entry);
+}
+
+void AppendListingExtra(ListingExtra type, const std::string& value, std::string* entry) {
+  entry->push_back(static_cast<char>(type));
+  AppendUint32(CheckedSize(value.size()), entry);
+  entry->append(value);
+}
+
+ListingRecord ParseListingEntry(
+    const char* entry, size_t size,
+    const std::function<void(ListingExtra, const char*, size_t)>& functor) {
+  if (size < kRecordSize)
+    ThrowParsingError();
+  ListingRecord record;
+  record.size = ReadUint64(entry);
+  record.blocks = ReadUint64(entry + 8);
+  record.creation_time = ReadTime(entry + 16, entry + 40);
+  record.last_access_time = ReadTime(entry + 24, entry + 44);
+  record.last_write_time = ReadTime(entry + 32, entry + 48);
+  ReadFields(entry + 52, record);
+
+  size_t offset(kRecordSize);
+  while (offset != size) {
+    if (size - offset < 5)
+      ThrowParsingError();
+    uint8_t type(static_cast<uint8_t>(entry[offset]));
+    size_t length(ReadUint32(entry + offset + 1));
+    offset += 5;
+    if (size - offset < length)
+      ThrowParsingError();
+    if (type >= static_cast<uint8_t>(ListingExtra::kDataMap) &&
+        type <= static_cast<uint8_t>(ListingExtra::kLinkTo)) {
+      functor(static_cast<ListingExtra>(type), entry + offset, length);
+    }
+    offset += length;
+  }
+  return record;
+}
+
+ListingWriter::ListingWriter(const DirectoryId& directory_id, MaxVersions max_versions)
+    : directory_id_(convert::ToString(directory_id.string())),
+      max_versions_(max_versions),
+      child_count_(0),
+      pack_count_(0),
+      records_(),
+      pack_records_(),
+      name_index_(),
+      names_(),
+      extras_(),
+      previous_name_() {}
+
+void ListingWriter::AddChild(const fs::path& name, const std::string& entry) {
+  if (entry.size() < kRecordSize)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  std::string encoded_name(name.string());
+  size_t shared(0);
+  if (child_count_ % kRestartInterval == 0) {
+    AppendUint32(CheckedSize(names_.size()), &name_index_);
+  } else {
+    size_t limit(std::min(encoded_name.size(), previous_name_.size()));
+    while (shared != limit && encoded_name[shared] == previous_name_[shared])
+      ++shared;
+  }
+  if (encoded_name.size() > std::numeric_limits<uint16_t>::max())
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  AppendUint16(static_cast<uint16_t>(shared), &names_);
+  AppendUint16(static_cast<uint16_t>(encoded_name.size() - shared), &names_);
+  names_.append(encoded_name, shared, std::string::npos);
+  previous_name_.swap(encoded_name);
+
+  size_t record_offset(records_.size());
+  records_.append(entry, 0, kRecordSize);
+  WriteUint32(CheckedSize(extras_.size()), &records_[record_offset + kRecordExtrasOffset]);
+  WriteUint32(CheckedSize(entry.size() - kRecordSize),
+              &records_[record_offset + kRecordExtrasSize]);
+  extras_.append(entry, kRecordSize, std::string::npos);
+  ++child_count_;
+}
+
+void ListingWriter::AddPack(uint32_t pack_id, const std::string& serialised_data_map,
+                            uint64_t size, uint64_t live_size) {
+  AppendUint32(pack_id, &pack_records_);
+  AppendUint64(size, &pack_records_);
+  AppendUint64(live_size, &pack_records_);
+  AppendUint32(CheckedSize(extras_.size()), &pack_records_);
+  AppendUint32(CheckedSize(serialised_data_map.size()), &pack_records_);
+  extras_.append(serialised_data_map);
+  ++pack_count_;
+}
+
+std::string ListingWriter::Finish() const {
+  std::string listing(kMagic, sizeof(kMagic));
+  listing.reserve(kHeaderSize + directory_id_.size() + records_.size() + pack_records_.size() +
+                  name_index_.size() + names_.size() + extras_.size());
+  for (size_t value : { size_t(kVersion), size_t(max_versions_.data), size_t(child_count_),
+                        size_t(pack_count_), directory_id_.size(), names_.size(),
+                        extras_.size() })
+    AppendUint32(CheckedSize(value), &listing);
+  listing += directory_id_;
+  listing += records_;
+  listing += pack_records_;
+  listing += name_index_;
+  listing += names_;
+  listing += extras_;
+  return listing;
+}
+
+bool ListingReader::IsListing(const std::string& serialised_listing) {
+  return serialised_listing.size() >= kHeaderSize &&
+         std::equal(kMagic, kMagic + sizeof(kMagic), serialised_listing.data());
+}
+
+ListingReader::ListingReader(const std::string& serialised_listing)
+    : listing_(serialised_listing),
+      max_versions_(0),
+      child_count_(0),
+      pack_count_(0),
+      directory_id_size_(0),
+      records_offset_(0),
+      packs_offset_(0),
+      index_offset_(0),
+      names_offset_(0),
+      extras_offset_(0) {
+  if (!IsListing(listing_))
+    ThrowParsingError();
+  const char* header(listing_.data() + sizeof(kMagic));
+  if (ReadUint32(header) != kVersion)
+    ThrowParsingError();
+  max_versions_ = ReadUint32(header + 4);
+  child_count_ = ReadUint32(header + 8);
+  pack_count_ = ReadUint32(header + 12);
+  directory_id_size_ = ReadUint32(header + 16);
+  uint64_t names_size(ReadUint32(header + 20)), extras_size(ReadUint32(header + 24));
+
+  // Sizes are summed in 64 bits so that no combination of header fields can overflow.
+  uint64_t index_count((static_cast<uint64_t>(child_count_) + kRestartInterval - 1) /
+                       kRestartInterval);
+  uint64_t records_offset(kHeaderSize + static_cast<uint64_t>(directory_id_size_));
+  uint64_t packs_offset(records_offset + child_count_ * static_cast<uint64_t>(kRecordSize));
+  uint64_t index_offset(packs_offset + pack_count_ * static_cast<uint64_t>(kPackRecordSize));
+  uint64_t names_offset(index_offset + index_count * 4);
+  uint64_t extras_offset(names_offset + names_size);
+  if (extras_offset + extras_size != listing_.size())
+    ThrowParsingError();
+  records_offset_ = static_cast<size_t>(records_offset);
+  packs_offset_ = static_cast<size_t>(packs_offset);
+  index_offset_ = static_cast<size_t>(index_offset);
+  names_offset_ = static_cast<size_t>(names_offset);
+  extras_offset_ = static_cast<size_t>(extras_offset);
+}
+
+DirectoryId ListingReader::directory_id() const {
+  return DirectoryId(listing_.substr(kHeaderSize, directory_id_size_));
+}
+
+size_t ListingReader::NextName(size_t offset, std::string& name) const {
+  if (extras_offset_ - offset < 4)
+    ThrowParsingError();
+  size_t shared(ReadUint16(&listing_[offset])), suffix(ReadUint16(&listing_[offset + 2]));
+  offset += 4;
+  if (shared > name.size() || extras_offset_ - offset < suffix)
+    ThrowParsingError();
+  name.resize(shared);
+  name.append(listing_, offset, suffix);
+  return offset + suffix;
+}
+
+size_t ListingReader::RestartOffset(uint32_t restart) const {
+  size_t offset(ReadUint32(&listing_[index_offset_ + restart * 4]));
+  if (offset >= extras_offset_ - names_offset_)
+    ThrowParsingError();
+  return names_offset_ + offset;
+}
+
+ListingReader::NameIterator::NameIterator(const ListingReader& reader, uint32_t index)
+    : reader_(reader), index_(std::min(index, reader.child_count_)), next_offset_(0), name_() {
+  if (AtEnd())
+    return;
+  // Names are decoded from the last one held in full.
+  uint32_t restart(index_ / kRestartInterval);
+  next_offset_ = reader_.RestartOffset(restart);
+  for (uint32_t i(restart * kRestartInterval); i <= index_; ++i)
+    next_offset_ = reader_.NextName(next_offset_, name_);
+}
+
+ListingReader::NameIterator& ListingReader::NameIterator::operator++() {
+  if (++index_ != reader_.child_count_)
+    next_offset_ = reader_.NextName(next_offset_, name_);
+  return *this;
+}
+
+std::string ListingReader::Entry(uint32_t index) const {
+  if (index >= child_count_)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  const char* record(&listing_[records_offset_ + index * kRecordSize]);
+  size_t extras_offset(ReadUint32(record + kRecordExtrasOffset));
+  size_t extras_size(ReadUint32(record + kRecordExtrasSize));
+  if (extras_offset > listing_.size() - extras_offset_ ||
+      extras_size > listing_.size() - extras_offset_ - extras_offset) {
+    ThrowParsingError();
+  }
+  std::string entry;
+  entry.reserve(kRecordSize + extras_size);
+  entry.append(record, kRecordSize);
+  entry.append(listing_, extras_offset_ + extras_offset, extras_size);
+  return entry;
+}
+
+uint32_t ListingReader::Find(const ChildName& name) const {
+  // Binary search the names held in full for the last one not after 'name'.
+  uint32_t low(0), high((child_count_ + kRestartInterval - 1) / kRestartInterval);
+  std::string candidate;
+  while (low != high) {
+    uint32_t middle(low + (high - low) / 2);
+    candidate.clear();
+    NextName(RestartOffset(middle), candidate);
+    if (CompareListedName(candidate, name) <= 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0)
+    return child_count_;
+
+  // Then scan forward from it.
+  uint32_t index((low - 1) * kRestartInterval);
+  uint32_t end(std::min(child_count_, index + kRestartInterval));
+  size_t offset(RestartOffset(low - 1));
+  candidate.clear();
+  for (; index != end; ++index) {
+    offset = NextName(offset, candidate);
+    int result(CompareListedName(candidate, name));
+    if (result == 0)
+      return index;
+    if (result > 0)
+      break;
+  }
+  return child_count_;
+}
+
+ListingReader::Pack ListingReader::GetPack(uint32_t index) const {
+  if (index >= pack_count_)
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::invalid_parameter));
+  const char* record(&listing_[packs_offset_ + index * kPackRecordSize]);
+  Pack pack;
+  pack.pack_id = ReadUint32(record);
+  pack.size = ReadUint64(record + 4);
+  pack.live_size = ReadUint64(record + 12);
+  size_t data_map_offset(ReadUint32(record + 20)), data_map_size(ReadUint32(record + 24));
+  if (data_map_offset > listing_.size() - extras_offset_ ||
+      data_map_size > listing_.size() - extras_offset_ - data_map_offset) {
+    ThrowParsingError();
+  }
+  pack.serialised_data_map = listing_.substr(extras_offset_ + data_map_offset, data_map_size);
+  return pack;
+}
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
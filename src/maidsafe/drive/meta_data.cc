@@ -18,7 +18,17 @@
 
 #include "maidsafe/drive/meta_data.h"
 
-#include "boost/algorithm/string/predicate.hpp"
+#ifndef MAIDSAFE_WIN32
+#include <sys/time.h>  // NOLINT
+#endif
+
+#include <algorithm>
+#include <ctime>
+#include <iterator>
+#include <limits>
+#include <utility>
+
+#include "boost/algorithm/string/case_conv.hpp"
 #include "boost/date_time/posix_time/posix_time.hpp"
 
 #include "maidsafe/common/convert.h"
@@ -26,6 +36,7 @@
 #include "maidsafe/common/utils.h"
 #include "maidsafe/common/serialisation/serialisation.h"
 
+#include "maidsafe/drive/listing.h"
 #include "maidsafe/drive/proto_structs.pb.h"
 #include "maidsafe/drive/utils.h"
 
@@ -94,13 +105,125 @@ bptime::ptime FileTimeToBptime(FILETIME const& ftime) {
   return bptime::from_ftime<bptime::ptime>(ftime);
 }
 
+// The number of 100 nanosecond intervals between 1601-01-01 and the Unix epoch.
+const int64_t kUnixEpochInFileTime(116444736000000000LL);
+const int64_t kFileTimeTicksPerSecond(10000000);
+
+ListingTime FileTimeToListingTime(const FILETIME& file_time) {
+  int64_t ticks((static_cast<int64_t>(file_time.dwHighDateTime) << 32) | file_time.dwLowDateTime);
+  ticks -= kUnixEpochInFileTime;
+  int64_t seconds(ticks / kFileTimeTicksPerSecond), remainder(ticks % kFileTimeTicksPerSecond);
+  if (remainder < 0) {
+    --seconds;
+    remainder += kFileTimeTicksPerSecond;
+  }
+  return ListingTime(seconds, static_cast<uint32_t>(remainder * 100));
+}
+
+FILETIME ListingTimeToFileTime(const ListingTime& time) {
+  uint64_t ticks(static_cast<uint64_t>(time.seconds * kFileTimeTicksPerSecond +
+                                       time.nanoseconds / 100 + kUnixEpochInFileTime));
+  FILETIME file_time;
+  file_time.dwHighDateTime = static_cast<DWORD>(ticks >> 32);
+  file_time.dwLowDateTime = static_cast<DWORD>(ticks & 0xFFFFFFFF);
+  return file_time;
+}
+
+uint32_t PosixMode(DWORD attributes) {
+  uint32_t st_mode(0x01FF);
+  st_mode &= kAttributesFormat;
+  if ((attributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY)
+    st_mode |= kAttributesDir;
+  else
+    st_mode |= kAttributesRegular;
+  return st_mode;
+}
+
+}  // unnamed namespace
+#else
+namespace {
+
+// The full precision times held in 'struct stat', whose names differ between platforms.
+#ifdef MAIDSAFE_APPLE
+timespec stat::* const kLastAccessTime(&stat::st_atimespec);
+timespec stat::* const kLastWriteTime(&stat::st_mtimespec);
+timespec stat::* const kStatusChangeTime(&stat::st_ctimespec);
+#else
+timespec stat::* const kLastAccessTime(&stat::st_atim);
+timespec stat::* const kLastWriteTime(&stat::st_mtim);
+timespec stat::* const kStatusChangeTime(&stat::st_ctim);
+#endif
+
+timespec CurrentTime() {
+  timespec now;
+#ifdef MAIDSAFE_APPLE
+  timeval time_of_day;
+  gettimeofday(&time_of_day, nullptr);
+  now.tv_sec = time_of_day.tv_sec;
+  now.tv_nsec = time_of_day.tv_usec * 1000;
+#else
+  clock_gettime(CLOCK_REALTIME, &now);
+#endif
+  return now;
+}
+
+ListingTime TimespecToListingTime(const timespec& time) {
+  return ListingTime(time.tv_sec, static_cast<uint32_t>(time.tv_nsec));
+}
+
+timespec ListingTimeToTimespec(const ListingTime& time) {
+  timespec result;
+  result.tv_sec = static_cast<time_t>(time.seconds);
+  result.tv_nsec = static_cast<long>(time.nanoseconds);  // NOLINT
+  return result;
+}
+
+timespec PosixTimeToTimespec(const bptime::ptime& time) {
+  static const bptime::ptime epoch(boost::gregorian::date(1970, 1, 1));
+  bptime::time_duration since_epoch(time - epoch);
+  int64_t ticks(since_epoch.ticks()), ticks_per_second(since_epoch.ticks_per_second());
+  int64_t seconds(ticks / ticks_per_second), remainder(ticks % ticks_per_second);
+  if (remainder < 0) {
+    --seconds;
+    remainder += ticks_per_second;
+  }
+  timespec result;
+  result.tv_sec = static_cast<time_t>(seconds);
+  result.tv_nsec = static_cast<long>(remainder * (1000000000 / ticks_per_second));  // NOLINT
+  return result;
+}
+
+bptime::ptime TimespecToPosixTime(const timespec& time) {
+  return bptime::from_time_t(time.tv_sec) + bptime::microseconds(time.tv_nsec / 1000);
+}
+
+uint32_t WindowsAttributes(const struct stat& attributes, const fs::path& name) {
+  uint32_t win_attributes(0x10);  // FILE_ATTRIBUTE_DIRECTORY
+  if ((attributes.st_mode & S_IFREG) == S_IFREG)
+    win_attributes = 0x80;  // FILE_ATTRIBUTE_NORMAL
+  if (((attributes.st_mode & S_IRUSR) == S_IRUSR) && (win_attributes == 0x80))
+    win_attributes = 0x20 | 0x1;  // FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_READONLY
+  if (name.string()[0]  == '.')
+    win_attributes |= 0x2;  // FILE_ATTRIBUTE_HIDDEN
+  return win_attributes;
+}
+
 }  // unnamed namespace
 #endif
 
+namespace {
 
+// Shared by all unnamed MetaData, so that default construction allocates no name.
+const std::shared_ptr<const ChildName>& EmptyName() {
+  static const std::shared_ptr<const ChildName> empty_name(
+      std::make_shared<ChildName>(fs::path()));
+  return empty_name;
+}
+
+}  // unnamed namespace
 
 MetaData::MetaData()
-    : name(),
+    : name_(EmptyName()),
 #ifdef MAIDSAFE_WIN32
       end_of_file(0),
       allocation_size(0),
@@ -109,11 +232,17 @@ MetaData::MetaData()
       last_access_time(),
       last_write_time(),
       data_map(),
+      inline_content(),
+      pack_extent(),
+      holes(),
       directory_id() {}
 #else
       attributes(),
       link_to(),
       data_map(),
+      inline_content(),
+      pack_extent(),
+      holes(),
       directory_id() {
   attributes.st_gid = getgid();
   attributes.st_uid = getuid();
@@ -123,7 +252,7 @@ MetaData::MetaData()
 #endif
 
 MetaData::MetaData(const fs::path& name, bool is_directory)
-    : name(name),
+    : name_(std::make_shared<ChildName>(name)),
 #ifdef MAIDSAFE_WIN32
       end_of_file(0),
       allocation_size(0),
@@ -132,6 +261,9 @@ MetaData::MetaData(const fs::path& name, bool is_directory)
       last_access_time(),
       last_write_time(),
       data_map(is_directory ? nullptr : new encrypt::DataMap()),
+      inline_content(),
+      pack_extent(),
+      holes(),
       directory_id(is_directory ? new DirectoryId(RandomString(64)) : nullptr) {
     FILETIME file_time;
     GetSystemTimeAsFileTime(&file_time);
@@ -143,12 +275,16 @@ MetaData::MetaData(const fs::path& name, bool is_directory)
       attributes(),
       link_to(),
       data_map(is_directory ? nullptr : new encrypt::DataMap()),
+      inline_content(),
+      pack_extent(),
+      holes(),
       directory_id(is_directory ? new DirectoryId(RandomString(64)) : nullptr) {
   attributes.st_gid = getgid();
   attributes.st_uid = getuid();
   attributes.st_mode = 0644;
   attributes.st_nlink = 1;
-  attributes.st_ctime = attributes.st_mtime = time(&attributes.st_atime);
+  attributes.*kStatusChangeTime = attributes.*kLastWriteTime = attributes.*kLastAccessTime =
+      CurrentTime();
 
   if (is_directory) {
     attributes.st_mode = (0755 | S_IFDIR);
@@ -158,7 +294,7 @@ MetaData::MetaData(const fs::path& name, bool is_directory)
 #endif
 
 MetaData::MetaData(const protobuf::MetaData& protobuf_meta_data)
-    : name(protobuf_meta_data.name()),
+    : name_(std::make_shared<ChildName>(NameFromProtobuf(protobuf_meta_data.name()))),
 #ifdef MAIDSAFE_WIN32
       end_of_file(protobuf_meta_data.attributes_archive().st_size()),
       allocation_size(protobuf_meta_data.attributes_archive().st_size()),
@@ -174,11 +310,11 @@ MetaData::MetaData(const protobuf::MetaData& protobuf_meta_data)
       link_to(),
 #endif
       data_map(),
+      inline_content(),
+      pack_extent(),
+      holes(),
       directory_id(protobuf_meta_data.has_directory_id() ?
                    new DirectoryId(protobuf_meta_data.directory_id()) : nullptr) {
-  if ((name == "\\") || (name == "/"))
-    name = kRoot;
-
   const protobuf::AttributesArchive& attributes_archive = protobuf_meta_data.attributes_archive();
 
 #ifdef MAIDSAFE_WIN32
@@ -194,14 +330,12 @@ MetaData::MetaData(const protobuf::MetaData& protobuf_meta_data)
     link_to = attributes_archive.link_to();
   attributes.st_size = attributes_archive.st_size();
 
-  static bptime::ptime epoch(boost::gregorian::date(1970, 1, 1));
-  bptime::time_duration diff(
-      bptime::from_iso_string(attributes_archive.last_access_time()) - epoch);
-  attributes.st_atime = diff.ticks() / diff.ticks_per_second();
-  diff = bptime::from_iso_string(attributes_archive.last_write_time()) - epoch;
-  attributes.st_mtime = diff.ticks() / diff.ticks_per_second();
-  diff = bptime::from_iso_string(attributes_archive.creation_time()) - epoch;
-  attributes.st_ctime = diff.ticks() / diff.ticks_per_second();
+  attributes.*kLastAccessTime =
+      PosixTimeToTimespec(bptime::from_iso_string(attributes_archive.last_access_time()));
+  attributes.*kLastWriteTime =
+      PosixTimeToTimespec(bptime::from_iso_string(attributes_archive.last_write_time()));
+  attributes.*kStatusChangeTime =
+      PosixTimeToTimespec(bptime::from_iso_string(attributes_archive.creation_time()));
 
   attributes.st_mode = attributes_archive.st_mode();
 
@@ -234,6 +368,93 @@ MetaData::MetaData(const protobuf::MetaData& protobuf_meta_data)
   } else if (!directory_id) {
     BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
   }
+
+  if (protobuf_meta_data.has_inline_content()) {
+    if (directory_id)
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+    inline_content.reset(new std::string(protobuf_meta_data.inline_content()));
+  }
+
+  if (protobuf_meta_data.has_pack_extent()) {
+    if (directory_id || inline_content)
+      BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+    const auto& extent(protobuf_meta_data.pack_extent());
+    pack_extent.reset(new PackExtent(extent.pack_id(), extent.offset(), extent.length()));
+  }
+
+  for (int i(0); i != protobuf_meta_data.holes_size(); ++i)
+    holes.emplace(protobuf_meta_data.holes(i).offset(), protobuf_meta_data.holes(i).length());
+}
+
+MetaData::MetaData(const fs::path& name_in, const char* entry, size_t entry_size)
+    : MetaData(std::make_shared<ChildName>(name_in), entry, entry_size) {}
+
+MetaData::MetaData(std::shared_ptr<const ChildName> name_in, const char* entry, size_t entry_size)
+    : MetaData() {
+  name_ = std::move(name_in);
+  ListingRecord record(ParseListingEntry(entry, entry_size,
+      [this](ListingExtra type, const char* value, size_t size) {
+        switch (type) {
+          case ListingExtra::kDataMap:
+            data_map.reset(new encrypt::DataMap());
+            ConvertFromString(std::string(value, size), *data_map);
+            break;
+          case ListingExtra::kDirectoryId:
+            directory_id.reset(new DirectoryId(std::string(value, size)));
+            break;
+          case ListingExtra::kInlineContent:
+            inline_content.reset(new std::string(value, size));
+            break;
+          case ListingExtra::kPackExtent:
+            if (size != 20)
+              BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+            pack_extent.reset(new PackExtent(ReadUint32(value), ReadUint64(value + 4),
+                                             ReadUint64(value + 12)));
+            break;
+          case ListingExtra::kHoles:
+            if (size % 16 != 0)
+              BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+            for (size_t i(0); i != size; i += 16)
+              holes.emplace(ReadUint64(value + i), ReadUint64(value + i + 8));
+            break;
+          case ListingExtra::kLinkTo:
+#ifndef MAIDSAFE_WIN32
+            link_to = std::string(value, size);
+#endif
+            break;
+        }
+      }));
+
+#ifdef MAIDSAFE_WIN32
+  end_of_file = allocation_size = record.size;
+  creation_time = ListingTimeToFileTime(record.creation_time);
+  last_access_time = ListingTimeToFileTime(record.last_access_time);
+  last_write_time = ListingTimeToFileTime(record.last_write_time);
+  if ((record.mode & kAttributesDir) == kAttributesDir)
+    end_of_file = 0;
+  attributes = static_cast<DWORD>(record.win_attributes);
+#else
+  attributes.st_size = record.size;
+  attributes.*kStatusChangeTime = ListingTimeToTimespec(record.creation_time);
+  attributes.*kLastAccessTime = ListingTimeToTimespec(record.last_access_time);
+  attributes.*kLastWriteTime = ListingTimeToTimespec(record.last_write_time);
+  attributes.st_mode = record.mode;
+  attributes.st_dev = record.dev;
+  attributes.st_ino = record.ino;
+  attributes.st_nlink = record.nlink;
+  attributes.st_uid = record.uid;
+  attributes.st_gid = record.gid;
+  attributes.st_rdev = record.rdev;
+  attributes.st_blksize = record.blksize;
+  attributes.st_blocks = record.blocks;
+  if ((record.mode & kAttributesDir) == kAttributesDir)
+    attributes.st_size = 4096;
+#endif
+
+  if ((data_map && directory_id) || (!data_map && !directory_id) ||
+      (inline_content && directory_id) || (pack_extent && (directory_id || inline_content))) {
+    BOOST_THROW_EXCEPTION(MakeError(CommonErrors::parsing_error));
+  }
 }
 
 MetaData::MetaData(MetaData&& other)
@@ -247,7 +468,7 @@ MetaData& MetaData::operator=(MetaData other) {
 }
 
 void MetaData::ToProtobuf(protobuf::MetaData* protobuf_meta_data) const {
-  protobuf_meta_data->set_name(name.string());
+  protobuf_meta_data->set_name(name().string());
   auto attributes_archive = protobuf_meta_data->mutable_attributes_archive();
 
 #ifdef MAIDSAFE_WIN32
@@ -257,13 +478,7 @@ void MetaData::ToProtobuf(protobuf::MetaData* protobuf_meta_data) const {
   attributes_archive->set_last_write_time(bptime::to_iso_string(FileTimeToBptime(last_write_time)));
   attributes_archive->set_st_size(end_of_file);
 
-  uint32_t st_mode(0x01FF);
-  st_mode &= kAttributesFormat;
-  if ((attributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY)
-    st_mode |= kAttributesDir;
-  else
-    st_mode |= kAttributesRegular;
-  attributes_archive->set_st_mode(st_mode);
+  attributes_archive->set_st_mode(PosixMode(attributes));
   attributes_archive->set_win_attributes(attributes);
 #else
   attributes_archive->set_link_to(link_to.string());
@@ -286,14 +501,7 @@ void MetaData::ToProtobuf(protobuf::MetaData* protobuf_meta_data) const {
   attributes_archive->set_st_blksize(attributes.st_blksize);
   attributes_archive->set_st_blocks(attributes.st_blocks);
 
-  uint32_t win_attributes(0x10);  // FILE_ATTRIBUTE_DIRECTORY
-  if ((attributes.st_mode & S_IFREG) == S_IFREG)
-    win_attributes = 0x80;  // FILE_ATTRIBUTE_NORMAL
-  if (((attributes.st_mode & S_IRUSR) == S_IRUSR) && (win_attributes == 0x80))
-    win_attributes = 0x20 | 0x1;  // FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_READONLY
-  if (name.string()[0]  == '.')
-    win_attributes |= 0x2;  // FILE_ATTRIBUTE_HIDDEN
-  attributes_archive->set_win_attributes(win_attributes);
+  attributes_archive->set_win_attributes(WindowsAttributes(attributes, name()));
 #endif
 
   if (directory_id) {
@@ -301,6 +509,75 @@ void MetaData::ToProtobuf(protobuf::MetaData* protobuf_meta_data) const {
   } else {
     std::string serialised_data_map(ConvertToString(*data_map));
     protobuf_meta_data->set_serialised_data_map(serialised_data_map);
+    if (inline_content)
+      protobuf_meta_data->set_inline_content(*inline_content);
+    if (pack_extent) {
+      auto protobuf_extent(protobuf_meta_data->mutable_pack_extent());
+      protobuf_extent->set_pack_id(pack_extent->pack_id);
+      protobuf_extent->set_offset(pack_extent->offset);
+      protobuf_extent->set_length(pack_extent->length);
+    }
+    for (const auto& hole : holes) {
+      auto protobuf_hole(protobuf_meta_data->add_holes());
+      protobuf_hole->set_offset(hole.first);
+      protobuf_hole->set_length(hole.second);
+    }
+  }
+}
+
+void MetaData::ToListingEntry(std::string* entry) const {
+  ListingRecord record;
+#ifdef MAIDSAFE_WIN32
+  record.size = end_of_file;
+  record.creation_time = FileTimeToListingTime(creation_time);
+  record.last_access_time = FileTimeToListingTime(last_access_time);
+  record.last_write_time = FileTimeToListingTime(last_write_time);
+  record.mode = PosixMode(attributes);
+  record.win_attributes = attributes;
+#else
+  record.size = attributes.st_size;
+  record.creation_time = TimespecToListingTime(attributes.*kStatusChangeTime);
+  record.last_access_time = TimespecToListingTime(attributes.*kLastAccessTime);
+  record.last_write_time = TimespecToListingTime(attributes.*kLastWriteTime);
+  record.mode = attributes.st_mode;
+  record.win_attributes = WindowsAttributes(attributes, name());
+  record.dev = static_cast<uint32_t>(attributes.st_dev);
+  record.ino = static_cast<uint32_t>(attributes.st_ino);
+  record.nlink = static_cast<uint32_t>(attributes.st_nlink);
+  record.uid = attributes.st_uid;
+  record.gid = attributes.st_gid;
+  record.rdev = static_cast<uint32_t>(attributes.st_rdev);
+  record.blksize = static_cast<uint32_t>(attributes.st_blksize);
+  record.blocks = attributes.st_blocks;
+#endif
+  AppendListingRecord(record, entry);
+
+#ifndef MAIDSAFE_WIN32
+  if (!link_to.empty())
+    AppendListingExtra(ListingExtra::kLinkTo, link_to.string(), entry);
+#endif
+  if (directory_id) {
+    AppendListingExtra(ListingExtra::kDirectoryId, convert::ToString(directory_id->string()),
+                       entry);
+    return;
+  }
+  AppendListingExtra(ListingExtra::kDataMap, ConvertToString(*data_map), entry);
+  if (inline_content)
+    AppendListingExtra(ListingExtra::kInlineContent, *inline_content, entry);
+  if (pack_extent) {
+    std::string extent;
+    AppendUint32(pack_extent->pack_id, &extent);
+    AppendUint64(pack_extent->offset, &extent);
+    AppendUint64(pack_extent->length, &extent);
+    AppendListingExtra(ListingExtra::kPackExtent, extent, entry);
+  }
+  if (!holes.empty()) {
+    std::string serialised_holes;
+    for (const auto& hole : holes) {
+      AppendUint64(hole.first, &serialised_holes);
+      AppendUint64(hole.second, &serialised_holes);
+    }
+    AppendListingExtra(ListingExtra::kHoles, serialised_holes, entry);
   }
 }
 
@@ -308,7 +585,7 @@ bptime::ptime MetaData::creation_posix_time() const {
 #ifdef MAIDSAFE_WIN32
   return FileTimeToBptime(creation_time);
 #else
-  return bptime::from_time_t(attributes.st_ctime);
+  return TimespecToPosixTime(attributes.*kStatusChangeTime);
 #endif
 }
 
@@ -316,22 +593,32 @@ bptime::ptime MetaData::last_write_posix_time() const {
 #ifdef MAIDSAFE_WIN32
   return FileTimeToBptime(last_write_time);
 #else
-  return bptime::from_time_t(attributes.st_mtime);
+  return TimespecToPosixTime(attributes.*kLastWriteTime);
 #endif
 }
 
 bool MetaData::operator<(const MetaData& other) const {
-  return boost::ilexicographical_compare(name.wstring(), other.name.wstring());
+  return CompareCollation(*name_, *other.name_) < 0;
+}
+
+void MetaData::SetName(const fs::path& new_name) {
+  name_ = std::make_shared<ChildName>(new_name);
 }
 
 void MetaData::UpdateLastModifiedTime() {
 #ifdef MAIDSAFE_WIN32
   GetSystemTimeAsFileTime(&last_write_time);
 #else
-  time(&attributes.st_mtime);
+  attributes.*kStatusChangeTime = attributes.*kLastWriteTime = CurrentTime();
 #endif
 }
 
+#ifndef MAIDSAFE_WIN32
+void MetaData::UpdateLastStatusChangeTime() {
+  attributes.*kStatusChangeTime = CurrentTime();
+}
+#endif
+
 uint64_t MetaData::GetAllocatedSize() const {
 #ifdef MAIDSAFE_WIN32
   return allocation_size;
@@ -340,9 +627,95 @@ uint64_t MetaData::GetAllocatedSize() const {
 #endif
 }
 
+uint64_t MetaData::GetSize() const {
+#ifdef MAIDSAFE_WIN32
+  return end_of_file;
+#else
+  return attributes.st_size;
+#endif
+}
+
+void MetaData::SetSize(uint64_t size) {
+#ifdef MAIDSAFE_WIN32
+  end_of_file = size;
+#else
+  attributes.st_size = size;
+  attributes.st_blocks = attributes.st_size / 512;
+#endif
+}
+
+void MetaData::AddHole(uint64_t offset, uint64_t length) {
+  if (length == 0)
+    return;
+  uint64_t end(offset + length);
+  auto itr(holes.upper_bound(offset));
+  if (itr != std::begin(holes)) {
+    auto previous(std::prev(itr));
+    if (previous->first + previous->second >= offset) {
+      offset = previous->first;
+      end = std::max(end, previous->first + previous->second);
+      itr = holes.erase(previous);
+    }
+  }
+  while (itr != std::end(holes) && itr->first <= end) {
+    end = std::max(end, itr->first + itr->second);
+    itr = holes.erase(itr);
+  }
+  holes.emplace(offset, end - offset);
+}
+
+void MetaData::RemoveHoles(uint64_t offset, uint64_t length) {
+  if (length == 0 || holes.empty())
+    return;
+  uint64_t end(length > std::numeric_limits<uint64_t>::max() - offset ?
+               std::numeric_limits<uint64_t>::max() : offset + length);
+  auto itr(holes.upper_bound(offset));
+  if (itr != std::begin(holes))
+    --itr;
+  while (itr != std::end(holes) && itr->first < end) {
+    uint64_t hole_start(itr->first), hole_end(itr->first + itr->second);
+    if (hole_end <= offset) {
+      ++itr;
+      continue;
+    }
+    itr = holes.erase(itr);
+    if (hole_start < offset)
+      holes.emplace(hole_start, offset - hole_start);
+    if (hole_end > end) {
+      holes.emplace(end, hole_end - end);
+      break;
+    }
+  }
+}
+
+void MetaData::TrimHoles(uint64_t size) {
+  RemoveHoles(size, std::numeric_limits<uint64_t>::max() - size);
+}
+
+bool MetaData::IsHole(uint64_t offset, uint64_t length) const {
+  // Holes are merged as they're added, so the range must lie within a single one.
+  auto itr(holes.upper_bound(offset));
+  if (itr == std::begin(holes))
+    return false;
+  --itr;
+  return offset - itr->first <= itr->second && length <= itr->second - (offset - itr->first);
+}
+
+void MetaData::ZeroFillHoles(char* data, uint32_t size, uint64_t offset) const {
+  uint64_t end(offset + size);
+  auto itr(holes.upper_bound(offset));
+  if (itr != std::begin(holes))
+    --itr;
+  for (; itr != std::end(holes) && itr->first < end; ++itr) {
+    uint64_t start(std::max(itr->first, offset)), stop(std::min(itr->first + itr->second, end));
+    if (start < stop)
+      std::fill(data + (start - offset), data + (stop - offset), 0);
+  }
+}
+
 void swap(MetaData& lhs, MetaData& rhs) MAIDSAFE_NOEXCEPT {
   using std::swap;
-  swap(lhs.name, rhs.name);
+  swap(lhs.name_, rhs.name_);
 #ifdef MAIDSAFE_WIN32
   swap(lhs.end_of_file, rhs.end_of_file);
   swap(lhs.allocation_size, rhs.allocation_size);
@@ -355,9 +728,35 @@ void swap(MetaData& lhs, MetaData& rhs) MAIDSAFE_NOEXCEPT {
   swap(lhs.link_to, rhs.link_to);
 #endif
   swap(lhs.data_map, rhs.data_map);
+  swap(lhs.inline_content, rhs.inline_content);
+  swap(lhs.pack_extent, rhs.pack_extent);
+  swap(lhs.holes, rhs.holes);
   swap(lhs.directory_id, rhs.directory_id);
 }
 
+std::wstring CollationKey(const fs::path& name) {
+  // Upper rather than lower case preserves the order previously given by
+  // boost::ilexicographical_compare, e.g. for '_' relative to letters.
+  return boost::algorithm::to_upper_copy(name.wstring());
+}
+
+fs::path NameFromProtobuf(const std::string& name) {
+  return (name == "\\" || name == "/") ? kRoot : fs::path(name);
+}
+
+int CompareCollation(const std::wstring& lhs_key, const fs::path& lhs_name,
+                     const std::wstring& rhs_key, const fs::path& rhs_name) {
+  int result(lhs_key.compare(rhs_key));
+  return result != 0 ? result : lhs_name.native().compare(rhs_name.native());
+}
+
+ChildName::ChildName(fs::path name_in)
+    : name(std::move(name_in)), collation_key(CollationKey(name)) {}
+
+int CompareCollation(const ChildName& lhs, const ChildName& rhs) {
+  return CompareCollation(lhs.collation_key, lhs.name, rhs.collation_key, rhs.name);
+}
+
 }  // namespace detail
 
 }  // namespace drive
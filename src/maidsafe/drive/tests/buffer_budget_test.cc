@@ -0,0 +1,140 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+
+#include "maidsafe/drive/buffer_budget.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+namespace {
+
+const uint64_t kMiB(1024 * 1024);
+
+}  // unnamed namespace
+
+TEST(BufferBudgetTest, BEH_ReserveAndRelease) {
+  BufferBudget budget(MemoryUsage(8 * kMiB), DiskUsage(16 * kMiB));
+  {
+    auto reservation(budget.Reserve(MemoryUsage(2 * kMiB), DiskUsage(4 * kMiB)));
+    EXPECT_EQ(2 * kMiB, reservation->memory().data);
+    EXPECT_EQ(4 * kMiB, reservation->disk().data);
+    EXPECT_EQ(2 * kMiB, budget.memory_in_use().data);
+    EXPECT_EQ(4 * kMiB, budget.disk_in_use().data);
+  }
+  EXPECT_EQ(0U, budget.memory_in_use().data);
+  EXPECT_EQ(0U, budget.disk_in_use().data);
+}
+
+TEST(BufferBudgetTest, BEH_ReserveUnderPressure) {
+  BufferBudget budget(MemoryUsage(4 * kMiB), DiskUsage(8 * kMiB));
+  auto first(budget.Reserve(MemoryUsage(3 * kMiB), DiskUsage(6 * kMiB)));
+  // Only part of the request is available.
+  auto second(budget.Reserve(MemoryUsage(3 * kMiB), DiskUsage(6 * kMiB)));
+  EXPECT_EQ(1 * kMiB, second->memory().data);
+  EXPECT_EQ(2 * kMiB, second->disk().data);
+  // Nothing is available and the budget is never exceeded, even for the minimum.
+  EXPECT_THROW(budget.Reserve(MemoryUsage(3 * kMiB), DiskUsage(6 * kMiB)), std::exception);
+  EXPECT_EQ(4 * kMiB, budget.memory_in_use().data);
+  EXPECT_EQ(8 * kMiB, budget.disk_in_use().data);
+  second.reset();
+  auto third(budget.Reserve(MemoryUsage(3 * kMiB), DiskUsage(6 * kMiB)));
+  EXPECT_EQ(BufferBudget::kMinimumMemory.data, third->memory().data);
+  EXPECT_LE(third->memory().data, third->disk().data);
+}
+
+TEST(BufferBudgetTest, BEH_EvictLeastRecentlyUsedIdle) {
+  BufferBudget budget(MemoryUsage(4 * kMiB), DiskUsage(4 * kMiB));
+  std::vector<int> evicted;
+  std::vector<std::thread> owners;
+  std::vector<std::unique_ptr<BufferBudget::Reservation>> reservations;
+  // As with a file's buffer, the owner releases evicted space asynchronously.
+  auto evict([&](int i) {
+    evicted.push_back(i);
+    owners.emplace_back([&reservations, i] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      reservations[i].reset();
+    });
+  });
+  for (int i(0); i != 4; ++i) {
+    reservations.emplace_back(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)));
+    reservations.back()->SetIdle([i, &evict] { evict(i); });
+  }
+  // Re-idling moves an entry to the back of the queue; reactivating removes it.
+  reservations[0]->SetIdle([&evict] { evict(0); });
+  reservations[1]->SetActive();
+  EXPECT_EQ(3U, budget.idle_count());
+
+  // The budget is full, so the reservation waits for the two least recently used idle buffers to
+  // be destroyed.
+  auto reservation(budget.Reserve(MemoryUsage(2 * kMiB), DiskUsage(2 * kMiB)));
+  for (auto& owner : owners)
+    owner.join();
+  EXPECT_EQ(2 * kMiB, reservation->memory().data);
+  ASSERT_EQ(2U, evicted.size());
+  EXPECT_EQ(2, evicted[0]);
+  EXPECT_EQ(3, evicted[1]);
+  EXPECT_EQ(1U, budget.idle_count());
+  EXPECT_EQ(4 * kMiB, budget.memory_in_use().data);
+  reservation.reset();
+  reservations.clear();
+  EXPECT_EQ(0U, budget.memory_in_use().data);
+  EXPECT_EQ(0U, budget.idle_count());
+}
+
+TEST(BufferBudgetTest, BEH_EvictionTimesOut) {
+  BufferBudget budget(MemoryUsage(2 * kMiB), DiskUsage(2 * kMiB), std::chrono::milliseconds(100));
+  auto first(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)));
+  auto second(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)));
+  int evictions(0);
+  first->SetIdle([&evictions] { ++evictions; });
+  // The evicted reservation is never destroyed.
+  EXPECT_THROW(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)), std::exception);
+  EXPECT_EQ(1, evictions);
+  EXPECT_EQ(0U, budget.idle_count());
+  // Reclaiming the buffer cancels the eviction, and nothing else can be evicted.
+  first->SetActive();
+  EXPECT_THROW(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)), std::exception);
+  EXPECT_EQ(1, evictions);
+  first.reset();
+  EXPECT_NO_THROW(budget.Reserve(MemoryUsage(kMiB), DiskUsage(kMiB)));
+}
+
+TEST(BufferBudgetTest, BEH_InvalidLimits) {
+  EXPECT_THROW(BufferBudget budget(MemoryUsage(kMiB - 1), DiskUsage(kMiB)), std::exception);
+  EXPECT_THROW(BufferBudget budget(MemoryUsage(2 * kMiB), DiskUsage(kMiB)), std::exception);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,145 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+#include "maidsafe/drive/child_index.h"
+#include "maidsafe/drive/file_context.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+namespace {
+
+ChildIndex::Entry MakeEntry(const std::string& name) {
+  return ChildIndex::Entry(std::make_shared<ChildName>(name),
+                           std::make_shared<FileContext>(name, false));
+}
+
+// Checks 'index' holds exactly the names in 'expected', in order, each with its own context.
+void CheckIndex(const ChildIndex& index, const std::vector<std::string>& expected) {
+  std::vector<std::string> sorted(expected);
+  std::sort(std::begin(sorted), std::end(sorted), [](const std::string& lhs,
+                                                     const std::string& rhs) {
+    return CompareCollation(ChildName(lhs), ChildName(rhs)) < 0;
+  });
+  ASSERT_EQ(sorted.size(), index.size());
+  ChildIndex::Iterator itr(index);
+  for (const auto& name : sorted) {
+    ASSERT_FALSE(itr.AtEnd());
+    EXPECT_EQ(name, itr->name->name.string());
+    EXPECT_EQ(name, itr->context->meta_data.name().string());
+    const ChildIndex::Entry* found(index.Find(ChildName(name)));
+    ASSERT_TRUE(found != nullptr);
+    EXPECT_EQ(itr->context, found->context);
+    ++itr;
+  }
+  EXPECT_TRUE(itr.AtEnd());
+}
+
+}  // unnamed namespace
+
+TEST(ChildIndexTest, BEH_Empty) {
+  ChildIndex index;
+  EXPECT_TRUE(index.empty());
+  EXPECT_TRUE(index.Find(ChildName("a")) == nullptr);
+  EXPECT_TRUE(ChildIndex::Iterator(index).AtEnd());
+  EXPECT_TRUE(index.Erase(ChildName("a")).empty());
+  EXPECT_TRUE(ChildIndex(std::vector<ChildIndex::Entry>()).empty());
+}
+
+TEST(ChildIndexTest, BEH_InsertAndErase) {
+  // Enough names to need several levels, inserted and erased in random order
+  std::vector<std::string> names;
+  for (int i(0); i != 5000; ++i)
+    names.push_back((i % 2 == 0 ? "child " : "Child ") + std::to_string(i));
+  std::mt19937 generator(RandomUint32());
+  std::shuffle(std::begin(names), std::end(names), generator);
+
+  ChildIndex index;
+  std::vector<std::string> inserted;
+  for (const auto& name : names) {
+    index = index.Insert(MakeEntry(name));
+    inserted.push_back(name);
+  }
+  CheckIndex(index, inserted);
+  EXPECT_TRUE(index.Find(ChildName("CHILD 0")) == nullptr);
+
+  // Inserting an existing name replaces its entry
+  auto replacement(MakeEntry(names.front()));
+  index = index.Insert(replacement);
+  EXPECT_EQ(names.size(), index.size());
+  EXPECT_EQ(replacement.context, index.Find(ChildName(names.front()))->context);
+  index = index.Insert(MakeEntry(names.front()));
+
+  // Earlier versions are unaffected by later changes
+  const ChildIndex full(index);
+  std::shuffle(std::begin(names), std::end(names), generator);
+  std::vector<std::string> remaining(names);
+  for (const auto& name : names) {
+    index = index.Erase(ChildName(name));
+    remaining.erase(std::begin(remaining));
+    if (remaining.size() % 1000 == 0)
+      CheckIndex(index, remaining);
+  }
+  EXPECT_TRUE(index.empty());
+  EXPECT_EQ(index.size(), index.Erase(ChildName(names.front())).size());
+  CheckIndex(full, names);
+}
+
+TEST(ChildIndexTest, BEH_BuildFromSorted) {
+  for (size_t count : std::vector<size_t>{1, 32, 33, 1025, 5000}) {
+    std::vector<std::string> names;
+    for (size_t i(0); i != count; ++i)
+      names.push_back("Child " + std::to_string(i));
+    std::sort(std::begin(names), std::end(names));
+    std::vector<ChildIndex::Entry> entries;
+    for (const auto& name : names)
+      entries.push_back(MakeEntry(name));
+    ChildIndex index(std::move(entries));
+    CheckIndex(index, names);
+
+    // A built index takes further changes like any other
+    index = index.Insert(MakeEntry("Child 0a"));
+    names.push_back("Child 0a");
+    index = index.Erase(ChildName("Child 0"));
+    names.erase(std::find(std::begin(names), std::end(names), "Child 0"));
+    CheckIndex(index, names);
+  }
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -22,9 +22,12 @@
 #include <time.h>
 #endif
 
+#include <chrono>
 #include <fstream>  // NOLINT
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "boost/filesystem/path.hpp"
 
@@ -69,6 +72,34 @@ class DirectoryHandlerTest : public testing::Test {
   DirectoryHandlerTest& operator=(const DirectoryHandlerTest&) = delete;
 
  protected:
+  void SetMaxCachedDirectories(size_t count) {
+    std::lock_guard<std::mutex> lock(listing_handler_->cache_mutex_);
+    listing_handler_->max_cached_directories_ = count;
+  }
+
+  size_t CachedDirectoryCount() const {
+    std::lock_guard<std::mutex> lock(listing_handler_->cache_mutex_);
+    return listing_handler_->cache_.size();
+  }
+
+  size_t PrefetchCount() const {
+    std::lock_guard<std::mutex> lock(listing_handler_->cache_mutex_);
+    return listing_handler_->prefetches_.size();
+  }
+
+  void WaitForStores() const {
+    std::vector<std::shared_ptr<Directory>> directories;
+    {
+      std::lock_guard<std::mutex> lock(listing_handler_->cache_mutex_);
+      for (const auto& entry : listing_handler_->cache_)
+        directories.push_back(entry.second->directory);
+    }
+    for (const auto& directory : directories) {
+      while (directory->HasPending())
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
   maidsafe::test::TestPath main_test_dir_;
   std::shared_ptr<nfs::FakeStore> data_store_;
   Identity unique_user_id_, root_parent_id_;
@@ -89,7 +120,7 @@ TEST_F(DirectoryHandlerTest, BEH_Construct) {
   EXPECT_TRUE(recovered_directory->directory_id() == root_parent_id_);
   EXPECT_TRUE(!recovered_directory->empty());
   EXPECT_NO_THROW(recovered_file_context = recovered_directory->GetChild(kRoot));
-  EXPECT_TRUE(kRoot == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(kRoot == recovered_file_context->meta_data.name());
   EXPECT_NO_THROW(recovered_directory = listing_handler_->Get(kRoot));
   EXPECT_TRUE(recovered_directory->parent_id().data == root_parent_id_);
 }
@@ -109,7 +140,7 @@ TEST_F(DirectoryHandlerTest, BEH_AddDirectory) {
   EXPECT_TRUE(directory->directory_id() == dir);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(directory_name));
-  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name());
 }
 
 TEST_F(DirectoryHandlerTest, BEH_AddSameDirectory) {
@@ -122,18 +153,18 @@ TEST_F(DirectoryHandlerTest, BEH_AddSameDirectory) {
   DirectoryId dir(*file_context.meta_data.directory_id);
   const FileContext* recovered_file_context(nullptr);
   std::shared_ptr<Directory> directory;
-  boost::filesystem::path meta_data_name(file_context.meta_data.name);
+  boost::filesystem::path meta_data_name(file_context.meta_data.name());
   EXPECT_NO_THROW(listing_handler_->Add(kRoot / directory_name, std::move(file_context)));
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot / directory_name));
   EXPECT_TRUE(directory->directory_id() == dir);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(directory_name));
-  EXPECT_TRUE(meta_data_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(meta_data_name == recovered_file_context->meta_data.name());
 
   EXPECT_THROW(listing_handler_->Add(kRoot / directory_name, FileContext(directory_name, true)),
                std::exception);
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(directory_name));
-  EXPECT_TRUE(meta_data_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(meta_data_name == recovered_file_context->meta_data.name());
 }
 
 TEST_F(DirectoryHandlerTest, BEH_AddFile) {
@@ -151,7 +182,7 @@ TEST_F(DirectoryHandlerTest, BEH_AddFile) {
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_TRUE(directory->HasChild(file_name));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(file_name));
-  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name());
 }
 
 TEST_F(DirectoryHandlerTest, BEH_AddSameFile) {
@@ -169,11 +200,11 @@ TEST_F(DirectoryHandlerTest, BEH_AddSameFile) {
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_TRUE(directory->HasChild(file_name));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(file_name));
-  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name());
 
   EXPECT_TRUE(directory->HasChild(file_name));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(file_name));
-  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name());
 }
 
 TEST_F(DirectoryHandlerTest, BEH_DeleteDirectory) {
@@ -192,7 +223,7 @@ TEST_F(DirectoryHandlerTest, BEH_DeleteDirectory) {
   EXPECT_TRUE(directory->directory_id() == dir);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(directory_name));
-  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name());
 
   EXPECT_NO_THROW(listing_handler_->Delete(kRoot / directory_name));
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / directory_name), std::exception);
@@ -216,7 +247,7 @@ TEST_F(DirectoryHandlerTest, BEH_DeleteSameDirectory) {
   EXPECT_TRUE(directory->directory_id() == dir);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(directory_name));
-  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(directory_name == recovered_file_context->meta_data.name());
 
   EXPECT_NO_THROW(listing_handler_->Delete(kRoot / directory_name));
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / directory_name), std::exception);
@@ -239,7 +270,7 @@ TEST_F(DirectoryHandlerTest, BEH_DeleteFile) {
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / file_name), std::exception);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(file_name));
-  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name());
 
   EXPECT_NO_THROW(listing_handler_->Delete(kRoot / file_name));
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
@@ -260,7 +291,7 @@ TEST_F(DirectoryHandlerTest, BEH_DeleteSameFile) {
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / file_name), std::exception);
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
   EXPECT_NO_THROW(recovered_file_context = directory->GetChild(file_name));
-  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(file_name == recovered_file_context->meta_data.name());
 
   EXPECT_NO_THROW(listing_handler_->Delete(kRoot / file_name));
   EXPECT_NO_THROW(directory = listing_handler_->Get(kRoot));
@@ -293,7 +324,7 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveDirectory) {
                                         std::move(file_context)));
 
   EXPECT_NO_THROW(recovered_file_context = old_parent_directory->GetChild(old_directory_name));
-  EXPECT_TRUE(old_directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(old_directory_name == recovered_file_context->meta_data.name());
 
   EXPECT_THROW(recovered_file_context = old_parent_directory->GetChild(new_directory_name),
                std::exception);
@@ -322,7 +353,7 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveDirectory) {
   EXPECT_THROW(recovered_file_context = old_parent_directory->GetChild(old_directory_name),
                std::exception);
   EXPECT_NO_THROW(recovered_file_context = old_parent_directory->GetChild(new_directory_name));
-  EXPECT_TRUE(new_directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(new_directory_name == recovered_file_context->meta_data.name());
   EXPECT_NO_THROW(new_parent_directory = listing_handler_->Get(kRoot / second_directory_name));
   EXPECT_THROW(recovered_file_context = new_parent_directory->GetChild(old_directory_name),
                std::exception);
@@ -356,7 +387,7 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveDirectory) {
   EXPECT_THROW(recovered_file_context = new_parent_directory->GetChild(old_directory_name),
                std::exception);
   EXPECT_NO_THROW(recovered_file_context = new_parent_directory->GetChild(new_directory_name));
-  EXPECT_TRUE(new_directory_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(new_directory_name == recovered_file_context->meta_data.name());
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / first_directory_name / old_directory_name),
                std::exception);
   EXPECT_THROW(directory = listing_handler_->Get(kRoot / first_directory_name / new_directory_name),
@@ -392,7 +423,7 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveFile) {
       listing_handler_->Add(kRoot / first_directory_name / old_file_name, std::move(file_context)));
 
   EXPECT_NO_THROW(recovered_file_context = old_parent_directory->GetChild(old_file_name));
-  EXPECT_TRUE(old_file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(old_file_name == recovered_file_context->meta_data.name());
   EXPECT_THROW(recovered_file_context = old_parent_directory->GetChild(new_file_name),
                std::exception);
   EXPECT_NO_THROW(new_parent_directory = listing_handler_->Get(kRoot / second_directory_name));
@@ -410,7 +441,7 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveFile) {
   EXPECT_THROW(recovered_file_context = old_parent_directory->GetChild(old_file_name),
                std::exception);
   EXPECT_NO_THROW(recovered_file_context = old_parent_directory->GetChild(new_file_name));
-  EXPECT_TRUE(new_file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(new_file_name == recovered_file_context->meta_data.name());
   EXPECT_NO_THROW(new_parent_directory = listing_handler_->Get(kRoot / second_directory_name));
   EXPECT_THROW(recovered_file_context = new_parent_directory->GetChild(old_file_name),
                std::exception);
@@ -434,11 +465,239 @@ TEST_F(DirectoryHandlerTest, BEH_RenameAndMoveFile) {
   EXPECT_THROW(recovered_file_context = new_parent_directory->GetChild(old_file_name),
                std::exception);
   EXPECT_NO_THROW(recovered_file_context = new_parent_directory->GetChild(new_file_name));
-  EXPECT_TRUE(new_file_name == recovered_file_context->meta_data.name);
+  EXPECT_TRUE(new_file_name == recovered_file_context->meta_data.name());
   EXPECT_THROW(listing_handler_->Get(kRoot / second_directory_name / new_file_name),
                std::exception);
 }
 
+TEST_F(DirectoryHandlerTest, BEH_EvictLeastRecentlyUsed) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  SetMaxCachedDirectories(3);
+  std::vector<DirectoryId> directory_ids;
+  for (const std::string name : { "a", "b" }) {
+    FileContext file_context(name, true);
+    directory_ids.push_back(*file_context.meta_data.directory_id);
+    listing_handler_->Add(kRoot / name, std::move(file_context));
+  }
+  // Directories which haven't been stored yet are kept, even over the limit
+  EXPECT_EQ(4U, CachedDirectoryCount());
+  EXPECT_EQ(0U, listing_handler_->cache_statistics().evictions);
+
+  listing_handler_->FlushAll();
+  WaitForStores();
+  listing_handler_->Add(kRoot / "c", FileContext("c", true));
+  EXPECT_EQ(3U, CachedDirectoryCount());
+  EXPECT_EQ(2U, listing_handler_->cache_statistics().evictions);
+
+  // An evicted directory is reloaded from storage, and is then a hit
+  auto statistics(listing_handler_->cache_statistics());
+  std::shared_ptr<Directory> directory(listing_handler_->Get(kRoot / "a"));
+  EXPECT_EQ(directory_ids.front(), directory->directory_id());
+  EXPECT_EQ(statistics.misses + 1, listing_handler_->cache_statistics().misses);
+  EXPECT_EQ(directory, listing_handler_->Get(kRoot / "a"));
+  EXPECT_EQ(statistics.hits + 1, listing_handler_->cache_statistics().hits);
+  // The directory still in use isn't evicted
+  listing_handler_->Add(kRoot / "d", FileContext("d", true));
+  EXPECT_EQ(directory, listing_handler_->Get(kRoot / "a"));
+}
+
+TEST_F(DirectoryHandlerTest, BEH_EvictAfterReadOnlyAccess) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  listing_handler_->Add(kRoot / "a", FileContext("a", true));
+  listing_handler_->Add(kRoot / "a" / "f", FileContext("f", false));
+  listing_handler_->FlushAll();
+  WaitForStores();
+
+  // Opening, reading and releasing a file, and opening its directory, changes nothing to store
+  auto root(listing_handler_->Get(kRoot));
+  auto directory(listing_handler_->Get(kRoot / "a"));
+  FileContext* file_context(directory->GetMutableChild("f"));
+  ++file_context->open_count;
+  EXPECT_FALSE(directory->CanBeEvicted());
+  EXPECT_EQ(fs::path("f"), directory->GetChild("f")->meta_data.name());
+  --file_context->open_count;
+  root->GetMutableChild("a");
+  EXPECT_TRUE(directory->CanBeEvicted());
+  EXPECT_TRUE(root->CanBeEvicted());
+
+  directory.reset();
+  SetMaxCachedDirectories(2);
+  auto statistics(listing_handler_->cache_statistics());
+  listing_handler_->Add(kRoot / "b", FileContext("b", true));
+  EXPECT_EQ(statistics.evictions + 1, listing_handler_->cache_statistics().evictions);
+}
+
+TEST_F(DirectoryHandlerTest, BEH_GetDeepPath) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  const int kDepth(12);
+  fs::path path(kRoot);
+  DirectoryId deepest_id;
+  for (int i(0); i != kDepth; ++i) {
+    path /= "Level " + std::to_string(i);
+    FileContext file_context(path.filename(), true);
+    deepest_id = *file_context.meta_data.directory_id;
+    listing_handler_->Add(path, std::move(file_context));
+  }
+  listing_handler_->FlushAll();
+  WaitForStores();
+
+  // Evict the whole tree, so that it is reloaded from the root one level at a time
+  SetMaxCachedDirectories(2);
+  listing_handler_->Add(kRoot / "Other", FileContext("Other", true));
+  auto statistics(listing_handler_->cache_statistics());
+  std::shared_ptr<Directory> directory(listing_handler_->Get(path));
+  EXPECT_EQ(deepest_id, directory->directory_id());
+  EXPECT_EQ(statistics.misses + kDepth, listing_handler_->cache_statistics().misses);
+  EXPECT_EQ(directory, listing_handler_->Get(path));
+
+  // Renaming an ancestor carries its cached descendants with it
+  fs::path renamed_path(kRoot / "Renamed");
+  for (auto itr(std::next(std::begin(path), 2)); itr != std::end(path); ++itr)
+    renamed_path /= *itr;
+  listing_handler_->Rename(kRoot / "Level 0", kRoot / "Renamed");
+  statistics = listing_handler_->cache_statistics();
+  EXPECT_EQ(directory, listing_handler_->Get(renamed_path));
+  EXPECT_EQ(statistics.hits + 1, listing_handler_->cache_statistics().hits);
+  EXPECT_THROW(listing_handler_->Get(path), std::exception);
+
+  // 'Find' reports missing paths without throwing
+  EXPECT_EQ(directory, listing_handler_->Find(renamed_path));
+  EXPECT_TRUE(listing_handler_->Find(path) == nullptr);
+  EXPECT_TRUE(listing_handler_->Find(renamed_path / "Missing" / "Deeper") == nullptr);
+}
+
+TEST_F(DirectoryHandlerTest, BEH_RenameMovesCachedSubtree) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  const int kChildCount(50);
+  std::vector<fs::path> relative_paths;
+  listing_handler_->Add(kRoot / "Project", FileContext("Project", true));
+  listing_handler_->Add(kRoot / "Other", FileContext("Other", true));
+  for (int i(0); i != kChildCount; ++i) {
+    fs::path child("Child " + std::to_string(i));
+    listing_handler_->Add(kRoot / "Project" / child, FileContext(child, true));
+    listing_handler_->Add(kRoot / "Project" / child / "Leaf", FileContext("Leaf", true));
+    relative_paths.push_back(child / "Leaf");
+  }
+  std::vector<std::shared_ptr<Directory>> directories;
+  for (const auto& relative_path : relative_paths)
+    directories.push_back(listing_handler_->Get(kRoot / "Project" / relative_path));
+  const size_t cached_count(CachedDirectoryCount());
+
+  // The whole subtree is found under the new name, still cached, and nothing under the old one
+  listing_handler_->Rename(kRoot / "Project", kRoot / "Renamed");
+  auto statistics(listing_handler_->cache_statistics());
+  for (int i(0); i != kChildCount; ++i)
+    EXPECT_EQ(directories[i], listing_handler_->Get(kRoot / "Renamed" / relative_paths[i]));
+  EXPECT_EQ(statistics.misses, listing_handler_->cache_statistics().misses);
+  EXPECT_EQ(cached_count, CachedDirectoryCount());
+  EXPECT_TRUE(listing_handler_->Find(kRoot / "Project") == nullptr);
+
+  // Likewise when it moves to a different parent
+  listing_handler_->Rename(kRoot / "Renamed", kRoot / "Other" / "Moved");
+  for (int i(0); i != kChildCount; ++i) {
+    EXPECT_EQ(directories[i],
+              listing_handler_->Get(kRoot / "Other" / "Moved" / relative_paths[i]));
+  }
+  EXPECT_EQ(statistics.misses, listing_handler_->cache_statistics().misses);
+  EXPECT_EQ(cached_count, CachedDirectoryCount());
+  EXPECT_TRUE(listing_handler_->Find(kRoot / "Renamed") == nullptr);
+
+  // Deleting a directory drops its entry
+  listing_handler_->Delete(kRoot / "Other" / "Moved" / relative_paths.front());
+  EXPECT_EQ(cached_count - 1, CachedDirectoryCount());
+}
+
+TEST_F(DirectoryHandlerTest, BEH_ConcurrentColdGets) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  const int kDepth(5);
+  fs::path path(kRoot);
+  for (int i(0); i != kDepth; ++i) {
+    path /= "Level " + std::to_string(i);
+    listing_handler_->Add(path, FileContext(path.filename(), true));
+  }
+  listing_handler_->FlushAll();
+  WaitForStores();
+  SetMaxCachedDirectories(2);
+  listing_handler_->Add(kRoot / "Other", FileContext("Other", true));
+  SetMaxCachedDirectories(kMaxCachedDirectories);
+
+  // Every directory on the path is fetched once, however many lookups race for it
+  auto statistics(listing_handler_->cache_statistics());
+  std::vector<std::shared_ptr<Directory>> directories(8);
+  std::vector<std::thread> threads;
+  for (auto& directory : directories)
+    threads.emplace_back([&] { directory = listing_handler_->Get(path); });
+  for (auto& thread : threads)
+    thread.join();
+  for (const auto& directory : directories)
+    EXPECT_EQ(directories.front(), directory);
+  EXPECT_EQ(statistics.misses + kDepth, listing_handler_->cache_statistics().misses);
+}
+
+TEST_F(DirectoryHandlerTest, BEH_PrefetchChildDirectories) {
+  listing_handler_ = detail::DirectoryHandler<nfs::FakeStore>::Create(
+      data_store_, unique_user_id_, root_parent_id_,
+      boost::filesystem::unique_path(GetUserAppDir() / "Buffers" / "%%%%%-%%%%%-%%%%%-%%%%%"), true,
+      asio_service_.service());
+  const int kChildCount(20);
+  fs::path parent(kRoot / "Parent");
+  listing_handler_->Add(parent, FileContext(parent.filename(), true));
+  for (int i(0); i != kChildCount; ++i) {
+    fs::path child(parent / ("Child " + std::to_string(i)));
+    listing_handler_->Add(child, FileContext(child.filename(), true));
+    listing_handler_->Add(child / "Grandchild", FileContext("Grandchild", true));
+  }
+  listing_handler_->Add(parent / "File", FileContext("File", false));
+  listing_handler_->FlushAll();
+  WaitForStores();
+  SetMaxCachedDirectories(2);
+  listing_handler_->Add(kRoot / "Other", FileContext("Other", true));
+  SetMaxCachedDirectories(kMaxCachedDirectories);
+
+  // Listing the parent fetches its child directories in the background
+  auto statistics(listing_handler_->cache_statistics());
+  listing_handler_->Get(parent);
+  listing_handler_->Prefetch(parent);
+  auto wait_for_prefetches([&](uint64_t count) {
+    for (int i(0); i != 500 && listing_handler_->cache_statistics().prefetches < count; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return listing_handler_->cache_statistics().prefetches;
+  });
+  EXPECT_EQ(statistics.prefetches + kChildCount, wait_for_prefetches(statistics.prefetches +
+                                                                     kChildCount));
+
+  // Descending into them needs no further fetch, and looks ahead to the grandchildren
+  for (int i(0); i != kChildCount; ++i)
+    listing_handler_->Get(parent / ("Child " + std::to_string(i)));
+  auto after_children(listing_handler_->cache_statistics());
+  EXPECT_EQ(statistics.misses + 1, after_children.misses);
+  EXPECT_EQ(statistics.prefetch_hits + kChildCount, after_children.prefetch_hits);
+  EXPECT_EQ(statistics.prefetches + 2 * kChildCount,
+            wait_for_prefetches(statistics.prefetches + 2 * kChildCount));
+  for (int i(0); i != kChildCount; ++i)
+    listing_handler_->Get(parent / ("Child " + std::to_string(i)) / "Grandchild");
+  EXPECT_EQ(statistics.misses + 1, listing_handler_->cache_statistics().misses);
+
+  // Cached directories aren't fetched again
+  listing_handler_->Prefetch(parent);
+  EXPECT_EQ(0U, PrefetchCount());
+}
+
 }  // namespace test
 
 }  // namespace detail
@@ -20,14 +20,23 @@
 #include <windows.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <future>
+#include <iostream>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 #include "boost/filesystem.hpp"
 #include "boost/thread.hpp"
 #include "boost/random/mersenne_twister.hpp"
 #include "boost/random/uniform_int.hpp"
 #include "boost/random/variate_generator.hpp"
 
+#include "maidsafe/common/convert.h"
 #include "maidsafe/common/crypto.h"
 #include "maidsafe/common/log.h"
 #include "maidsafe/common/test.h"
@@ -36,8 +45,10 @@
 
 #include "maidsafe/encrypt/data_map.h"
 
+#include "maidsafe/drive/listing.h"
 #include "maidsafe/drive/meta_data.h"
 #include "maidsafe/drive/directory.h"
+#include "maidsafe/drive/proto_structs.pb.h"
 #include "maidsafe/drive/utils.h"
 #include "maidsafe/drive/tests/test_utils.h"
 
@@ -59,6 +70,12 @@ inline uint64_t GetSize(const MetaData& meta_data) {
 #endif
 }
 
+// Serialises 'directory' as a store would, discarding the chunks its listing supersedes.
+std::string Serialise(const std::shared_ptr<Directory>& directory) {
+  std::vector<Identity> superseded_chunks;
+  return directory->Serialise(superseded_chunks);
+}
+
 class DirectoryTestListener
   : public std::enable_shared_from_this<DirectoryTestListener>,
     public Directory::Listener {
@@ -66,15 +83,36 @@ class DirectoryTestListener
   // Directory::Listener
   virtual void DirectoryPut(std::shared_ptr<Directory> directory) {
     LOG(kInfo) << "Putting directory.";
-    ImmutableData contents(NonEmptyString(directory->Serialise()));
+    std::vector<Identity> superseded_chunks;
+    ImmutableData contents(NonEmptyString(directory->Serialise(superseded_chunks)));
     directory->AddNewVersion(contents.name());
+    if (!superseded_chunks.empty())
+      DirectoryDecrementChunks(superseded_chunks);
   }
   virtual void DirectoryPutChunk(const ImmutableData&) {
     LOG(kInfo) << "Putting chunk.";
   }
-  virtual void DirectoryIncrementChunks(const std::vector<Identity>&) {
+  virtual void DirectoryIncrementChunks(const std::vector<Identity>& names) {
     LOG(kInfo) << "Incrementing chunks.";
+    incremented_chunks.insert(std::end(incremented_chunks), std::begin(names), std::end(names));
+  }
+  virtual void DirectoryDecrementChunks(const std::vector<Identity>& names) {
+    LOG(kInfo) << "Decrementing chunks.";
+    decremented_chunks.insert(std::end(decremented_chunks), std::begin(names), std::end(names));
   }
+  virtual encrypt::DataMap DirectoryPutPack(const std::string& content) {
+    LOG(kInfo) << "Putting pack.";
+    encrypt::DataMap data_map;
+    data_map.content.assign(std::begin(content), std::end(content));
+    return data_map;
+  }
+  virtual std::string DirectoryReadPack(const encrypt::DataMap& data_map, uint64_t offset,
+                                        uint32_t size) {
+    std::string content(std::begin(data_map.content), std::end(data_map.content));
+    return offset >= content.size() ? std::string() : content.substr(offset, size);
+  }
+
+  std::vector<Identity> incremented_chunks, decremented_chunks;
 };
 
 class DirectoryTest : public testing::Test {
@@ -143,7 +181,7 @@ class DirectoryTest : public testing::Test {
           return false;
         }
       }
-      ImmutableData contents(NonEmptyString(directory->Serialise()));
+      ImmutableData contents(NonEmptyString(Serialise(directory)));
       EXPECT_TRUE(WriteFile(path / "msdir.listing", contents.data().string()));
       directory->AddNewVersion(contents.name());
     }
@@ -178,12 +216,12 @@ class DirectoryTest : public testing::Test {
           EXPECT_TRUE(
               RemoveDirectoryListingsEntries(itr->path(), relative_path / itr->path().filename()));
           EXPECT_NO_THROW(file_context = directory->GetMutableChild(itr->path().filename()));
-          EXPECT_NO_THROW(FileContext(directory->RemoveChild(file_context->meta_data.name)));
+          EXPECT_NO_THROW(FileContext(directory->RemoveChild(file_context->meta_data.name())));
           // Remove the disk directory also
           CheckedRemove(itr->path());
         } else if (fs::is_regular_file(*itr)) {
           EXPECT_NO_THROW(file_context = directory->GetMutableChild(itr->path().filename()));
-          EXPECT_NO_THROW(FileContext(directory->RemoveChild(file_context->meta_data.name)));
+          EXPECT_NO_THROW(FileContext(directory->RemoveChild(file_context->meta_data.name())));
           // Remove the disk file also
           CheckedRemove(itr->path());
         } else {
@@ -226,9 +264,10 @@ class DirectoryTest : public testing::Test {
           EXPECT_TRUE(RenameDirectoryEntries(itr->path(), new_path));
           EXPECT_NO_THROW(file_context = directory->GetMutableChild(itr->path().filename()));
           FileContext removed_context;
-          EXPECT_NO_THROW(removed_context = directory->RemoveChild(file_context->meta_data.name));
+          EXPECT_NO_THROW(removed_context =
+                              directory->RemoveChild(file_context->meta_data.name()));
           std::string new_name(RandomAlphaNumericString(5));
-          removed_context.meta_data.name = fs::path(new_name);
+          removed_context.meta_data.SetName(fs::path(new_name));
           EXPECT_NO_THROW(directory->AddChild(std::move(removed_context)));
           // Rename corresponding directory
           CheckedRename(itr->path(), (itr->path().parent_path() / new_name));
@@ -236,9 +275,10 @@ class DirectoryTest : public testing::Test {
           if (itr->path().filename().string() != listing) {
             EXPECT_NO_THROW(file_context = directory->GetMutableChild(itr->path().filename()));
             FileContext removed_context;
-            EXPECT_NO_THROW(removed_context = directory->RemoveChild(file_context->meta_data.name));
+            EXPECT_NO_THROW(removed_context =
+                                directory->RemoveChild(file_context->meta_data.name()));
             std::string new_name(RandomAlphaNumericString(5) + ".txt");
-            removed_context.meta_data.name = fs::path(new_name);
+            removed_context.meta_data.SetName(fs::path(new_name));
             EXPECT_NO_THROW(directory->AddChild(std::move(removed_context)));
             // Rename corresponding file
             CheckedRename(itr->path(), (itr->path().parent_path() / new_name));
@@ -322,11 +362,11 @@ class DirectoryTest : public testing::Test {
         if (fs::is_directory(*itr)) {
           EXPECT_TRUE(MatchEntries(itr->path(), relative_path / itr->path().filename()));
           EXPECT_NO_THROW(file_context = directory->GetChild(itr->path().filename()));
-          EXPECT_TRUE(file_context->meta_data.name == itr->path().filename());
+          EXPECT_TRUE(file_context->meta_data.name() == itr->path().filename());
         } else if (fs::is_regular_file(*itr)) {
           if (itr->path().filename().string() != listing) {
             EXPECT_NO_THROW(file_context = directory->GetChild(itr->path().filename()));
-            EXPECT_TRUE(file_context->meta_data.name == itr->path().filename());
+            EXPECT_TRUE(file_context->meta_data.name() == itr->path().filename());
             // EXPECT_TRUE(GetSize(file_context->meta_data) ==
             // fs::file_size(itr->path()));
           }
@@ -395,14 +435,21 @@ TEST_F(DirectoryTest, BEH_DirectoryHasChild) {
 }
 
 void DirectoriesMatch(const Directory& lhs, const Directory& rhs) {
-  std::lock_guard<std::mutex> lhsLock(lhs.mutex_);
-  std::lock_guard<std::mutex> rhsLock(rhs.mutex_);
+  // Children are fetched before locking; those not looked up yet are decoded by fetching them.
+  std::vector<const FileContext*> lhs_children, rhs_children;
+  const auto lhs_listed(lhs.LoadChildren()), rhs_listed(rhs.LoadChildren());
+  for (Directory::ChildIterator child(*lhs_listed); !child.AtEnd(); ++child)
+    lhs_children.push_back(lhs.GetChild(child.name()));
+  for (Directory::ChildIterator child(*rhs_listed); !child.AtEnd(); ++child)
+    rhs_children.push_back(rhs.GetChild(child.name()));
+  boost::shared_lock<boost::shared_mutex> lhsLock(lhs.mutex_);
+  boost::shared_lock<boost::shared_mutex> rhsLock(rhs.mutex_);
   // Do not call functions on lhs and rhs, otherwise they will deadlock
   ASSERT_TRUE(lhs.directory_id_ == rhs.directory_id_) << "Directory ID mismatch.";
-  ASSERT_TRUE(lhs.children_.size() == rhs.children_.size());
-  auto itr1(lhs.children_.begin()), itr2(rhs.children_.begin());
-  for (; itr1 != lhs.children_.end(); ++itr1, ++itr2) {
-    ASSERT_TRUE((*itr1)->meta_data.name == (*itr2)->meta_data.name);
+  ASSERT_TRUE(lhs_children.size() == rhs_children.size());
+  auto itr1(lhs_children.begin()), itr2(rhs_children.begin());
+  for (; itr1 != lhs_children.end(); ++itr1, ++itr2) {
+    ASSERT_TRUE((*itr1)->meta_data.name() == (*itr2)->meta_data.name());
     EXPECT_FALSE((*itr1)->meta_data.data_map == nullptr &&
                  (*itr2)->meta_data.directory_id == nullptr);
     if ((*itr1)->meta_data.data_map) {
@@ -478,6 +525,32 @@ void SortAndResetChildrenCounter(Directory& lhs) {
     lhs.SortAndResetChildrenCounter();
 }
 
+size_t DecodedChildCount(const Directory& directory) {
+  return Directory::ContextsOf(*directory.LoadChildren()).size();
+}
+
+// Converts a binary listing to the protobuf format used before it.
+protobuf::Directory ToProtobufListing(const std::string& serialised_listing) {
+  ListingReader listing(serialised_listing);
+  protobuf::Directory proto_directory;
+  proto_directory.set_directory_id(convert::ToString(listing.directory_id().string()));
+  proto_directory.set_max_versions(listing.max_versions().data);
+  for (ListingReader::NameIterator name(listing, 0); !name.AtEnd(); ++name) {
+    std::string entry(listing.Entry(name.index()));
+    MetaData(NameFromProtobuf(name.name()), entry.data(), entry.size())
+        .ToProtobuf(proto_directory.add_children());
+  }
+  for (uint32_t i(0); i != listing.pack_count(); ++i) {
+    ListingReader::Pack pack(listing.GetPack(i));
+    auto proto_pack(proto_directory.add_packs());
+    proto_pack->set_pack_id(pack.pack_id);
+    proto_pack->set_serialised_data_map(pack.serialised_data_map);
+    proto_pack->set_size(pack.size);
+    proto_pack->set_live_size(pack.live_size);
+  }
+  return proto_directory;
+}
+
 TEST_F(DirectoryTest, BEH_SerialiseAndParse) {
   maidsafe::test::TestPath testpath(maidsafe::test::CreateTestPath("MaidSafe_Test_Drive"));
   auto directory(Directory::Create(ParentId(unique_id_),
@@ -534,7 +607,7 @@ TEST_F(DirectoryTest, BEH_SerialiseAndParse) {
 
   directory->StoreImmediatelyIfPending();
 
-  std::string serialised_directory(directory->Serialise());
+  std::string serialised_directory(Serialise(directory));
   std::vector<StructuredDataVersions::VersionName> versions;
   auto recovered_directory(Directory::Create(directory->parent_id(),
                                              serialised_directory,
@@ -545,6 +618,535 @@ TEST_F(DirectoryTest, BEH_SerialiseAndParse) {
   DirectoriesMatch(*directory, *recovered_directory);
 }
 
+TEST_F(DirectoryTest, BEH_PackedChildren) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  const std::string kContentA(RandomString(5000)), kContentB(RandomString(7000));
+  FileContext file_context_a("A", false), file_context_b("B", false);
+  file_context_a.unpacked_content.reset(new std::string(kContentA));
+  file_context_b.unpacked_content.reset(new std::string(kContentB));
+  EXPECT_NO_THROW(directory->AddChild(std::move(file_context_a)));
+  EXPECT_NO_THROW(directory->AddChild(std::move(file_context_b)));
+
+  const FileContext* child(directory->GetChild("A"));
+  ASSERT_TRUE(child->meta_data.pack_extent != nullptr);
+  EXPECT_FALSE(child->unpacked_content);
+  EXPECT_EQ(kContentA, directory->ReadPackedChild(child, 0, 5000));
+  child = directory->GetChild("B");
+  EXPECT_EQ(kContentB.substr(100, 50), directory->ReadPackedChild(child, 100, 50));
+  // Reads are clamped to the extent
+  EXPECT_EQ(kContentB.substr(6990), directory->ReadPackedChild(child, 6990, 50));
+
+  // Both children share the stored pack once the directory has been serialised
+  std::string serialised_directory(Serialise(directory));
+  std::vector<StructuredDataVersions::VersionName> versions;
+  auto recovered_directory(Directory::Create(directory->parent_id(),
+                                             serialised_directory,
+                                             versions,
+                                             asio_service_.service(),
+                                             GetListener(),
+                                             ""));
+  child = recovered_directory->GetChild("B");
+  ASSERT_TRUE(child->meta_data.pack_extent != nullptr);
+  EXPECT_EQ(recovered_directory->GetChild("A")->meta_data.pack_extent->pack_id,
+            child->meta_data.pack_extent->pack_id);
+  EXPECT_EQ(kContentB, recovered_directory->ReadPackedChild(child, 0, 7000));
+
+  // A removed child takes its content with it
+  FileContext removed_context(directory->RemoveChild("A"));
+  EXPECT_FALSE(removed_context.meta_data.pack_extent);
+  ASSERT_TRUE(removed_context.unpacked_content != nullptr);
+  EXPECT_EQ(kContentA, *removed_context.unpacked_content);
+  EXPECT_NO_THROW(directory->DeleteChild("B"));
+  EXPECT_FALSE(directory->HasChild("B"));
+}
+
+TEST_F(DirectoryTest, BEH_SealFullPacks) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  const size_t kFilesPerPack(kMaxPackSize / kMaxPackedFileSize);
+  std::vector<std::string> contents;
+  for (size_t i(0); i != kFilesPerPack + 3; ++i) {
+    contents.push_back(RandomString(kMaxPackedFileSize));
+    FileContext file_context("File " + std::to_string(i), false);
+    file_context.unpacked_content.reset(new std::string(contents.back()));
+    EXPECT_NO_THROW(directory->AddChild(std::move(file_context)));
+  }
+  auto pack_id([&](size_t i) {
+    return directory->GetChild("File " + std::to_string(i))->meta_data.pack_extent->pack_id;
+  });
+
+  // A full pending pack is sealed and a new one started, rather than further files being refused
+  for (size_t i(0); i != contents.size(); ++i)
+    ASSERT_TRUE(directory->GetChild("File " + std::to_string(i))->meta_data.pack_extent);
+  const uint32_t first_pack(pack_id(0)), second_pack(pack_id(kFilesPerPack));
+  EXPECT_EQ(first_pack, pack_id(kFilesPerPack - 1));
+  EXPECT_NE(first_pack, second_pack);
+  std::string serialised_directory(Serialise(directory));
+  EXPECT_EQ(2U, ListingReader(serialised_directory).pack_count());
+  for (size_t i(0); i < contents.size(); i += kFilesPerPack) {
+    EXPECT_EQ(contents[i], directory->ReadPackedChild(
+        directory->GetChild("File " + std::to_string(i)), 0, kMaxPackedFileSize));
+  }
+
+  // With both packs sparse, each store rewrites only the sparser one
+  for (size_t i(0); i != kFilesPerPack + 2; ++i) {
+    if (i != kFilesPerPack - 1)
+      EXPECT_NO_THROW(directory->DeleteChild("File " + std::to_string(i)));
+  }
+  Serialise(directory);
+  EXPECT_NE(first_pack, pack_id(kFilesPerPack - 1));
+  EXPECT_EQ(second_pack, pack_id(kFilesPerPack + 2));
+  Serialise(directory);
+  EXPECT_NE(second_pack, pack_id(kFilesPerPack + 2));
+  EXPECT_EQ(contents.back(), directory->ReadPackedChild(
+      directory->GetChild("File " + std::to_string(kFilesPerPack + 2)), 0, kMaxPackedFileSize));
+}
+
+TEST_F(DirectoryTest, BEH_DeltaReferenceCounts) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  std::vector<Identity> chunk_names;
+  for (char c('A'); c != 'D'; ++c) {
+    FileContext file_context(std::string(1, c), false);
+    std::string name(RandomString(64));
+    encrypt::ChunkDetails chunk;
+    chunk.hash.assign(std::begin(name), std::end(name));
+    file_context.meta_data.data_map->chunks.push_back(chunk);
+    chunk_names.emplace_back(name);
+    EXPECT_NO_THROW(directory->AddChild(std::move(file_context)));
+  }
+
+  // Untouched children need no reference count changes, however often the directory is stored
+  std::vector<Identity> superseded_chunks;
+  directory->Serialise(superseded_chunks);
+  directory->Serialise(superseded_chunks);
+  EXPECT_TRUE(listener->incremented_chunks.empty());
+  EXPECT_TRUE(superseded_chunks.empty());
+
+  // A deleted child's chunks are superseded by the next store, but left for the caller to release
+  // once that store succeeds
+  EXPECT_NO_THROW(directory->DeleteChild("B"));
+  directory->Serialise(superseded_chunks);
+  EXPECT_TRUE(listener->incremented_chunks.empty());
+  EXPECT_TRUE(listener->decremented_chunks.empty());
+  ASSERT_EQ(1U, superseded_chunks.size());
+  EXPECT_EQ(chunk_names[1], superseded_chunks.front());
+
+  // If that store fails, they're superseded by the following one instead
+  directory->RestoreSupersededChunks(superseded_chunks);
+  superseded_chunks.clear();
+  directory->Serialise(superseded_chunks);
+  ASSERT_EQ(1U, superseded_chunks.size());
+  EXPECT_EQ(chunk_names[1], superseded_chunks.front());
+}
+
+TEST_F(DirectoryTest, BEH_CompletePendingStores) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  // With no store pending, a new parent is applied immediately
+  ParentId first_parent(RandomString(64));
+  directory->SetNewParent(first_parent, "first");
+  directory->CompletePendingStores();
+  EXPECT_EQ(first_parent.data, directory->parent_id().data);
+
+  // A pending store is brought forward rather than waiting out the inactivity delay
+  EXPECT_NO_THROW(directory->AddChild(FileContext("A", false)));
+  EXPECT_TRUE(directory->HasPending());
+  ParentId second_parent(RandomString(64));
+  directory->SetNewParent(second_parent, "second");
+  auto start(std::chrono::steady_clock::now());
+  directory->CompletePendingStores();
+  EXPECT_LT(std::chrono::steady_clock::now() - start, kDirectoryInactivityDelay);
+  EXPECT_FALSE(directory->HasPending());
+  EXPECT_EQ(second_parent.data, directory->parent_id().data);
+}
+
+TEST_F(DirectoryTest, FUNC_ChildCreateAndLookupBenchmark) {
+  auto nanoseconds_each([](std::chrono::steady_clock::duration duration, size_t count) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / count;
+  });
+  for (size_t count : std::vector<size_t>{10, 10000, 1000000}) {
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (size_t i(0); i != count; ++i) {
+      std::string index(std::to_string(i));
+      names.emplace_back(std::string(7 - index.size(), '0') + index);
+    }
+    std::mt19937 generator(RandomUint32());
+
+    // Children are created in name order, as when copying in a sorted tree, then in random order,
+    // as when files are created by a build; both are looked up at random
+    for (bool sorted : { true, false }) {
+      auto directory(Directory::Create(ParentId(unique_id_),
+                                       parent_id_,
+                                       asio_service_.service(),
+                                       GetListener(),
+                                       ""));
+      if (sorted)
+        std::sort(std::begin(names), std::end(names));
+      else
+        std::shuffle(std::begin(names), std::end(names), generator);
+      auto start(std::chrono::steady_clock::now());
+      for (const auto& name : names)
+        directory->AddChild(FileContext(name, false));
+      auto create_duration(std::chrono::steady_clock::now() - start);
+
+      std::shuffle(std::begin(names), std::end(names), generator);
+      start = std::chrono::steady_clock::now();
+      for (const auto& name : names)
+        ASSERT_EQ(name, directory->GetChild(name)->meta_data.name());
+      auto lookup_duration(std::chrono::steady_clock::now() - start);
+
+      // Once stored, children are found through the listing's name index
+      Serialise(directory);
+      std::shuffle(std::begin(names), std::end(names), generator);
+      start = std::chrono::steady_clock::now();
+      for (const auto& name : names)
+        ASSERT_EQ(name, directory->GetChild(name)->meta_data.name());
+      auto listed_lookup_duration(std::chrono::steady_clock::now() - start);
+
+      std::cout << count << " children created " << (sorted ? "in order" : "at random") << ": "
+                << nanoseconds_each(create_duration, count) << " ns per create, "
+                << nanoseconds_each(lookup_duration, count) << " ns per lookup, "
+                << nanoseconds_each(listed_lookup_duration, count)
+                << " ns per lookup once stored" << std::endl;
+    }
+  }
+}
+
+TEST_F(DirectoryTest, FUNC_ConcurrentLookupBenchmark) {
+  const size_t kChildCount(1000), kThreadCount(32), kLookupsPerThread(100000);
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  std::vector<std::string> names;
+  for (size_t i(0); i != kChildCount; ++i) {
+    names.emplace_back("Child " + std::to_string(i));
+    directory->AddChild(FileContext(names.back(), false));
+  }
+
+  // Each thread repeatedly stats children of the same directory, as for a tree walk or build
+  std::vector<std::thread> threads;
+  std::atomic<size_t> failures(0);
+  auto start(std::chrono::steady_clock::now());
+  for (size_t i(0); i != kThreadCount; ++i) {
+    threads.emplace_back([&, i] {
+      std::mt19937 generator(static_cast<uint32_t>(i));
+      std::uniform_int_distribution<size_t> distribution(0, kChildCount - 1);
+      for (size_t j(0); j != kLookupsPerThread; ++j) {
+        const std::string& name(names[distribution(generator)]);
+        if (!directory->HasChild(name) || directory->GetChild(name)->meta_data.name() != name)
+          ++failures;
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  auto duration(std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(0U, failures.load());
+
+  std::cout << kThreadCount << " threads: "
+            << (kThreadCount * kLookupsPerThread * 1000) /
+                   std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::milliseconds>(
+                       duration).count())
+            << " lookups per second" << std::endl;
+}
+
+TEST_F(DirectoryTest, FUNC_MissingNameLookupBenchmark) {
+  const size_t kChildCount(1000), kProbeCount(100), kRepeats(1000);
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  for (size_t i(0); i != kChildCount; ++i)
+    directory->AddChild(FileContext("header_" + std::to_string(i) + ".h", false));
+  std::vector<std::string> missing_names;
+  for (size_t i(0); i != kProbeCount; ++i)
+    missing_names.emplace_back("missing_" + std::to_string(i) + ".h");
+
+  // As a compiler searching its include path, the same missing names are probed again and again;
+  // first through the throwing lookup, then through the non-throwing one
+  size_t failures(0);
+  auto start(std::chrono::steady_clock::now());
+  for (size_t i(0); i != kRepeats; ++i) {
+    for (const auto& name : missing_names) {
+      try {
+        directory->GetChild(name);
+        ++failures;
+      }
+      catch (const std::exception&) {}
+    }
+  }
+  auto throwing_duration(std::chrono::steady_clock::now() - start);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i(0); i != kRepeats; ++i) {
+    for (const auto& name : missing_names) {
+      if (directory->FindChild(name))
+        ++failures;
+    }
+  }
+  auto finding_duration(std::chrono::steady_clock::now() - start);
+  EXPECT_EQ(0U, failures);
+
+  const size_t kLookups(kProbeCount * kRepeats);
+  std::cout << kChildCount << " children: "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(throwing_duration).count() /
+                   kLookups << " ns per throwing lookup, "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(finding_duration).count() /
+                   kLookups << " ns per non-throwing lookup" << std::endl;
+}
+
+TEST_F(DirectoryTest, BEH_LookupsDuringMutation) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  const size_t kChildCount(100);
+  for (size_t i(0); i != kChildCount; ++i)
+    directory->AddChild(FileContext("Stable " + std::to_string(i), false));
+
+  // Readers never take the directory's lock, so the stable children must stay visible throughout
+  std::atomic<bool> done(false);
+  std::atomic<size_t> failures(0);
+  std::vector<std::thread> readers;
+  for (int i(0); i != 4; ++i) {
+    readers.emplace_back([&] {
+      while (!done) {
+        for (size_t j(0); j != kChildCount; ++j) {
+          if (!directory->HasChild("Stable " + std::to_string(j)))
+            ++failures;
+        }
+      }
+    });
+  }
+  for (int i(0); i != 200; ++i) {
+    std::string name("Transient " + std::to_string(i));
+    directory->AddChild(FileContext(name, false));
+    directory->RenameChild(name, name + " renamed");
+    directory->DeleteChild(name + " renamed");
+  }
+  done = true;
+  for (auto& reader : readers)
+    reader.join();
+  EXPECT_EQ(0U, failures.load());
+  EXPECT_FALSE(directory->HasChild("Transient 0"));
+
+  // Nor do lookups and listing wait while a store or change holds the lock
+  std::future<bool> reader;
+  std::future_status status;
+  {
+    std::lock_guard<boost::shared_mutex> lock(directory->mutex_);
+    reader = std::async(std::launch::async, [&] {
+      ResetChildrenCounter(directory);
+      return directory->HasChild("Stable 0") && !directory->empty() &&
+             directory->GetChildAndIncrementCounter() != nullptr;
+    });
+    status = reader.wait_for(std::chrono::seconds(10));
+  }
+  ASSERT_EQ(std::future_status::ready, status);
+  EXPECT_TRUE(reader.get());
+}
+
+TEST_F(DirectoryTest, BEH_SerialiseOnlyChangedChildren) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  directory->AddChild(FileContext("A", false));
+  directory->AddChild(FileContext("B", false));
+  std::string serialised_directory(Serialise(directory));
+  const FileContext* child_a(directory->GetChild("A"));
+  const FileContext* child_b(directory->GetChild("B"));
+  EXPECT_FALSE(child_a->meta_data_changed);
+  const std::string entry_a(ListingReader(serialised_directory).Entry(0));
+
+  // Handing a child out for modification doesn't mark it changed; only the modified child is
+  // serialised again, and the children keep their contexts
+  FileContext* mutable_b(directory->GetMutableChild("B"));
+  EXPECT_FALSE(child_b->meta_data_changed);
+  mutable_b->meta_data.AddHole(0, 100);
+  mutable_b->meta_data_changed = true;
+  EXPECT_FALSE(child_a->meta_data_changed);
+  serialised_directory = Serialise(directory);
+  EXPECT_EQ(child_a, directory->GetChild("A"));
+  EXPECT_EQ(child_b, directory->GetChild("B"));
+  EXPECT_FALSE(child_b->meta_data_changed);
+
+  // The assembled listing holds the updated entry
+  ListingReader listing(serialised_directory);
+  ASSERT_EQ(2U, listing.child_count());
+  EXPECT_EQ(entry_a, listing.Entry(0));
+  std::string entry_b(listing.Entry(1));
+  EXPECT_EQ(1U, MetaData("B", entry_b.data(), entry_b.size()).holes.size());
+}
+
+TEST_F(DirectoryTest, BEH_LazyChildDecoding) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  FileContext file_context_a("A", false), file_context_b("B", false);
+  file_context_a.meta_data.AddHole(0, 100);
+  file_context_b.unpacked_content.reset(new std::string(RandomString(5000)));
+  directory->AddChild(std::move(file_context_a));
+  directory->AddChild(std::move(file_context_b));
+  std::string serialised_directory(Serialise(directory));
+
+  // A loaded directory decodes only the children looked up, and reproduces its listing
+  std::vector<StructuredDataVersions::VersionName> versions;
+  auto recovered_directory(Directory::Create(directory->parent_id(), serialised_directory,
+                                             versions, asio_service_.service(), GetListener(),
+                                             ""));
+  EXPECT_TRUE(DecodedChildCount(*recovered_directory) == 0);
+  EXPECT_TRUE(recovered_directory->HasChild("A"));
+  EXPECT_FALSE(recovered_directory->HasChild("C"));
+  EXPECT_EQ(1U, DecodedChildCount(*recovered_directory));
+  EXPECT_EQ(serialised_directory, Serialise(recovered_directory));
+  EXPECT_EQ(1U, DecodedChildCount(*recovered_directory));
+  EXPECT_EQ(1U, recovered_directory->GetChild("A")->meta_data.holes.size());
+
+  // Protobuf listings are still read, have pack live sizes recounted if they weren't stored, and
+  // are rewritten in the binary format
+  protobuf::Directory proto_directory(ToProtobufListing(serialised_directory));
+  ASSERT_EQ(1, proto_directory.packs_size());
+  proto_directory.mutable_packs(0)->clear_live_size();
+  auto legacy_directory(Directory::Create(directory->parent_id(),
+                                          proto_directory.SerializeAsString(), versions,
+                                          asio_service_.service(), GetListener(), ""));
+  EXPECT_EQ(1U, legacy_directory->GetChild("A")->meta_data.holes.size());
+  std::string rewritten_directory(Serialise(legacy_directory));
+  ListingReader listing(rewritten_directory);
+  ASSERT_EQ(1U, listing.pack_count());
+  EXPECT_EQ(5000U, listing.GetPack(0).live_size);
+}
+
+TEST_F(DirectoryTest, BEH_MovedChildKeepsState) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  FileContext file_context("A", false);
+  file_context.meta_data.inline_content.reset(new std::string());
+  file_context.open_count = 2;
+  directory->AddChild(std::move(file_context));
+  Serialise(directory);
+  const FileContext* child(directory->GetChild("A"));
+  EXPECT_FALSE(child->meta_data_changed);
+  // A file which has never been opened with an encryptor carries no open file state
+  EXPECT_FALSE(child->open_file);
+
+  // The flags and open count travel with the context rather than being left behind
+  FileContext removed(directory->RemoveChild("A"));
+  EXPECT_EQ(2, removed.open_count);
+  FileContext other("B", false);
+  swap(removed, other);
+  EXPECT_EQ(0, removed.open_count);
+  EXPECT_EQ(2, other.open_count);
+}
+
+TEST_F(DirectoryTest, BEH_FindMissingChild) {
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  directory->AddChild(FileContext("A", false));
+  EXPECT_TRUE(directory->FindChild("B") == nullptr);
+  EXPECT_FALSE(directory->HasChild("B"));
+  EXPECT_THROW(directory->GetChild("B"), std::exception);
+  ASSERT_TRUE(directory->FindChild("A") != nullptr);
+  EXPECT_EQ(fs::path("A"), directory->FindChild("A")->meta_data.name());
+
+  // Names remembered as missing are found once they're added or renamed to
+  directory->AddChild(FileContext("B", false));
+  ASSERT_TRUE(directory->FindChild("B") != nullptr);
+  EXPECT_TRUE(directory->FindChild("C") == nullptr);
+  directory->RenameChild("A", "C");
+  ASSERT_TRUE(directory->FindChild("C") != nullptr);
+  EXPECT_EQ(fs::path("C"), directory->GetChild("C")->meta_data.name());
+  EXPECT_TRUE(directory->FindChild("A") == nullptr);
+  EXPECT_NO_THROW(directory->GetMutableChild("B"));
+  directory->DeleteChild("B");
+  EXPECT_TRUE(directory->FindChild("B") == nullptr);
+
+  // Beyond the limit, further missing names are still reported correctly
+  for (size_t i(0); i != kMaxCachedMissingNames + 10; ++i)
+    EXPECT_TRUE(directory->FindChild("Missing " + std::to_string(i)) == nullptr);
+  directory->AddChild(FileContext("Missing 1", false));
+  EXPECT_TRUE(directory->FindChild("Missing 1") != nullptr);
+}
+
+TEST_F(DirectoryTest, FUNC_ListingFormatBenchmark) {
+  const size_t kChildCount(100000);
+  auto directory(Directory::Create(ParentId(unique_id_),
+                                   parent_id_,
+                                   asio_service_.service(),
+                                   GetListener(),
+                                   ""));
+  for (size_t i(0); i != kChildCount; ++i) {
+    std::string index(std::to_string(i));
+    FileContext file_context("Child " + std::string(6 - index.size(), '0') + index, i % 10 == 0);
+    if (file_context.meta_data.data_map)
+      file_context.meta_data.data_map->content = GetRandomString<encrypt::ByteVector>(100);
+    directory->AddChild(std::move(file_context));
+  }
+  std::vector<StructuredDataVersions::VersionName> versions;
+  auto milliseconds([](std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+  });
+
+  // Binary: the first store encodes every entry, later ones only those changed
+  auto start(std::chrono::steady_clock::now());
+  std::string binary_listing(Serialise(directory));
+  auto binary_serialise(std::chrono::steady_clock::now() - start);
+  start = std::chrono::steady_clock::now();
+  Serialise(directory);
+  auto binary_reserialise(std::chrono::steady_clock::now() - start);
+  start = std::chrono::steady_clock::now();
+  auto binary_directory(Directory::Create(directory->parent_id(), binary_listing, versions,
+                                          asio_service_.service(), GetListener(), ""));
+  auto binary_parse(std::chrono::steady_clock::now() - start);
+
+  start = std::chrono::steady_clock::now();
+  std::string protobuf_listing(ToProtobufListing(binary_listing).SerializeAsString());
+  auto protobuf_serialise(std::chrono::steady_clock::now() - start);
+  start = std::chrono::steady_clock::now();
+  auto protobuf_directory(Directory::Create(directory->parent_id(), protobuf_listing, versions,
+                                            asio_service_.service(), GetListener(), ""));
+  auto protobuf_parse(std::chrono::steady_clock::now() - start);
+
+  EXPECT_TRUE(binary_directory->HasChild("Child 099999"));
+  EXPECT_TRUE(protobuf_directory->HasChild("Child 099999"));
+  std::cout << kChildCount << " children: binary listing " << binary_listing.size()
+            << " bytes, serialised in " << milliseconds(binary_serialise) << " ms ("
+            << milliseconds(binary_reserialise) << " ms unchanged), parsed in "
+            << milliseconds(binary_parse) << " ms; protobuf listing " << protobuf_listing.size()
+            << " bytes, serialised in " << milliseconds(protobuf_serialise)
+            << " ms (including decoding the binary entries), parsed in "
+            << milliseconds(protobuf_parse) << " ms" << std::endl;
+}
+
 TEST_F(DirectoryTest, BEH_IteratorReset) {
   auto directory(Directory::Create(ParentId(unique_id_),
                                    parent_id_,
@@ -567,41 +1169,41 @@ TEST_F(DirectoryTest, BEH_IteratorReset) {
   c = 'A';
   for (size_t i(0); i != kTestCount; ++i, ++c) {
     EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-    EXPECT_TRUE(std::string(1, c) == file_context->meta_data.name);
+    EXPECT_TRUE(std::string(1, c) == file_context->meta_data.name());
     EXPECT_TRUE(((i % 2) == 0) == (file_context->meta_data.directory_id != nullptr));
   }
 
   SortAndResetChildrenCounter(directory);
 
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("A" == file_context->meta_data.name);
+  EXPECT_TRUE("A" == file_context->meta_data.name());
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("B" == file_context->meta_data.name);
+  EXPECT_TRUE("B" == file_context->meta_data.name());
 
   // Add another element and check iterator is reset
   ++c;
   FileContext new_file_context(std::string(1, c), false);
   EXPECT_NO_THROW(directory->AddChild(std::move(new_file_context)));
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("A" == file_context->meta_data.name);
+  EXPECT_TRUE("A" == file_context->meta_data.name());
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("B" == file_context->meta_data.name);
+  EXPECT_TRUE("B" == file_context->meta_data.name());
 
   // Remove an element and check iterator is reset
   ASSERT_TRUE(directory->HasChild("C"));
   EXPECT_NO_THROW(FileContext context(directory->RemoveChild("C")));
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("A" == file_context->meta_data.name);
+  EXPECT_TRUE("A" == file_context->meta_data.name());
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("B" == file_context->meta_data.name);
+  EXPECT_TRUE("B" == file_context->meta_data.name());
 
   // Try to remove a non-existent element and check iterator is not reset
   ASSERT_FALSE(directory->HasChild("C"));
   EXPECT_THROW(FileContext context(directory->RemoveChild("C")), std::exception);
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("D" == file_context->meta_data.name);
+  EXPECT_TRUE("D" == file_context->meta_data.name());
   EXPECT_NO_THROW(file_context = directory->GetChildAndIncrementCounter());
-  EXPECT_TRUE("E" == file_context->meta_data.name);
+  EXPECT_TRUE("E" == file_context->meta_data.name());
 
   // Check operator<
   // DirectoryListing directory_listing1(Identity(crypto::Hash<crypto::SHA512>(std::string("A")))),
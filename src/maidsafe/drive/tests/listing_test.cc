@@ -0,0 +1,150 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <algorithm>
+#include <codecvt>
+#include <locale>
+#include <string>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+#include "maidsafe/drive/listing.h"
+#include "maidsafe/drive/meta_data.h"
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+namespace {
+
+std::vector<MetaData> SortedChildren(size_t count) {
+  std::vector<MetaData> children;
+  for (size_t i(0); i != count; ++i) {
+    // Shared prefixes, differing case and varying lengths exercise the name compression.
+    children.emplace_back((i % 3 == 0 ? "child " : "Child ") + std::to_string(i * 7), i % 5 == 0);
+    // Directories always report their fixed size.
+    if (!children.back().directory_id)
+      children.back().SetSize(i);
+  }
+  std::sort(std::begin(children), std::end(children));
+  return children;
+}
+
+std::string WriteListing(const DirectoryId& directory_id, const std::vector<MetaData>& children) {
+  ListingWriter writer(directory_id, MaxVersions(7));
+  for (const auto& child : children) {
+    std::string entry;
+    child.ToListingEntry(&entry);
+    writer.AddChild(child.name(), entry);
+  }
+  writer.AddPack(4, "data map", 100, 60);
+  return writer.Finish();
+}
+
+}  // unnamed namespace
+
+TEST(ListingTest, BEH_WriteAndRead) {
+  DirectoryId directory_id(RandomString(64));
+  auto children(SortedChildren(100));
+  std::string listing(WriteListing(directory_id, children));
+  ASSERT_TRUE(ListingReader::IsListing(listing));
+
+  ListingReader reader(listing);
+  EXPECT_EQ(directory_id, reader.directory_id());
+  EXPECT_EQ(7U, reader.max_versions().data);
+  ASSERT_EQ(children.size(), reader.child_count());
+  uint32_t i(0);
+  for (ListingReader::NameIterator name(reader, 0); !name.AtEnd(); ++name, ++i) {
+    ASSERT_EQ(i, name.index());
+    EXPECT_EQ(children[i].name(), NameFromProtobuf(name.name()));
+    std::string entry(reader.Entry(i));
+    MetaData parsed(children[i].name(), entry.data(), entry.size());
+    EXPECT_EQ(children[i].GetSize(), parsed.GetSize());
+    EXPECT_EQ(children[i].directory_id != nullptr, parsed.directory_id != nullptr);
+  }
+  EXPECT_EQ(children.size(), i);
+  // Iterating can start from any child
+  ListingReader::NameIterator name(reader, 37);
+  EXPECT_EQ(children[37].name(), NameFromProtobuf(name.name()));
+  ++name;
+  EXPECT_EQ(children[38].name(), NameFromProtobuf(name.name()));
+  EXPECT_TRUE(ListingReader::NameIterator(reader, reader.child_count()).AtEnd());
+
+  ASSERT_EQ(1U, reader.pack_count());
+  ListingReader::Pack pack(reader.GetPack(0));
+  EXPECT_EQ(4U, pack.pack_id);
+  EXPECT_EQ("data map", pack.serialised_data_map);
+  EXPECT_EQ(100U, pack.size);
+  EXPECT_EQ(60U, pack.live_size);
+}
+
+TEST(ListingTest, BEH_Find) {
+  auto children(SortedChildren(100));
+  std::string listing(WriteListing(DirectoryId(RandomString(64)), children));
+  ListingReader reader(listing);
+  for (uint32_t i(0); i != children.size(); ++i)
+    EXPECT_EQ(i, reader.Find(ChildName(children[i].name())));
+  EXPECT_EQ(reader.child_count(), reader.Find(ChildName("CHILD 0")));
+  EXPECT_EQ(reader.child_count(), reader.Find(ChildName("a")));
+  EXPECT_EQ(reader.child_count(), reader.Find(ChildName("zzz")));
+
+  // Names which aren't ASCII are compared by their full collation keys, consistently with the
+  // rest.  As in the drive, names
+  // are UTF-8.
+  std::locale previous_locale(
+      fs::path::imbue(std::locale(std::locale(), new std::codecvt_utf8<wchar_t>())));
+  std::vector<MetaData> mixed;
+  for (const auto& name : {"ab", "Ab", "_b", "[", "\xc3\xa9t\xc3\xa9", "z", "Z\xc3\xa9",
+                           "\xe2\x82\xac"})
+    mixed.emplace_back(name, false);
+  std::sort(std::begin(mixed), std::end(mixed));
+  std::string mixed_listing(WriteListing(DirectoryId(RandomString(64)), mixed));
+  ListingReader mixed_reader(mixed_listing);
+  for (uint32_t i(0); i != mixed.size(); ++i)
+    EXPECT_EQ(i, mixed_reader.Find(ChildName(mixed[i].name())));
+  EXPECT_EQ(mixed_reader.child_count(), mixed_reader.Find(ChildName("\xc3\xa9")));
+  fs::path::imbue(previous_locale);
+
+  std::string empty_listing(WriteListing(DirectoryId(RandomString(64)), {}));
+  EXPECT_EQ(0U, ListingReader(empty_listing).Find(ChildName("a")));
+}
+
+TEST(ListingTest, BEH_RejectMalformed) {
+  std::string listing(WriteListing(DirectoryId(RandomString(64)), SortedChildren(20)));
+  EXPECT_FALSE(ListingReader::IsListing("Not a listing"));
+  EXPECT_THROW(ListingReader reader(listing.substr(0, listing.size() - 1)), std::exception);
+  std::string unknown_version(listing);
+  unknown_version[4] = 3;
+  EXPECT_THROW(ListingReader reader(unknown_version), std::exception);
+}
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
@@ -0,0 +1,224 @@
+/*  Copyright 2014 MaidSafe.net limited
+
+    This MaidSafe Software is licensed to you under (1) the MaidSafe.net Commercial License,
+    version 1.0 or later, or (2) The General Public License (GPL), version 3, depending on which
+    licence you accepted on initial access to the Software (the "Licences").
+
+    By contributing code to the MaidSafe Software, or to this project generally, you agree to be
+    bound by the terms of the MaidSafe Contributor Agreement, version 1.0, found in the root
+    directory of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also
+    available at: http://www.maidsafe.net/licenses
+
+    Unless required by applicable law or agreed to in writing, the MaidSafe Software distributed
+    under the GPL Licence is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS
+    OF ANY KIND, either express or implied.
+
+    See the Licences for the specific language governing permissions and limitations relating to
+    use of the MaidSafe Software.                                                                 */
+
+#include <algorithm>
+#include <string>
+
+#include "maidsafe/common/test.h"
+
+#include "maidsafe/drive/listing.h"
+#include "maidsafe/drive/meta_data.h"
+#include "maidsafe/drive/proto_structs.pb.h"
+
+namespace maidsafe {
+
+namespace drive {
+
+namespace detail {
+
+namespace test {
+
+#ifndef MAIDSAFE_WIN32
+namespace {
+
+timespec& LastWriteTime(MetaData& meta_data) {
+#ifdef MAIDSAFE_APPLE
+  return meta_data.attributes.st_mtimespec;
+#else
+  return meta_data.attributes.st_mtim;
+#endif
+}
+
+}  // unnamed namespace
+#endif
+
+TEST(MetaDataTest, BEH_AddAndRemoveHoles) {
+  MetaData meta_data("file", false);
+  meta_data.AddHole(10, 10);
+  meta_data.AddHole(30, 10);
+  // Adjacent holes are merged.
+  meta_data.AddHole(20, 5);
+  ASSERT_EQ(2U, meta_data.holes.size());
+  EXPECT_EQ(15U, meta_data.holes[10]);
+  EXPECT_EQ(10U, meta_data.holes[30]);
+  // Overlapping holes are merged.
+  meta_data.AddHole(5, 40);
+  ASSERT_EQ(1U, meta_data.holes.size());
+  EXPECT_EQ(40U, meta_data.holes[5]);
+  // Removing from the middle splits a hole.
+  meta_data.RemoveHoles(10, 5);
+  ASSERT_EQ(2U, meta_data.holes.size());
+  EXPECT_EQ(5U, meta_data.holes[5]);
+  EXPECT_EQ(30U, meta_data.holes[15]);
+  meta_data.TrimHoles(20);
+  ASSERT_EQ(2U, meta_data.holes.size());
+  EXPECT_EQ(5U, meta_data.holes[15]);
+
+  std::string data(30, 'x');
+  meta_data.ZeroFillHoles(&data[0], static_cast<uint32_t>(data.size()), 0);
+  const std::string kZeros(5, '\0');
+  EXPECT_EQ(std::string(5, 'x') + kZeros + std::string(5, 'x') + kZeros + std::string(10, 'x'),
+            data);
+  data.assign(10, 'x');
+  meta_data.ZeroFillHoles(&data[0], static_cast<uint32_t>(data.size()), 12);
+  EXPECT_EQ(std::string(3, 'x') + kZeros + std::string(2, 'x'), data);
+
+  // Only ranges entirely within one hole are holes.
+  EXPECT_TRUE(meta_data.IsHole(5, 5));
+  EXPECT_TRUE(meta_data.IsHole(16, 2));
+  EXPECT_FALSE(meta_data.IsHole(8, 5));
+  EXPECT_FALSE(meta_data.IsHole(0, 1));
+  EXPECT_FALSE(meta_data.IsHole(19, 2));
+  meta_data.RemoveHoles(0, 100);
+  EXPECT_TRUE(meta_data.holes.empty());
+  EXPECT_FALSE(meta_data.IsHole(16, 2));
+}
+
+TEST(MetaDataTest, BEH_SerialiseHoles) {
+  MetaData meta_data("file", false);
+  meta_data.SetSize(1000);
+  meta_data.AddHole(100, 200);
+  meta_data.AddHole(500, 100);
+  protobuf::MetaData proto_meta_data;
+  meta_data.ToProtobuf(&proto_meta_data);
+  MetaData parsed(proto_meta_data);
+  EXPECT_EQ(1000U, parsed.GetSize());
+  EXPECT_TRUE(meta_data.holes == parsed.holes);
+}
+
+TEST(MetaDataTest, BEH_SerialiseInlineContent) {
+  MetaData meta_data("file", false);
+  protobuf::MetaData proto_meta_data;
+  meta_data.ToProtobuf(&proto_meta_data);
+  EXPECT_FALSE(MetaData(proto_meta_data).inline_content);
+
+  meta_data.inline_content.reset(new std::string("content"));
+  proto_meta_data.Clear();
+  meta_data.ToProtobuf(&proto_meta_data);
+  MetaData parsed(proto_meta_data);
+  ASSERT_TRUE(parsed.inline_content != nullptr);
+  EXPECT_EQ(*meta_data.inline_content, *parsed.inline_content);
+
+  MetaData directory("directory", true);
+  proto_meta_data.Clear();
+  directory.ToProtobuf(&proto_meta_data);
+  proto_meta_data.set_inline_content("content");
+  EXPECT_THROW(MetaData parsed_directory(proto_meta_data), std::exception);
+}
+
+TEST(MetaDataTest, BEH_SerialisePackExtent) {
+  MetaData meta_data("file", false);
+  meta_data.pack_extent.reset(new PackExtent(3, 5000, 7000));
+  protobuf::MetaData proto_meta_data;
+  meta_data.ToProtobuf(&proto_meta_data);
+  MetaData parsed(proto_meta_data);
+  ASSERT_TRUE(parsed.pack_extent != nullptr);
+  EXPECT_EQ(3U, parsed.pack_extent->pack_id);
+  EXPECT_EQ(5000U, parsed.pack_extent->offset);
+  EXPECT_EQ(7000U, parsed.pack_extent->length);
+
+  // A file can't be both inline and packed
+  proto_meta_data.set_inline_content("content");
+  EXPECT_THROW(MetaData inline_and_packed(proto_meta_data), std::exception);
+}
+
+TEST(MetaDataTest, BEH_CollationOrder) {
+  MetaData lower_a("a", false), upper_a("A", false), upper_b("B", false), underscore("_", false);
+  EXPECT_TRUE(upper_a < lower_a);
+  EXPECT_FALSE(lower_a < upper_a);
+  EXPECT_TRUE(lower_a < upper_b);
+  EXPECT_TRUE(upper_b < underscore);
+  EXPECT_EQ(0, CompareCollation(lower_a.collation_key(), lower_a.name(), CollationKey("a"), "a"));
+
+  // The key follows renames and survives a protobuf round trip
+  lower_a.SetName("c");
+  EXPECT_TRUE(upper_b < lower_a);
+  protobuf::MetaData proto_meta_data;
+  lower_a.ToProtobuf(&proto_meta_data);
+  MetaData parsed(proto_meta_data);
+  EXPECT_EQ(lower_a.collation_key(), parsed.collation_key());
+}
+
+TEST(MetaDataTest, BEH_SerialiseListingEntry) {
+  MetaData meta_data("file", false);
+  meta_data.SetSize(1000);
+  meta_data.AddHole(100, 200);
+  meta_data.pack_extent.reset(new PackExtent(3, 5000, 7000));
+  std::string entry;
+  meta_data.ToListingEntry(&entry);
+  MetaData parsed("file", entry.data(), entry.size());
+  EXPECT_EQ(1000U, parsed.GetSize());
+  EXPECT_TRUE(meta_data.holes == parsed.holes);
+  ASSERT_TRUE(parsed.pack_extent != nullptr);
+  EXPECT_EQ(3U, parsed.pack_extent->pack_id);
+  EXPECT_EQ(5000U, parsed.pack_extent->offset);
+  EXPECT_EQ(7000U, parsed.pack_extent->length);
+  EXPECT_TRUE(parsed.last_write_posix_time() == meta_data.last_write_posix_time());
+
+  // Unknown extras are skipped
+  entry.append(1, static_cast<char>(100));
+  AppendUint32(3, &entry);
+  entry.append("new");
+  EXPECT_EQ(7000U, MetaData("file", entry.data(), entry.size()).pack_extent->length);
+
+  MetaData directory("directory", true);
+  entry.clear();
+  directory.ToListingEntry(&entry);
+  MetaData parsed_directory("directory", entry.data(), entry.size());
+  ASSERT_TRUE(parsed_directory.directory_id != nullptr);
+  EXPECT_EQ(*directory.directory_id, *parsed_directory.directory_id);
+  EXPECT_TRUE(parsed_directory.data_map == nullptr);
+
+  // A directory can't have inline content, and a truncated entry is rejected
+  AppendListingExtra(ListingExtra::kInlineContent, "content", &entry);
+  EXPECT_THROW(MetaData inline_directory("directory", entry.data(), entry.size()),
+               std::exception);
+  EXPECT_THROW(MetaData truncated("directory", entry.data(), entry.size() - 1), std::exception);
+}
+
+#ifndef MAIDSAFE_WIN32
+TEST(MetaDataTest, BEH_ListingEntryTimePrecision) {
+  MetaData meta_data("file", false);
+  LastWriteTime(meta_data).tv_sec = 1400000000;
+  LastWriteTime(meta_data).tv_nsec = 123456789;
+  std::string entry;
+  meta_data.ToListingEntry(&entry);
+  MetaData parsed("file", entry.data(), entry.size());
+  EXPECT_EQ(1400000000, LastWriteTime(parsed).tv_sec);
+  EXPECT_EQ(123456789, LastWriteTime(parsed).tv_nsec);
+
+  // Times read from a protobuf entry keep any fractional seconds
+  protobuf::MetaData proto_meta_data;
+  meta_data.ToProtobuf(&proto_meta_data);
+  proto_meta_data.mutable_attributes_archive()->set_last_write_time("20140513T165320,5");
+  MetaData parsed_protobuf(proto_meta_data);
+  EXPECT_EQ(500000000, LastWriteTime(parsed_protobuf).tv_nsec);
+
+  // Updating the last write time keeps sub-second precision and also sets the status change time
+  meta_data.UpdateLastModifiedTime();
+  EXPECT_TRUE(meta_data.creation_posix_time() == meta_data.last_write_posix_time());
+}
+#endif
+
+}  // namespace test
+
+}  // namespace detail
+
+}  // namespace drive
+
+}  // namespace maidsafe
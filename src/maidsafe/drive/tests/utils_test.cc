@@ -209,6 +209,21 @@ TEST(MaskMatchTest, BEH_MaskMatch) {
 #endif  // MAIDSAFE_WIN32
 }
 
+TEST(ChunkDiffTest, BEH_DiffChunks) {
+  ChunkDiff diff(DiffChunks(std::vector<std::string>(), std::vector<std::string>()));
+  EXPECT_TRUE(diff.added.empty() && diff.kept.empty() && diff.dropped.empty());
+
+  std::vector<std::string> before{"b", "c", "e", "g"}, after{"a", "c", "d", "g", "h"};
+  diff = DiffChunks(before, after);
+  EXPECT_EQ((std::vector<std::string>{"a", "d", "h"}), diff.added);
+  EXPECT_EQ((std::vector<std::string>{"c", "g"}), diff.kept);
+  EXPECT_EQ((std::vector<std::string>{"b", "e"}), diff.dropped);
+
+  diff = DiffChunks(before, std::vector<std::string>());
+  EXPECT_TRUE(diff.added.empty() && diff.kept.empty());
+  EXPECT_EQ(before, diff.dropped);
+}
+
 }  // namespace test
 
 }  // namespace detail
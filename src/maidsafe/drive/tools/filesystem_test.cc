@@ -833,6 +833,23 @@ TEST(FileSystemTest, BEH_CreateFileModifyThenRead) {
   ASSERT_TRUE(ReadFile(filepath_and_contents.first).string() == filepath_and_contents.second);
 }
 
+TEST(FileSystemTest, BEH_OpenThenTruncateToZero) {
+  on_scope_exit cleanup(clean_root);
+  auto filepath_and_contents(CreateFile(g_root, (RandomUint32() % 1048576) + 1048577));
+  std::fstream stream(filepath_and_contents.first.c_str(),
+                      std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+  ASSERT_TRUE(stream.is_open());
+
+  // The content is discarded while the file is open, and the open file can still be written
+  fs::resize_file(filepath_and_contents.first, 0);
+  EXPECT_EQ(0U, fs::file_size(filepath_and_contents.first));
+  std::string content(RandomString(5000));
+  stream.write(content.c_str(), content.size());
+  ASSERT_TRUE(!stream.bad());
+  stream.close();
+  EXPECT_EQ(content, ReadFile(filepath_and_contents.first).string());
+}
+
 TEST(FileSystemTest, BEH_RenameFileToDifferentParentDirectory) {
   // Create a file in a newly created directory in 'g_temp'
   on_scope_exit cleanup(clean_root);
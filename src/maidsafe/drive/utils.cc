@@ -124,6 +124,27 @@ bool MatchesMask(std::wstring mask, const boost::filesystem::path& file_name) {
   return result;
 }
 
+ChunkDiff DiffChunks(const std::vector<std::string>& before,
+                     const std::vector<std::string>& after) {
+  assert(std::is_sorted(std::begin(before), std::end(before)));
+  assert(std::is_sorted(std::begin(after), std::end(after)));
+  ChunkDiff diff;
+  auto before_itr(std::begin(before)), after_itr(std::begin(after));
+  while (before_itr != std::end(before) && after_itr != std::end(after)) {
+    if (*before_itr < *after_itr) {
+      diff.dropped.push_back(*before_itr++);
+    } else if (*after_itr < *before_itr) {
+      diff.added.push_back(*after_itr++);
+    } else {
+      diff.kept.push_back(*after_itr++);
+      ++before_itr;
+    }
+  }
+  diff.dropped.insert(std::end(diff.dropped), before_itr, std::end(before));
+  diff.added.insert(std::end(diff.added), after_itr, std::end(after));
+  return diff;
+}
+
 }  // namespace detail
 
 }  // namespace drive